@@ -0,0 +1,94 @@
+#include "finger.h"
+
+// Per-run arena
+// Bump allocator for the variable-length strings of UserInfo records. Memory
+// is taken from a list of chunks and only given back all at once, by
+// arena_reset() or arena_free(). A mutex keeps it usable from the probe
+// worker threads.
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t used;
+    size_t size;
+    max_align_t data[]; // Keeps every allocation suitably aligned
+};
+
+void arena_init(Arena *arena) {
+    memset(arena, 0, sizeof(*arena));
+    pthread_mutex_init(&arena->lock, NULL);
+}
+
+// Allocate `size` bytes that live until the arena is reset or freed
+void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+
+    pthread_mutex_lock(&arena->lock);
+    ArenaChunk *chunk = arena->chunks;
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        chunk = malloc(sizeof(ArenaChunk) + chunk_size);
+        if (chunk == NULL) {
+            perror("Error allocating memory for arena");
+            exit(EXIT_FAILURE);
+        }
+        chunk->size = chunk_size;
+        chunk->used = 0;
+
+        // An oversized chunk goes behind the current one so its free space is not lost
+        if (arena->chunks != NULL && size > ARENA_CHUNK_SIZE) {
+            chunk->next = arena->chunks->next;
+            arena->chunks->next = chunk;
+        } else {
+            chunk->next = arena->chunks;
+            arena->chunks = chunk;
+        }
+    }
+
+    void *ptr = (char *)chunk->data + chunk->used;
+    chunk->used += size;
+    arena->total += size;
+    pthread_mutex_unlock(&arena->lock);
+    return ptr;
+}
+
+char *arena_strndup(Arena *arena, const char *str, size_t len) {
+    char *copy = arena_alloc(arena, len + 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+char *arena_strdup(Arena *arena, const char *str) {
+    return arena_strndup(arena, str, strlen(str));
+}
+
+// Drop every allocation but keep one chunk for reuse
+void arena_reset(Arena *arena) {
+    pthread_mutex_lock(&arena->lock);
+    ArenaChunk *keep = arena->chunks;
+    if (keep != NULL) {
+        ArenaChunk *chunk = keep->next;
+        while (chunk != NULL) {
+            ArenaChunk *next = chunk->next;
+            free(chunk);
+            chunk = next;
+        }
+        keep->next = NULL;
+        keep->used = 0;
+    }
+    arena->total = 0;
+    pthread_mutex_unlock(&arena->lock);
+}
+
+void arena_free(Arena *arena) {
+    ArenaChunk *chunk = arena->chunks;
+    while (chunk != NULL) {
+        ArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    pthread_mutex_destroy(&arena->lock);
+    memset(arena, 0, sizeof(*arena));
+}
@@ -0,0 +1,153 @@
+// Benchmark runner
+// Runs a command RUNS times with its output sent to /dev/null and reports
+// the median wall time and the peak RSS (from wait4()), then runs it once
+// more under ptrace to count the system calls it makes. The traced run is
+// not timed, since tracing slows every syscall down.
+//
+//   fingerbench [-n RUNS] [-l LABEL] -- command [args ...]
+//
+// Prints one line: LABEL  wall_ms  syscalls  maxrss_kb
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Start the command with stdout and stderr on /dev/null
+static pid_t spawn(char *argv[], int traced) {
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd != -1) {
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+            close(null_fd);
+        }
+        if (traced) {
+            ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+            raise(SIGSTOP); // Let the parent set options before exec
+        }
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+// One timed run; returns the wall time and stores the peak RSS in KiB
+static double timed_run(char *argv[], long *maxrss) {
+    int status;
+    struct rusage usage;
+    double start = now_ms();
+    pid_t pid = spawn(argv, 0);
+    if (wait4(pid, &status, 0, &usage) == -1) {
+        perror("wait4");
+        exit(EXIT_FAILURE);
+    }
+    double elapsed = now_ms() - start;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) == 127) {
+        fprintf(stderr, "fingerbench: %s did not run\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    *maxrss = usage.ru_maxrss;
+    return elapsed;
+}
+
+// Count the syscalls of one run (every syscall stops twice: entry and exit)
+static long count_syscalls(char *argv[]) {
+    int status;
+    pid_t pid = spawn(argv, 1);
+    if (waitpid(pid, &status, 0) == -1 || !WIFSTOPPED(status)) {
+        return -1;
+    }
+    ptrace(PTRACE_SETOPTIONS, pid, NULL, (void *)(long)(PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL));
+
+    long stops = 0;
+    int signal_to_deliver = 0;
+    for (;;) {
+        if (ptrace(PTRACE_SYSCALL, pid, NULL, (void *)(long)signal_to_deliver) == -1) {
+            return -1;
+        }
+        if (waitpid(pid, &status, 0) == -1) {
+            return -1;
+        }
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            break;
+        }
+        signal_to_deliver = 0;
+        if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+            stops++;
+        } else if (WSTOPSIG(status) != SIGTRAP) {
+            signal_to_deliver = WSTOPSIG(status);
+        }
+    }
+    return (stops + 1) / 2; // exit_group() has no exit stop
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[]) {
+    int runs = 5;
+    const char *label = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "+n:l:")) != -1) {
+        switch (opt) {
+            case 'n':
+                runs = atoi(optarg);
+                break;
+            case 'l':
+                label = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n runs] [-l label] -- command [args ...]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (optind >= argc || runs < 1) {
+        fprintf(stderr, "Usage: %s [-n runs] [-l label] -- command [args ...]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    char **command = &argv[optind];
+
+    double *times = malloc(runs * sizeof(double));
+    if (times == NULL) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    long maxrss = 0;
+    for (int i = 0; i < runs; i++) {
+        long rss;
+        times[i] = timed_run(command, &rss);
+        if (rss > maxrss) {
+            maxrss = rss;
+        }
+    }
+    qsort(times, runs, sizeof(double), compare_double);
+
+    long syscalls = count_syscalls(command);
+    printf("%-28s %10.2f %10ld %10ld\n", label ? label : command[0], times[runs / 2], syscalls, maxrss);
+    free(times);
+    return EXIT_SUCCESS;
+}
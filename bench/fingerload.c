@@ -0,0 +1,301 @@
+// Finger protocol load generator
+// Keeps CONNECTIONS queries in flight against a finger daemon for SECONDS
+// (or until REQUESTS answers arrived), spread over THREADS threads that each
+// run their own epoll loop. Every query is a fresh connection, as the
+// protocol wants: connect, send the query line, read the answer until the
+// server closes. The latency of a query runs from connect() to that close.
+//
+//   fingerload [-c CONNECTIONS] [-t THREADS] [-d SECONDS] [-n REQUESTS]
+//              [-q QUERY] [-l LABEL] host port
+//
+// Prints one line: LABEL  requests  req_per_s  p50_us  p99_us  p999_us  max_us  errors
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+    int fd;
+    uint64_t start;
+    size_t sent;
+    size_t received;
+} Query;
+
+typedef struct {
+    pthread_t thread;
+    int connections;
+    uint64_t *latencies; // ns, one per answered query
+    size_t count;
+    size_t capacity;
+    uint64_t errors;
+} Worker;
+
+static struct sockaddr_storage target;
+static socklen_t target_len;
+static char request[1024];
+static size_t request_len;
+static uint64_t deadline;            // Stop starting queries at this time
+static uint64_t request_limit;       // 0: no limit
+static atomic_uint_fast64_t started; // Queries started by all threads
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Whether another query may start
+static int may_start(void) {
+    if (now_ns() >= deadline) {
+        return 0;
+    }
+    return request_limit == 0 || atomic_fetch_add(&started, 1) < request_limit;
+}
+
+// Open a connection for `query`; 0 if it is under way
+static int start_query(int epoll_fd, Query *query) {
+    query->fd = socket(target.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (query->fd == -1) {
+        return -1;
+    }
+    query->start = now_ns();
+    query->sent = 0;
+    query->received = 0;
+    if (connect(query->fd, (struct sockaddr *)&target, target_len) == -1 && errno != EINPROGRESS) {
+        close(query->fd);
+        query->fd = -1;
+        return -1;
+    }
+    struct epoll_event event = {.events = EPOLLOUT, .data.ptr = query};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, query->fd, &event) == -1) {
+        close(query->fd);
+        query->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static void record(Worker *worker, uint64_t latency) {
+    if (worker->count == worker->capacity) {
+        size_t capacity = worker->capacity ? worker->capacity * 2 : 4096;
+        uint64_t *latencies = realloc(worker->latencies, capacity * sizeof(uint64_t));
+        if (latencies == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        worker->latencies = latencies;
+        worker->capacity = capacity;
+    }
+    worker->latencies[worker->count++] = latency;
+}
+
+// Advance `query` after an event; 1 once it is finished (answered or failed)
+static int step_query(int epoll_fd, Worker *worker, Query *query, uint32_t events) {
+    if (query->sent < request_len) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if ((events & EPOLLERR) || getsockopt(query->fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error != 0) {
+            worker->errors++;
+            return 1;
+        }
+        ssize_t n = send(query->fd, request + query->sent, request_len - query->sent, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EINTR) {
+                return 0;
+            }
+            worker->errors++;
+            return 1;
+        }
+        query->sent += (size_t)n;
+        if (query->sent == request_len) {
+            struct epoll_event event = {.events = EPOLLIN, .data.ptr = query};
+            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, query->fd, &event);
+        }
+        return 0;
+    }
+
+    char buffer[16384];
+    for (;;) {
+        ssize_t n = recv(query->fd, buffer, sizeof(buffer), 0);
+        if (n > 0) {
+            query->received += (size_t)n;
+            continue;
+        }
+        if (n == 0) {
+            if (query->received == 0) {
+                worker->errors++; // Closed without an answer
+            } else {
+                record(worker, now_ns() - query->start);
+            }
+            return 1;
+        }
+        if (errno == EAGAIN || errno == EINTR) {
+            return 0;
+        }
+        worker->errors++;
+        return 1;
+    }
+}
+
+static void *run_worker(void *arg) {
+    Worker *worker = arg;
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    Query *queries = calloc((size_t)worker->connections, sizeof(Query));
+    if (epoll_fd == -1 || queries == NULL) {
+        perror("fingerload");
+        exit(EXIT_FAILURE);
+    }
+
+    int active = 0;
+    for (int i = 0; i < worker->connections; i++) {
+        queries[i].fd = -1;
+        if (may_start()) {
+            if (start_query(epoll_fd, &queries[i]) == 0) {
+                active++;
+            } else {
+                worker->errors++;
+            }
+        }
+    }
+
+    struct epoll_event events[256];
+    while (active > 0) {
+        int ready = epoll_wait(epoll_fd, events, 256, 1000);
+        for (int i = 0; i < ready; i++) {
+            Query *query = events[i].data.ptr;
+            if (!step_query(epoll_fd, worker, query, events[i].events)) {
+                continue;
+            }
+            close(query->fd); // Also drops it from the epoll set
+            query->fd = -1;
+            active--;
+            // Keep the slot busy; a failed start counts and is retried on the next event
+            while (may_start()) {
+                if (start_query(epoll_fd, query) == 0) {
+                    active++;
+                    break;
+                }
+                worker->errors++;
+            }
+        }
+    }
+    close(epoll_fd);
+    free(queries);
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Latency at quantile `q` of the sorted samples, in microseconds
+static double quantile_us(const uint64_t *sorted, size_t count, double q) {
+    if (count == 0) {
+        return 0;
+    }
+    size_t i = (size_t)(q * (double)(count - 1) + 0.5);
+    return (double)sorted[i] / 1e3;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-c CONNECTIONS] [-t THREADS] [-d SECONDS] [-n REQUESTS] [-q QUERY] [-l LABEL] host port\n", name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int connections = 64;
+    int threads = 4;
+    double seconds = 5;
+    const char *query = "";
+    const char *label = "fingerload";
+    int opt;
+    while ((opt = getopt(argc, argv, "c:t:d:n:q:l:")) != -1) {
+        switch (opt) {
+            case 'c': connections = atoi(optarg); break;
+            case 't': threads = atoi(optarg); break;
+            case 'd': seconds = atof(optarg); break;
+            case 'n': request_limit = strtoull(optarg, NULL, 10); break;
+            case 'q': query = optarg; break;
+            case 'l': label = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2 || connections < 1 || threads < 1 || seconds <= 0) {
+        usage(argv[0]);
+    }
+    if (threads > connections) {
+        threads = connections;
+    }
+
+    struct addrinfo hints = {.ai_socktype = SOCK_STREAM};
+    struct addrinfo *result;
+    int rc = getaddrinfo(argv[optind], argv[optind + 1], &hints, &result);
+    if (rc != 0) {
+        fprintf(stderr, "fingerload: %s: %s\n", argv[optind], gai_strerror(rc));
+        return EXIT_FAILURE;
+    }
+    memcpy(&target, result->ai_addr, result->ai_addrlen);
+    target_len = result->ai_addrlen;
+    freeaddrinfo(result);
+    request_len = (size_t)snprintf(request, sizeof(request), "%s\r\n", query);
+    if (request_len >= sizeof(request)) {
+        fprintf(stderr, "fingerload: query too long\n");
+        return EXIT_FAILURE;
+    }
+
+    Worker *workers = calloc((size_t)threads, sizeof(Worker));
+    if (workers == NULL) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+    uint64_t begin = now_ns();
+    deadline = begin + (uint64_t)(seconds * 1e9);
+    for (int i = 0; i < threads; i++) {
+        workers[i].connections = connections / threads + (i < connections % threads);
+        if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0) {
+            perror("pthread_create");
+            return EXIT_FAILURE;
+        }
+    }
+
+    size_t total = 0;
+    uint64_t errors = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        total += workers[i].count;
+        errors += workers[i].errors;
+    }
+    double elapsed = (double)(now_ns() - begin) / 1e9;
+
+    uint64_t *all = malloc((total ? total : 1) * sizeof(uint64_t));
+    if (all == NULL) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    size_t n = 0;
+    for (int i = 0; i < threads; i++) {
+        memcpy(all + n, workers[i].latencies, workers[i].count * sizeof(uint64_t));
+        n += workers[i].count;
+        free(workers[i].latencies);
+    }
+    qsort(all, total, sizeof(uint64_t), compare_u64);
+
+    printf("%-28s %10zu %10.0f %10.0f %10.0f %10.0f %10.0f %10llu\n", label, total, (double)total / elapsed,
+           quantile_us(all, total, 0.50), quantile_us(all, total, 0.99), quantile_us(all, total, 0.999),
+           total ? (double)all[total - 1] / 1e3 : 0.0, (unsigned long long)errors);
+    free(all);
+    free(workers);
+    return total > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,167 @@
+// GECOS search microbenchmark
+// Compares the per-entry byte-at-a-time strcasestr() replacement finger used
+// to fall back on, glibc's strcasestr(), and the casefind() kernels (scalar,
+// SSE2, AVX2) scanning one contiguous NUL-separated block, on synthetic
+// GECOS strings. Every method must report the same number of matching
+// entries; the time is the best of several rounds.
+//
+//   gecosbench [ENTRIES] [NEEDLE ...]
+//
+// Build: gcc -D_GNU_SOURCE -O2 -I. -o gecosbench bench/gecosbench.c casefind.c
+
+#include "finger.h"
+
+#define ROUNDS 7
+
+static const char *const first_names[] = {
+    "Alice", "Bob", "Carol", "David", "Erin", "Frank", "Grace", "Heidi",
+    "Ivan", "Judy", "Mallory", "Niaj", "Olivia", "Peggy", "Rupert", "Sybil",
+};
+
+static const char *const last_names[] = {
+    "Smith", "Johnson", "Williams", "Brown", "Jones", "Garcia", "Miller",
+    "Davis", "Rodriguez", "Martinez", "Hernandez", "Lopez", "Gonzalez",
+    "Wilson", "Anderson", "Thomas", "Taylor", "Moore", "Jackson", "Martin",
+};
+
+#define COUNT(array) (sizeof(array) / sizeof((array)[0]))
+
+// The fallback finger.c carried for systems without strcasestr()
+static char *old_strcasestr(const char *haystack, const char *needle) {
+    if (!*needle) return (char *) haystack;
+    for ( ; *haystack; ++haystack) {
+        if (tolower((unsigned char)*haystack) == tolower((unsigned char)*needle)) {
+            const char *h, *n;
+            for (h = haystack, n = needle; *h && *n; ++h, ++n) {
+                if (tolower((unsigned char)*h) != tolower((unsigned char)*n)) break;
+            }
+            if (!*n) return (char *) haystack;
+        }
+    }
+    return NULL;
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+typedef struct {
+    char *block;       // Every string, NUL-separated
+    size_t size;
+    size_t *starts;    // Offset of every string in the block
+    size_t count;
+} GecosSet;
+
+static size_t count_per_entry(const GecosSet *set, const char *needle, char *(*search)(const char *, const char *)) {
+    size_t matches = 0;
+    for (size_t i = 0; i < set->count; i++) {
+        if (search(set->block + set->starts[i], needle) != NULL) {
+            matches++;
+        }
+    }
+    return matches;
+}
+
+// One pass over the block, skipping to the next string after every hit
+static size_t count_block(const GecosSet *set, const char *folded) {
+    size_t needle_len = strlen(folded);
+    size_t matches = 0;
+    size_t offset = 0;
+    while (offset < set->size) {
+        const char *hit = casefind(set->block + offset, set->size - offset, folded, needle_len);
+        if (hit == NULL) {
+            break;
+        }
+        matches++;
+        offset = (size_t)(hit - set->block);
+        offset += strlen(set->block + offset) + 1;
+    }
+    return matches;
+}
+
+static void report(const char *name, const char *needle, double best, size_t matches, size_t bytes) {
+    printf("%-16s %-12s %10.3f ms %8.2f GB/s %8zu matches\n", name, needle, best, bytes / (best * 1e6), matches);
+}
+
+int main(int argc, char *argv[]) {
+    size_t count = argc > 1 ? (size_t)atol(argv[1]) : 100000;
+    static const char *default_needles[] = {"smith", "Rupert Mar", "zz-nowhere", "555-01"};
+    const char **needles = argc > 2 ? (const char **)&argv[2] : default_needles;
+    int needle_count = argc > 2 ? argc - 2 : (int)COUNT(default_needles);
+
+    GecosSet set = {0};
+    set.starts = malloc(count * sizeof(size_t));
+    set.block = malloc(count * 96);
+    if (set.starts == NULL || set.block == NULL) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    srand(42);
+    for (size_t i = 0; i < count; i++) {
+        set.starts[i] = set.size;
+        set.size += (size_t)sprintf(set.block + set.size, "%s %s,Room %d,555-01%02d,555-%04d",
+                                    first_names[rand() % COUNT(first_names)],
+                                    last_names[rand() % COUNT(last_names)],
+                                    rand() % 1000, rand() % 100, rand() % 10000) + 1;
+    }
+    set.count = count;
+
+    static const struct { const char *name; int kernel; } kernels[] = {
+        {"casefind-scalar", CASEFIND_SCALAR},
+        {"casefind-sse2", CASEFIND_SSE2},
+        {"casefind-avx2", CASEFIND_AVX2},
+    };
+
+    printf("%zu GECOS strings, %zu bytes\n", count, set.size);
+    for (int n = 0; n < needle_count; n++) {
+        const char *needle = needles[n];
+        char *folded = casefind_fold(strdup(needle));
+        double best;
+        size_t expected = 0;
+        size_t matches = 0;
+
+        best = 1e30;
+        for (int r = 0; r < ROUNDS; r++) {
+            double start = now_ms();
+            expected = count_per_entry(&set, needle, old_strcasestr);
+            double elapsed = now_ms() - start;
+            best = elapsed < best ? elapsed : best;
+        }
+        report("old-strcasestr", needle, best, expected, set.size);
+
+        best = 1e30;
+        for (int r = 0; r < ROUNDS; r++) {
+            double start = now_ms();
+            matches = count_per_entry(&set, needle, (char *(*)(const char *, const char *))strcasestr);
+            double elapsed = now_ms() - start;
+            best = elapsed < best ? elapsed : best;
+        }
+        report("glibc-strcasestr", needle, best, matches, set.size);
+
+        for (size_t k = 0; k < COUNT(kernels); k++) {
+            if (casefind_select(kernels[k].kernel) == -1) {
+                printf("%-16s unsupported on this CPU\n", kernels[k].name);
+                continue;
+            }
+            best = 1e30;
+            for (int r = 0; r < ROUNDS; r++) {
+                double start = now_ms();
+                matches = count_block(&set, folded);
+                double elapsed = now_ms() - start;
+                best = elapsed < best ? elapsed : best;
+            }
+            report(kernels[k].name, needle, best, matches, set.size);
+            if (matches != expected) {
+                fprintf(stderr, "%s: %zu matches for \"%s\", expected %zu\n", kernels[k].name, matches, needle, expected);
+                return EXIT_FAILURE;
+            }
+        }
+        free(folded);
+    }
+
+    free(set.block);
+    free(set.starts);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,151 @@
+// Synthetic fixtures for the finger benchmarks
+// Writes DIR/passwd, DIR/utmp, DIR/mail/<login> and DIR/home/<login>/ with
+// dotfiles, sized by the number of accounts and utmp sessions. Everything is
+// generated from a fixed seed so runs are comparable.
+//
+//   genfixtures DIR ACCOUNTS SESSIONS
+//
+// Logins are user000000, user000001, ...; real names are drawn from small
+// first/last name lists so that real-name queries match many accounts.
+// Home directories are only created for the first MAX_HOMES accounts; the
+// others point at missing directories, like stale accounts do.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <utmp.h>
+
+#define MAX_HOMES 10000
+
+static const char *const first_names[] = {
+    "Alice", "Bob", "Carol", "David", "Erin", "Frank", "Grace", "Heidi",
+    "Ivan", "Judy", "Mallory", "Niaj", "Olivia", "Peggy", "Rupert", "Sybil",
+    "Trent", "Victor", "Walter", "Yolanda",
+};
+
+static const char *const last_names[] = {
+    "Smith", "Johnson", "Williams", "Brown", "Jones", "Garcia", "Miller",
+    "Davis", "Rodriguez", "Martinez", "Hernandez", "Lopez", "Gonzalez",
+    "Wilson", "Anderson", "Thomas", "Taylor", "Moore", "Jackson", "Martin",
+    "Lee", "Perez", "Thompson", "White", "Harris", "Sanchez", "Clark",
+    "Ramirez", "Lewis", "Robinson", "Walker", "Young",
+};
+
+#define COUNT(array) (sizeof(array) / sizeof((array)[0]))
+
+static unsigned long long rng_state = 0x9e3779b97f4a7c15ULL;
+
+// xorshift64*: deterministic and good enough for fixtures
+static unsigned long next_random(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (unsigned long)((rng_state * 2685821657736338717ULL) >> 32);
+}
+
+static void die(const char *what) {
+    perror(what);
+    exit(EXIT_FAILURE);
+}
+
+static void make_dir(const char *path) {
+    if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+        die(path);
+    }
+}
+
+static void write_file(const char *path, const char *content) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        die(path);
+    }
+    fputs(content, file);
+    fclose(file);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 4) {
+        fprintf(stderr, "Usage: %s DIR ACCOUNTS SESSIONS\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char *dir = argv[1];
+    long accounts = atol(argv[2]);
+    long sessions = atol(argv[3]);
+    if (accounts <= 0 || sessions < 0) {
+        fprintf(stderr, "ACCOUNTS must be positive and SESSIONS not negative\n");
+        return EXIT_FAILURE;
+    }
+
+    char path[8192];
+    make_dir(dir);
+    snprintf(path, sizeof(path), "%s/home", dir);
+    make_dir(path);
+    snprintf(path, sizeof(path), "%s/mail", dir);
+    make_dir(path);
+
+    // passwd, plus homes with dotfiles and a mail spool for every other account
+    snprintf(path, sizeof(path), "%s/passwd", dir);
+    FILE *passwd = fopen(path, "w");
+    if (passwd == NULL) {
+        die(path);
+    }
+    for (long i = 0; i < accounts; i++) {
+        char login[32];
+        char home[4096];
+        snprintf(login, sizeof(login), "user%06ld", i);
+        snprintf(home, sizeof(home), "%s/home/%s", dir, login);
+
+        const char *first = first_names[next_random() % COUNT(first_names)];
+        const char *last = last_names[next_random() % COUNT(last_names)];
+        fprintf(passwd, "%s:x:%ld:%ld:%s %s,Room %lu,555%07lu,555%07lu:%s:/bin/sh\n",
+                login, 10000 + i, 10000 + i, first, last, next_random() % 1000,
+                next_random() % 10000000, next_random() % 10000000, home);
+
+        if (i < MAX_HOMES) {
+            make_dir(home);
+            snprintf(path, sizeof(path), "%s/.plan", home);
+            write_file(path, "Benchmark plan.\nSecond line of the plan.\n");
+            if (i % 3 == 0) {
+                snprintf(path, sizeof(path), "%s/.project", home);
+                write_file(path, "Benchmark project.\n");
+            }
+        }
+        if (i % 2 == 0) {
+            snprintf(path, sizeof(path), "%s/mail/%s", dir, login);
+            write_file(path, i % 4 == 0 ? "From someone\n" : "");
+        }
+    }
+    fclose(passwd);
+
+    // utmp: SESSIONS logins of random accounts (user000000 always has one)
+    snprintf(path, sizeof(path), "%s/utmp", dir);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        die(path);
+    }
+    time_t now = time(NULL);
+    for (long i = 0; i < sessions; i++) {
+        struct utmp ut;
+        memset(&ut, 0, sizeof(ut));
+        ut.ut_type = USER_PROCESS;
+        ut.ut_pid = (pid_t)(1000 + i);
+        long user = i == 0 ? 0 : (long)(next_random() % (unsigned long)accounts);
+        snprintf(ut.ut_user, sizeof(ut.ut_user), "user%06ld", user);
+        snprintf(ut.ut_line, sizeof(ut.ut_line), i % 2 ? "pts/%ld" : "null", i);
+        snprintf(ut.ut_id, sizeof(ut.ut_id), "%ld", i % 1000);
+        snprintf(ut.ut_host, sizeof(ut.ut_host), "10.0.%ld.%ld", (i / 256) % 256, i % 256);
+        ut.ut_tv.tv_sec = (int32_t)(now - (long)(next_random() % 86400));
+        if (write(fd, &ut, sizeof(ut)) != (ssize_t)sizeof(ut)) {
+            die(path);
+        }
+    }
+    close(fd);
+    return EXIT_SUCCESS;
+}
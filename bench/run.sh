@@ -0,0 +1,84 @@
+#!/bin/sh
+# Benchmark suite: builds finger and the bench tools, generates synthetic
+# fixtures at three sizes and reports wall time, syscalls and peak RSS for
+# an exact login lookup, a real-name lookup and the no-argument listing,
+# then runs the GECOS search microbenchmark and drives the daemon over
+# loopback, single-process and with one worker per core.
+#
+#   bench/run.sh [FIXTURE_DIR]
+#
+# RUNS (default 5) sets the timed runs per case; SIZES overrides the
+# "accounts:sessions" pairs. LOAD_SECONDS (default 5) and LOAD_CONNECTIONS
+# (default 64) shape the daemon runs.
+
+set -e
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+SRC_DIR=$(dirname "$BENCH_DIR")
+WORK_DIR=${1:-${TMPDIR:-/tmp}/finger-bench}
+RUNS=${RUNS:-5}
+SIZES=${SIZES:-"1000:10 10000:100 100000:1000"}
+CC=${CC:-gcc}
+LOAD_SECONDS=${LOAD_SECONDS:-5}
+LOAD_CONNECTIONS=${LOAD_CONNECTIONS:-64}
+
+mkdir -p "$WORK_DIR"
+$CC -D_GNU_SOURCE -O2 -pthread -o "$WORK_DIR/finger" "$SRC_DIR"/*.c
+$CC -O2 -o "$WORK_DIR/genfixtures" "$BENCH_DIR/genfixtures.c"
+$CC -O2 -o "$WORK_DIR/fingerbench" "$BENCH_DIR/fingerbench.c"
+$CC -D_GNU_SOURCE -O2 -I"$SRC_DIR" -o "$WORK_DIR/gecosbench" "$BENCH_DIR/gecosbench.c" "$SRC_DIR/casefind.c"
+$CC -O2 -pthread -o "$WORK_DIR/fingerload" "$BENCH_DIR/fingerload.c"
+
+printf '%-28s %10s %10s %10s\n' "case" "wall_ms" "syscalls" "maxrss_kb"
+for size in $SIZES; do
+    accounts=${size%%:*}
+    sessions=${size##*:}
+    fixture="$WORK_DIR/fixture-$accounts-$sessions"
+    if [ ! -f "$fixture/passwd" ]; then
+        "$WORK_DIR/genfixtures" "$fixture" "$accounts" "$sessions"
+    fi
+
+    finger="$WORK_DIR/finger -P $fixture/passwd -U $fixture/utmp -M $fixture/mail"
+    login=$(printf 'user%06d' $((accounts / 2)))
+    bench="$WORK_DIR/fingerbench -n $RUNS"
+
+    # Exact login (-m: no real-name matching), real name, a misspelled real
+    # name (-f, two letters swapped), and everyone logged in
+    $bench -l "$accounts/$sessions login" -- $finger -m "$login"
+    $bench -l "$accounts/$sessions name" -- $finger Smith
+    $bench -l "$accounts/$sessions typo" -- $finger -f Smiht
+    $bench -l "$accounts/$sessions listing" -- $finger
+done
+
+# GECOS substring search kernels against the old per-entry strcasestr()
+echo
+"$WORK_DIR/gecosbench" 100000
+
+# Daemon throughput and latency on the last fixture: a short query and a
+# long-format one, against one event loop (-N 1) and one worker per core (-N 0)
+echo
+printf '%-28s %10s %10s %10s %10s %10s %10s %10s\n' "case" "requests" "req_per_s" "p50_us" "p99_us" "p999_us" "max_us" "errors"
+for workers in 1 0; do
+    log="$WORK_DIR/fingerd.log"
+    $finger -I "$WORK_DIR/fingerd.pwindex" -N $workers -S 127.0.0.1:0 2>"$log" &
+    daemon=$!
+    port=""
+    tries=0
+    while [ -z "$port" ]; do
+        # Give up if the daemon died or has not announced its port within 10 s
+        if ! kill -0 $daemon 2>/dev/null || [ $tries -ge 100 ]; then
+            echo "fingerd did not start:" >&2
+            cat "$log" >&2
+            kill $daemon 2>/dev/null || true
+            exit 1
+        fi
+        sleep 0.1
+        tries=$((tries + 1))
+        port=$(sed -n 's/.* port \([0-9]*\).*/\1/p' "$log")
+    done
+    load="$WORK_DIR/fingerload -d $LOAD_SECONDS -c $LOAD_CONNECTIONS -t 4"
+    $load -l "fingerd -N $workers $login" -q "$login" 127.0.0.1 "$port"
+    $load -l "fingerd -N $workers /W $login" -q "/W $login" 127.0.0.1 "$port"
+    kill $daemon
+    wait $daemon || true
+done
@@ -0,0 +1,177 @@
+#include "finger.h"
+
+// Case-insensitive substring search
+// casefind() looks for an ASCII case-insensitive occurrence of a needle in a
+// byte range, which may hold many NUL-separated strings (the GECOS block of
+// the passwd index). The vector kernels compare the first and last byte of
+// the needle against 16 or 32 haystack positions at once, after folding
+// 'A'-'Z' to lowercase in the register, and only verify the candidates that
+// pass both. The kernel is picked once from what the CPU supports.
+//
+// Folding is ASCII only, which is what strcasestr() does in the C locale
+// finger runs in. A match never spans two strings: the needle has no NUL.
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+typedef const char *(*CasefindKernel)(const char *, size_t, const char *, size_t);
+
+static inline unsigned char fold(unsigned char c) {
+    return (c >= 'A' && c <= 'Z') ? (unsigned char)(c | 0x20) : c;
+}
+
+// Does `candidate` match the (lowercase) needle?
+static inline int matches_at(const char *candidate, const char *needle, size_t needle_len) {
+    for (size_t i = 0; i < needle_len; i++) {
+        if (fold((unsigned char)candidate[i]) != (unsigned char)needle[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Byte-at-a-time search, used for the tail of the vector kernels too
+static const char *casefind_scalar(const char *haystack, size_t size, const char *needle, size_t needle_len) {
+    if (needle_len > size) {
+        return NULL;
+    }
+    unsigned char first = (unsigned char)needle[0];
+    for (size_t i = 0; i + needle_len <= size; i++) {
+        if (fold((unsigned char)haystack[i]) == first && matches_at(haystack + i, needle, needle_len)) {
+            return haystack + i;
+        }
+    }
+    return NULL;
+}
+
+#ifdef HAVE_X86_KERNELS
+
+__attribute__((target("sse2")))
+static inline __m128i fold_sse2(__m128i bytes) {
+    // Signed compares: bytes >= 0x80 are negative and never uppercase
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('A' - 1)),
+                                  _mm_cmpgt_epi8(_mm_set1_epi8('Z' + 1), bytes));
+    return _mm_or_si128(bytes, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+__attribute__((target("sse2")))
+static const char *casefind_sse2(const char *haystack, size_t size, const char *needle, size_t needle_len) {
+    if (needle_len > size) {
+        return NULL;
+    }
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+
+    size_t i = 0;
+    for ( ; i + needle_len - 1 + 16 <= size; i += 16) {
+        __m128i block_first = fold_sse2(_mm_loadu_si128((const __m128i *)(haystack + i)));
+        __m128i block_last = fold_sse2(_mm_loadu_si128((const __m128i *)(haystack + i + needle_len - 1)));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first),
+                                                                  _mm_cmpeq_epi8(block_last, last)));
+        while (mask != 0) {
+            size_t bit = (size_t)__builtin_ctz(mask);
+            if (matches_at(haystack + i + bit, needle, needle_len)) {
+                return haystack + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return casefind_scalar(haystack + i, size - i, needle, needle_len);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i fold_avx2(__m256i bytes) {
+    __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(bytes, _mm256_set1_epi8('A' - 1)),
+                                     _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), bytes));
+    return _mm256_or_si256(bytes, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+}
+
+__attribute__((target("avx2")))
+static const char *casefind_avx2(const char *haystack, size_t size, const char *needle, size_t needle_len) {
+    if (needle_len > size) {
+        return NULL;
+    }
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[needle_len - 1]);
+
+    size_t i = 0;
+    for ( ; i + needle_len - 1 + 32 <= size; i += 32) {
+        __m256i block_first = fold_avx2(_mm256_loadu_si256((const __m256i *)(haystack + i)));
+        __m256i block_last = fold_avx2(_mm256_loadu_si256((const __m256i *)(haystack + i + needle_len - 1)));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(block_first, first),
+                                                                        _mm256_cmpeq_epi8(block_last, last)));
+        while (mask != 0) {
+            size_t bit = (size_t)__builtin_ctz(mask);
+            if (matches_at(haystack + i + bit, needle, needle_len)) {
+                return haystack + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return casefind_sse2(haystack + i, size - i, needle, needle_len);
+}
+
+#endif
+
+static CasefindKernel kernel;
+
+// Select a kernel (CASEFIND_AUTO picks the best one the CPU has).
+// Returns -1 if the CPU or the build does not support the requested one.
+int casefind_select(int which) {
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    int have_avx2 = __builtin_cpu_supports("avx2");
+    int have_sse2 = __builtin_cpu_supports("sse2");
+#else
+    int have_avx2 = 0;
+    int have_sse2 = 0;
+#endif
+
+    if (which == CASEFIND_AUTO) {
+        which = have_avx2 ? CASEFIND_AVX2 : have_sse2 ? CASEFIND_SSE2 : CASEFIND_SCALAR;
+    }
+    switch (which) {
+        case CASEFIND_SCALAR:
+            kernel = casefind_scalar;
+            return 0;
+#ifdef HAVE_X86_KERNELS
+        case CASEFIND_SSE2:
+            if (have_sse2) {
+                kernel = casefind_sse2;
+                return 0;
+            }
+            break;
+        case CASEFIND_AVX2:
+            if (have_avx2) {
+                kernel = casefind_avx2;
+                return 0;
+            }
+            break;
+#endif
+        default:
+            break;
+    }
+    return -1;
+}
+
+// First case-insensitive occurrence of `needle` in haystack[0, size), or NULL.
+// The needle must already be lowercase (see casefind_fold()).
+const char *casefind(const char *haystack, size_t size, const char *needle, size_t needle_len) {
+    if (needle_len == 0) {
+        return haystack;
+    }
+    if (kernel == NULL) {
+        casefind_select(CASEFIND_AUTO);
+    }
+    return kernel(haystack, size, needle, needle_len);
+}
+
+// Lowercase a needle in place for casefind()
+char *casefind_fold(char *needle) {
+    for (char *c = needle; *c != '\0'; c++) {
+        *c = (char)fold((unsigned char)*c);
+    }
+    return needle;
+}
@@ -1,131 +1,170 @@
 #include "finger.h"
-
-// Custom implementation of strcasestr if not available
-// This function searches for the string "needle" inside "haystack" ignoring case differences
-#ifndef _GNU_SOURCE
-char *strcasestr(const char *haystack, const char *needle) {
-    if (!*needle) return (char *) haystack; // If needle is empty, return haystack
-    for ( ; *haystack; ++haystack) {
-        if (tolower((unsigned char)*haystack) == tolower((unsigned char)*needle)) {
-            const char *h, *n;
-            for (h = haystack, n = needle; *h && *n; ++h, ++n) {
-                if (tolower((unsigned char)*h) != tolower((unsigned char)*n)) break;
-            }
-            if (!*n) return (char *) haystack;
-        }
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <getopt.h>
+
+// Function to get user information; -1 if the user is not in passwd
+int get_user_info(const PwIndex *index, const UtmpSnapshot *utmp, UserInfo *user, int show_plan, int long_format, int match_names) {
+    if (get_passwd_info(index, user, match_names) == -1) {
+        return -1;
     }
-    return NULL;
+    probe_user_info(utmp, user, show_plan, long_format);
+    return 0;
 }
-#endif
 
-// Function to get user information
-void get_user_info(UserInfo *user, int show_plan, int long_format, int match_names) {
-    struct passwd *pw = getpwnam(user->login_name); // Get user info from login name
+// Function to fill the passwd and GECOS fields (no filesystem access).
+// Returns -1 if the user is not in passwd (a logged-in account can be
+// missing: deleted, another -P file, an NSS outage); `user` is untouched.
+int get_passwd_info(const PwIndex *index, UserInfo *user, int match_names) {
+    const PwEntry *pw = pwindex_find_login(index, user->login_name); // Get user info from login name
     if (pw == NULL) { // If user is not found
         if (!match_names) {
-            fprintf(stderr, "User %s not found\n", user->login_name); // Print error message
-            exit(EXIT_FAILURE); // Terminate program
-        } else {
-            // Iterate over all users and try to match the real name
-            setpwent(); // Reset passwd file to beginning
-            while ((pw = getpwent()) != NULL) {
-                if (strcasestr(pw->pw_gecos, user->login_name) != NULL) { // Search login name in GECOS field
-                    // Copy login name from pw structure
-                    strncpy(user->login_name, pw->pw_name, sizeof(user->login_name) - 1);
-                    user->login_name[sizeof(user->login_name) - 1] = '\0';
-                    break;
-                }
-            }
-            endpwent(); // Close passwd file
-
-            if (pw == NULL) {
-                fprintf(stderr, "User %s not found\n", user->login_name); // Print error if user not found
-                exit(EXIT_FAILURE); // Terminate program
-            }
+            return -1;
         }
-    }
-
-    // Parse GECOS field
-    char *gecos = strdup(pw->pw_gecos); // Duplicate GECOS field
-    char *tokens[4] = {NULL, NULL, NULL, NULL};
-    int i = 0;
 
-    tokens[i++] = strtok(gecos, ","); // Split GECOS field into tokens separated by commas
-    while ((tokens[i++] = strtok(NULL, ",")) != NULL && i < 4);
-
-    // Populate user info from GECOS field and passwd structure
-    strncpy(user->real_name, tokens[0] ? tokens[0] : "", sizeof(user->real_name) - 1);
-    user->real_name[sizeof(user->real_name) - 1] = '\0';
+        // Try to match the real name in the GECOS fields
+        pw = pwindex_find_gecos(index, user->login_name);
+        if (pw == NULL) {
+            return -1;
+        }
 
-    strncpy(user->office_location, tokens[1] ? tokens[1] : "", sizeof(user->office_location) - 1);
-    user->office_location[sizeof(user->office_location) - 1] = '\0';
+        // Take the login name from the matching entry
+        user->login_name = pw_field(index, pw->login_name);
+    }
 
-    strncpy(user->office_phone, tokens[2] ? format_phone_number(tokens[2]) : "", sizeof(user->office_phone) - 1);
-    user->office_phone[sizeof(user->office_phone) - 1] = '\0';
+    // Populate user info from the GECOS fields split by the index. The strings
+    // point into the index, which outlives every UserInfo of the run.
+    user->real_name = pw_field(index, pw->real_name);
+    user->office_location = pw_field(index, pw->office_location);
 
-    strncpy(user->home_phone, tokens[3] ? format_phone_number(tokens[3]) : "", sizeof(user->home_phone) - 1);
-    user->home_phone[sizeof(user->home_phone) - 1] = '\0';
+    char phone[PHONE_NUMBER_SIZE];
+    const char *office_phone = pw_field(index, pw->office_phone);
+    user->office_phone = office_phone[0] ? arena_strdup(user->arena, format_phone_number(office_phone, phone, sizeof(phone))) : "";
 
-    free(gecos); // Free memory allocated for duplicated GECOS field
+    const char *home_phone = pw_field(index, pw->home_phone);
+    user->home_phone = home_phone[0] ? arena_strdup(user->arena, format_phone_number(home_phone, phone, sizeof(phone))) : "";
 
     // Populate remaining user info from passwd structure
-    strncpy(user->home_directory, pw->pw_dir, sizeof(user->home_directory) - 1);
-    user->home_directory[sizeof(user->home_directory) - 1] = '\0';
-
-    strncpy(user->login_shell, pw->pw_shell, sizeof(user->login_shell) - 1);
-    user->login_shell[sizeof(user->login_shell) - 1] = '\0';
-
-    // Get terminal, idle time, and login time
-    get_login_time(user->login_name, user->login_time, long_format);
-    get_idle_time(user->terminal, user->login_time, user->idle_time, long_format);
+    user->home_directory = pw_field(index, pw->home_directory);
+    user->login_shell = pw_field(index, pw->login_shell);
+    return 0;
+}
 
-    // Read additional user files like .plan, .project, and .pgpkey
-    read_user_files(user, show_plan);
+// Function to run the filesystem probes of a user (dotfiles, mail, terminals).
+// Only touches `user` and its arena, so it can run on a worker thread.
+void probe_user_info(const UtmpSnapshot *utmp, UserInfo *user, int show_plan, int long_format) {
+    // .plan, .project and .pgpkey are not read here: fprint_user_info() streams them
+    (void)show_plan;
 
     // Mail status
-    char mail_path[256];
-    snprintf(mail_path, sizeof(mail_path), "/var/mail/%s", user->login_name); // Create path to user's mail file
-    get_mail_status(mail_path, user->mail_status);
-
-    // Get terminal and write status
-    struct utmp *ut;
-    setutent(); // Reset utmp file to beginning
-    while ((ut = getutent()) != NULL) {
-        if (ut->ut_type == USER_PROCESS && strncmp(ut->ut_user, user->login_name, sizeof(ut->ut_user)) == 0) { // Search for user in utmp
-            strncpy(user->terminal, ut->ut_line, sizeof(user->terminal) - 1);
-            user->terminal[sizeof(user->terminal) - 1] = '\0';
-            user->write_status = check_write_permission(user->terminal); // Check write permissions for terminal
-            break;
+    char mail_path[PATH_MAX];
+    MailSummary mail;
+    get_mail_path(user->login_name, mail_path, sizeof(mail_path)); // Create path to user's mail file
+    uint64_t start = stats_start();
+    get_mail_status(mail_path, user->home_directory, &mail);
+    stats_stop(STAT_MAIL, start);
+    set_mail_status(user, &mail);
+
+    // Get terminal and login time of every session
+    get_user_sessions(utmp, user, long_format);
+
+    // Get idle time and write status of every session
+    for (size_t i = 0; i < user->session_count; i++) {
+        SessionInfo *session = &user->sessions[i];
+        char idle_time[64];
+        start = stats_start();
+        if (shmsnap_tty(session->terminal, &session->last_access, &session->device, &session->write_status)) {
+            // Stat()ed once for every process sharing the snapshot (-Z)
+            if (session->last_access != -1) {
+                format_idle_time(session->last_access, idle_time, long_format);
+            } else {
+                snprintf(idle_time, sizeof(idle_time), "*");
+            }
+        } else {
+            session->last_access = get_idle_time(session->terminal, session->login_time, idle_time, long_format, &session->device);
+            session->write_status = check_write_permission(session->terminal); // Check write permissions for terminal
         }
+        stats_stop(STAT_TTY, start);
+        session->idle_time = arena_strdup(user->arena, idle_time);
+        set_session_command(user, session);
+    }
+}
+
+// Function to fill the terminal and login time of every utmp session of a user
+// (no filesystem access)
+void get_user_sessions(const UtmpSnapshot *utmp, UserInfo *user, int long_format) {
+    uint64_t start = stats_start();
+    size_t count = 0;
+    for (size_t i = utmp_snapshot_first(utmp, user->login_name); i != PWINDEX_NONE; i = utmp_snapshot_next(utmp, i)) {
+        count++;
+    }
+    user->session_count = 0;
+    user->sessions = count ? arena_alloc(user->arena, count * sizeof(SessionInfo)) : NULL;
+
+    for (size_t i = utmp_snapshot_first(utmp, user->login_name); i != PWINDEX_NONE; i = utmp_snapshot_next(utmp, i)) {
+        const struct utmp *ut = &utmp->records[i];
+        SessionInfo *session = &user->sessions[user->session_count++];
+        char login_time[64];
+
+        session->terminal = arena_strndup(user->arena, ut->ut_line, strnlen(ut->ut_line, sizeof(ut->ut_line)));
+        get_login_time(ut->ut_tv.tv_sec, login_time, long_format);
+        session->login_time = arena_strdup(user->arena, login_time);
+        session->login_timestamp = ut->ut_tv.tv_sec;
+        session->idle_time = "*";
+        session->last_access = -1;
+        session->write_status = 0;
+        session->host = arena_strndup(user->arena, ut->ut_host, strnlen(ut->ut_host, sizeof(ut->ut_host)));
+        session->what = NULL;
+        session->device = 0;
     }
-    endutent(); // Close utmp file
+    stats_stop(STAT_SESSIONS, start);
 }
 
-// Function to format a phone number
-char* format_phone_number(const char *input) {
-    static char output[16]; // Static buffer for formatted output
+// Function to fill the last login of a user who has no session, from wtmp
+// (after wtmp_refresh())
+void get_last_login(UserInfo *user, int long_format) {
+    struct utmp record;
+    if (!wtmp_find(user->login_name, &record)) {
+        return;
+    }
+
+    LastLogin *last = arena_alloc(user->arena, sizeof(LastLogin));
+    char login_time[64];
+    get_login_time(record.ut_tv.tv_sec, login_time, long_format);
+    last->login_timestamp = record.ut_tv.tv_sec;
+    last->login_time = arena_strdup(user->arena, login_time);
+    last->terminal = arena_strndup(user->arena, record.ut_line, strnlen(record.ut_line, sizeof(record.ut_line)));
+    last->host = arena_strndup(user->arena, record.ut_host, strnlen(record.ut_host, sizeof(record.ut_host)));
+    user->last_login = last;
+}
+
+// Function to format a phone number into `output` (PHONE_NUMBER_SIZE bytes
+// hold every format); returns `output`
+char *format_phone_number(const char *input, char *output, size_t size) {
     size_t len = strlen(input); // Length of input string
     if (len == 11) {
-        snprintf(output, sizeof(output), "+%c-%3.3s-%3.3s-%4.4s", input[0], &input[1], &input[4], &input[7]);
+        snprintf(output, size, "+%c-%3.3s-%3.3s-%4.4s", input[0], &input[1], &input[4], &input[7]);
     } else if (len == 10) {
-        snprintf(output, sizeof(output), "%3.3s-%3.3s-%4.4s", input, &input[3], &input[6]);
+        snprintf(output, size, "%3.3s-%3.3s-%4.4s", input, &input[3], &input[6]);
     } else if (len == 7) {
-        snprintf(output, sizeof(output), "%3.3s-%4.4s", input, &input[3]);
+        snprintf(output, size, "%3.3s-%4.4s", input, &input[3]);
     } else if (len == 5) {
-        snprintf(output, sizeof(output), "x%c-%4.4s", input[0], &input[1]);
+        snprintf(output, size, "x%c-%4.4s", input[0], &input[1]);
     } else if (len == 4) {
-        snprintf(output, sizeof(output), "x%4.4s", input);
+        snprintf(output, size, "x%4.4s", input);
     } else {
-        snprintf(output, sizeof(output), "Invalid"); // If length matches no known format, return "Invalid"
+        snprintf(output, size, "Invalid"); // If length matches no known format, return "Invalid"
     }
     return output; // Return formatted phone number
 }
 
-// Function to get idle time
-void get_idle_time(const char *tty, char *login_time, char *idle_time, int long_format) {
+// Function to get idle time; returns the terminal's atime (-1 if unknown)
+// and stores the terminal's device number in `device` (0 if unknown)
+time_t get_idle_time(const char *tty, const char *login_time, char *idle_time, int long_format, dev_t *device) {
+    *device = 0;
     if (strcmp(tty, "*") == 0 || strcmp(login_time, "*") == 0) { // If terminal or login time are invalid
         snprintf(idle_time, 2, "*"); // Set idle time to "*"
-        return;
+        return -1;
     }
 
     char tty_path[256];
@@ -134,11 +173,17 @@ void get_idle_time(const char *tty, char *login_time, char *idle_time, int long_
     struct stat statbuf;
     if (stat(tty_path, &statbuf) == -1) { // Get info on terminal file
         snprintf(idle_time, 2, "*"); // If failed, set idle time to "*"
-        return;
+        return -1;
     }
 
+    format_idle_time(statbuf.st_atime, idle_time, long_format); // Use last access time of terminal file
+    *device = statbuf.st_rdev; // Joins the session to its foreground process
+    return statbuf.st_atime; // Raw value for the structured output
+}
+
+// Function to format the idle time since the last terminal access
+void format_idle_time(time_t last_access, char *idle_time, int long_format) {
     time_t now = time(NULL); // Get current time
-    time_t last_access = statbuf.st_atime; // Get last access time of terminal file
 
     int idle_seconds = (int)difftime(now, last_access); // Calculate idle time in seconds
     int minutes = idle_seconds / 60; // Convert seconds to minutes
@@ -167,68 +212,289 @@ void get_idle_time(const char *tty, char *login_time, char *idle_time, int long_
 }
 
 // Function to get login time
-void get_login_time(const char *login_name, char *login_time, int long_format) {
-    struct utmp *ut;
-    setutent(); // Reset utmp file to beginning
-    while ((ut = getutent()) != NULL) {
-        if (ut->ut_type == USER_PROCESS && strncmp(ut->ut_user, login_name, sizeof(ut->ut_user)) == 0) { // Search user in utmp
-            time_t login_timestamp = ut->ut_tv.tv_sec; // Get login timestamp
-            struct tm *login_tm = localtime(&login_timestamp); // Convert timestamp to tm struct
-
-            if (long_format) { // If long format is enabled
-                strftime(login_time, 64, "%A, %d %B %Y %H:%M:%S", login_tm); // Format login time as readable string
-            } else { // If short format is enabled
-                strftime(login_time, 64, "%b %d %H:%M", login_tm); // Format login time as short string
+void get_login_time(time_t login_timestamp, char *login_time, int long_format) {
+    struct tm login_tm;
+    localtime_r(&login_timestamp, &login_tm); // Convert timestamp to tm struct
+
+    if (long_format) { // If long format is enabled
+        strftime(login_time, 64, "%A, %d %B %Y %H:%M:%S", &login_tm); // Format login time as readable string
+    } else { // If short format is enabled
+        strftime(login_time, 64, "%b %d %H:%M", &login_tm); // Format login time as short string
+    }
+}
+
+// Read everything left in an open file into the arena, NUL-terminated
+char *read_fd_content(Arena *arena, int fd) {
+    struct stat statbuf;
+    char *buffer;
+    size_t used = 0;
+    if (fstat(fd, &statbuf) == 0 && S_ISREG(statbuf.st_mode)) {
+        // Regular file: read exactly the size it had when we opened it
+        size_t size = (size_t)statbuf.st_size;
+        buffer = arena_alloc(arena, size + 1);
+        while (used < size) {
+            ssize_t n = read(fd, buffer + used, size - used);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            used += (size_t)n;
+        }
+    } else {
+        // FIFO or device (the classic dynamic .plan): read until EOF
+        size_t capacity = 4096;
+        char *data = malloc(capacity);
+        for (;;) {
+            if (data == NULL) {
+                return NULL;
+            }
+            ssize_t n = read(fd, data + used, capacity - used);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            used += (size_t)n;
+            if (used == capacity) {
+                char *grown = realloc(data, capacity * 2);
+                if (grown == NULL) {
+                    free(data);
+                }
+                data = grown;
+                capacity *= 2;
             }
-            break;
         }
+        buffer = arena_strndup(arena, data, used);
+        free(data);
+    }
+    buffer[used] = '\0'; // Ensure null termination
+    return buffer;
+}
+
+// Dotfiles read by read_user_files(), in output order
+const char *const user_file_names[USER_FILE_COUNT] = {".plan", ".project", ".pgpkey"};
+
+// Set by the daemon: dotfiles are read on behalf of network clients
+int strict_user_files = 0;
+
+// Function to open a dotfile of the user (-1 if it cannot be served). For the
+// daemon the last component may not be a symlink, a FIFO cannot block the
+// open or the reads, and only a regular file owned by the owner of the home
+// directory is served, so a link to another user's file shows nothing.
+int open_user_file(const UserInfo *user, int file) {
+    char file_path[PATH_MAX];
+    snprintf(file_path, sizeof(file_path), "%s/%s", user->home_directory, user_file_names[file]); // Create path for the dotfile
+    if (!strict_user_files) {
+        return open(file_path, O_RDONLY | O_CLOEXEC);
     }
-    endutent(); // Close utmp file
 
-    if (ut == NULL) { // If user not found
-        snprintf(login_time, 2, "*"); // Set login time to "*"
+    int fd = open(file_path, O_RDONLY | O_CLOEXEC | O_NONBLOCK | O_NOFOLLOW);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat file_stat;
+    struct stat home_stat;
+    if (fstat(fd, &file_stat) == -1 || !S_ISREG(file_stat.st_mode) ||
+        stat(user->home_directory, &home_stat) == -1 || file_stat.st_uid != home_stat.st_uid) {
+        close(fd);
+        errno = EACCES;
+        return -1;
     }
+    return fd;
 }
 
-// Definition of read_file_content function
-void read_file_content(const char *file_path, char *buffer, size_t buffer_size) {
-    FILE *file = fopen(file_path, "r");
-    if (file) {
-        fread(buffer, 1, buffer_size - 1, file);
-        buffer[buffer_size - 1] = '\0'; // Ensure null termination
-        fclose(file);
+// Function to read one dotfile of the user whole, NUL-terminated, in the
+// arena (NULL if it cannot be opened)
+char *read_user_file(UserInfo *user, int file) {
+    int fd = open_user_file(user, file);
+    if (fd == -1) {
+        return NULL;
     }
+    char *buffer = read_fd_content(user->arena, fd);
+    close(fd);
+    return buffer;
 }
 
 // Function to read user files like .plan, .project, and .pgpkey
-void read_user_files(UserInfo *user, int show_plan) {
-    if (show_plan) {
-        char file_path[256];
-        snprintf(file_path, sizeof(file_path), "%s/.plan", user->home_directory); // Create path for .plan
-        read_file_content(file_path, user->plan, sizeof(user->plan)); // Read .plan content
+void read_user_files(UserInfo *user) {
+    uint64_t start = stats_start();
+    for (int i = 0; i < USER_FILE_COUNT; i++) {
+        user->files[i] = read_user_file(user, i); // Read dotfile content
+    }
+    user->files_loaded = 1;
+    stats_stop(STAT_DOTFILES, start);
+}
 
-        snprintf(file_path, sizeof(file_path), "%s/.project", user->home_directory); // Create path for .project
-        read_file_content(file_path, user->project, sizeof(user->project)); // Read .project content
+// Function to get a dotfile of the user, reading the dotfiles on first use
+const char *get_user_file(UserInfo *user, int file) {
+    if (!user->files_loaded) {
+        read_user_files(user);
+    }
+    return user->files[file] ? user->files[file] : "";
+}
 
-        snprintf(file_path, sizeof(file_path), "%s/.pgpkey", user->home_directory); // Create path for .pgpkey
-        read_file_content(file_path, user->pgpkey, sizeof(user->pgpkey)); // Read .pgpkey content
+// Output labels of the dotfiles, in user_file_names order
+static const char *const user_file_labels[USER_FILE_COUNT] = {"Plan", "Project", "PGP Key"};
+
+// Write `len` bytes of the mapped file `fd` to `out`. sendfile() moves them
+// from the page cache straight to the output descriptor; streams without one
+// (open_memstream) and descriptors sendfile() refuses get the mapping instead.
+static void write_file_range(FILE *out, int fd, const char *map, size_t len) {
+    off_t offset = 0;
+    int out_fd = fileno(out);
+    if (out_fd >= 0) {
+        fflush(out); // Keep the label ahead of the file bytes
+        while ((size_t)offset < len) {
+            ssize_t n = sendfile(out_fd, fd, &offset, len - (size_t)offset);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+        }
     }
+    fwrite(map + offset, 1, len - (size_t)offset, out);
 }
 
-// Function to get mail status
-void get_mail_status(const char *mail_path, char *mail_status) {
-    struct stat mail_stat;
-    if (stat(mail_path, &mail_stat) == -1) { // Get info on mail file
-        snprintf(mail_status, 16, "No Mail"); // If file doesn't exist, set status to "No Mail"
+// Function to print one dotfile section of the long format ("Plan: ..." or
+// "No Plan."). A regular file is streamed from disk without copying it into
+// memory; anything else (a FIFO .plan, say) is read from the same open.
+static void write_user_file(FILE *out, UserInfo *user, int file) {
+    const char *label = user_file_labels[file];
+    const char *content;
+
+    if (user->files_loaded) {
+        content = get_user_file(user, file); // Already read by a probe
     } else {
-        if (mail_stat.st_size == 0) { // If file exists but is empty
-            snprintf(mail_status, 16, "No Mail"); // Set status to "No Mail"
-        } else {
-            time_t last_change = mail_stat.st_mtime; // Get last modification time
-            struct tm *last_change_tm = localtime(&last_change); // Convert to tm struct
-            strftime(mail_status, 64, "Mail last read %b %d %H:%M", last_change_tm); // Format last read time
+        int fd = open_user_file(user, file);
+        if (fd == -1) {
+            fprintf(out, "No %s.\n", label);
+            return;
+        }
+
+        struct stat statbuf;
+        char *map = MAP_FAILED;
+        size_t size = 0;
+        if (fstat(fd, &statbuf) == 0 && S_ISREG(statbuf.st_mode)) {
+            size = (size_t)statbuf.st_size;
+            map = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+        }
+
+        if (map != MAP_FAILED) {
+            // Stop at a NUL byte like the "%s" of the buffered path does
+            const char *nul = size > 0 ? memchr(map, '\0', size) : NULL;
+            size_t len = nul != NULL ? (size_t)(nul - map) : size;
+            if (len == 0) {
+                fprintf(out, "No %s.\n", label);
+            } else {
+                fprintf(out, "%s: ", label);
+                write_file_range(out, fd, map, len);
+                fprintf(out, "\n");
+            }
+            if (map != NULL) {
+                munmap(map, size);
+            }
+            close(fd);
+            return;
+        }
+
+        content = read_fd_content(user->arena, fd);
+        close(fd);
+        if (content == NULL) {
+            content = "";
         }
     }
+
+    if (strcmp(content, "") == 0) {
+        fprintf(out, "No %s.\n", label);
+    } else {
+        fprintf(out, "%s: %s\n", label, content);
+    }
+}
+
+// Same, timed as a dotfile phase for --stats
+static void print_user_file(FILE *out, UserInfo *user, int file) {
+    uint64_t start = stats_start();
+    write_user_file(out, user, file);
+    stats_stop(STAT_DOTFILES, start);
+}
+
+// Directory of the mail spools (-M)
+const char *mail_directory = "/var/mail";
+
+// Function to build the path of a user's mail spool
+void get_mail_path(const char *login_name, char *mail_path, size_t size) {
+    snprintf(mail_path, size, "%s/%s", mail_directory, login_name);
+}
+
+// Function to summarize the mail of a user: the spool in mail_directory (an
+// mbox file or a Maildir), or else ~/Maildir
+void get_mail_status(const char *mail_path, const char *home_directory, MailSummary *summary) {
+    struct stat mail_stat;
+    if (stat(mail_path, &mail_stat) == 0) { // Get info on mail file
+        mail_summarize(mail_path, &mail_stat, summary);
+        return;
+    }
+
+    char maildir[PATH_MAX];
+    snprintf(maildir, sizeof(maildir), "%s/Maildir", home_directory);
+    if (stat(maildir, &mail_stat) == 0 && S_ISDIR(mail_stat.st_mode)) {
+        mail_summarize(maildir, &mail_stat, summary);
+    } else {
+        memset(summary, 0, sizeof(*summary)); // No spool at all
+    }
+}
+
+// Function to format the mail status. There is new mail when unread messages
+// were counted or, if the spool could not be read, when it changed after it
+// was last read (mtime after atime, like BSD finger).
+void format_mail_status(const MailSummary *summary, char *mail_status) {
+    if (!summary->has_mail) {
+        snprintf(mail_status, MAIL_STATUS_SIZE, "No Mail");
+        return;
+    }
+
+    char received[32];
+    char read[32];
+    struct tm tm;
+    localtime_r(&summary->received, &tm);
+    strftime(received, sizeof(received), "%b %d %H:%M", &tm);
+    localtime_r(&summary->read, &tm);
+    strftime(read, sizeof(read), "%b %d %H:%M", &tm);
+
+    int is_new = summary->counted ? summary->unread > 0 : summary->received > summary->read;
+    int len;
+    if (!is_new) {
+        len = snprintf(mail_status, MAIL_STATUS_SIZE, "Mail last read %s", read);
+    } else if (summary->read < summary->received) {
+        len = snprintf(mail_status, MAIL_STATUS_SIZE, "New mail received %s; unread since %s", received, read);
+    } else {
+        len = snprintf(mail_status, MAIL_STATUS_SIZE, "New mail received %s", received);
+    }
+
+    if (summary->counted && len > 0 && len < MAIL_STATUS_SIZE) {
+        snprintf(mail_status + len, MAIL_STATUS_SIZE - (size_t)len, " (%zu message%s, %zu unread)",
+                 summary->messages, summary->messages == 1 ? "" : "s", summary->unread);
+    }
+}
+
+// Function to store a mail summary and its text in the user record
+void set_mail_status(UserInfo *user, const MailSummary *summary) {
+    char mail_status[MAIL_STATUS_SIZE];
+    format_mail_status(summary, mail_status);
+    user->mail = *summary;
+    user->mail_status = arena_strdup(user->arena, mail_status);
+}
+
+// Function to copy the foreground command of a session's terminal (from the
+// /proc walk of ttyproc_refresh()) into the user record
+void set_session_command(UserInfo *user, SessionInfo *session) {
+    const char *command = ttyproc_find(session->device);
+    session->what = command != NULL ? arena_strdup(user->arena, command) : NULL;
 }
 
 int check_write_permission(const char *tty) {
@@ -243,299 +509,534 @@ int check_write_permission(const char *tty) {
     }
 }
 
+// Whether a file other runs share (-Z snapshot, -I index) can be believed:
+// a regular file owned by the real user or root that nobody else can write
+int file_is_trusted(const struct stat *statbuf) {
+    return S_ISREG(statbuf->st_mode) && (statbuf->st_uid == getuid() || statbuf->st_uid == 0) &&
+           (statbuf->st_mode & 022) == 0;
+}
+
+// Mirror access(W_OK) for the real uid on the mode and owner of a terminal
+// already stat()ed; `groups` are the supplementary groups of the process
+int mode_writable(mode_t mode, uid_t uid, gid_t gid, const gid_t *groups, int group_count) {
+    uid_t real_uid = getuid();
+    if (real_uid == 0) {
+        return 1; // root may write to any terminal
+    }
+    if (uid == real_uid) {
+        return (mode & S_IWUSR) != 0;
+    }
+    if (gid == getgid()) {
+        return (mode & S_IWGRP) != 0;
+    }
+    for (int i = 0; i < group_count; i++) {
+        if (groups[i] == gid) {
+            return (mode & S_IWGRP) != 0;
+        }
+    }
+    return (mode & S_IWOTH) != 0;
+}
+
 void print_user_info(UserInfo *user, int long_format, int show_plan) {
+    fprint_user_info(stdout, user, long_format, show_plan);
+}
+
+// Same as print_user_info() but to any stream (the daemon renders into memory)
+void fprint_user_info(FILE *out, UserInfo *user, int long_format, int show_plan) {
         if (long_format) {
         // Print login and name info
-        printf("Login: %-30s Name: %s\n", user->login_name, user->real_name);
+        fprintf(out, "Login: %-30s Name: %s\n", user->login_name, user->real_name);
 
         // Print directory and shell
-        printf("Directory: %-25s Shell: %s\n", user->home_directory, user->login_shell);
+        fprintf(out, "Directory: %-25s Shell: %s\n", user->home_directory, user->login_shell);
 
         // Print office and home phone
-        printf("Office: %-28s Office Phone: %-15s Home Phone: %s\n", user->office_location, user->office_phone, user->home_phone);
-
-         if (strcmp(user->login_time,"*")==0){
-            printf("Never logged in.\n");
+        fprintf(out, "Office: %-28s Office Phone: %-15s Home Phone: %s\n", user->office_location, user->office_phone, user->home_phone);
 
-         }else{
+        if (user->session_count == 0 && user->last_login != NULL) {
+            const LastLogin *last = user->last_login;
+            if (last->host[0] != '\0') {
+                fprintf(out, "Last login %s on %s from %s\n", last->login_time, last->terminal, last->host);
+            } else {
+                fprintf(out, "Last login %s on %s\n", last->login_time, last->terminal);
+            }
+        } else if (user->session_count == 0) {
+            fprintf(out, "Never logged in.\n");
+        }
 
-         // Print login time, terminal, and idle time
-        printf("On since %s on %s from \n", user->login_time, user->terminal);
-        printf("   %s idle\n", user->idle_time);}
+        // Print login time, terminal, and idle time of every session
+        for (size_t i = 0; i < user->session_count; i++) {
+            const SessionInfo *session = &user->sessions[i];
+            if (session->host[0] != '\0') {
+                fprintf(out, "On since %s on %s from %s\n", session->login_time, session->terminal, session->host);
+            } else {
+                fprintf(out, "On since %s on %s\n", session->login_time, session->terminal);
+            }
+            if (session->what != NULL) {
+                fprintf(out, "   %s idle, running %s\n", session->idle_time, session->what);
+            } else {
+                fprintf(out, "   %s idle\n", session->idle_time);
+            }
+        }
 
         // Print mail status
         if (strcmp(user->mail_status, "No mail.") == 0) {
             
         } else {
-            printf("Mail: %s\n", user->mail_status);
+            fprintf(out, "Mail: %s\n", user->mail_status);
         }
 
         // Print plan and project if requested
         if (show_plan) {
-            if (strcmp(user->plan, "") == 0) {
-                printf("No Plan.\n");
-            } else {
-                printf("Plan: %s\n", user->plan);
-            }
-
-            if (strcmp(user->project, "") == 0) {
-                printf("No Project.\n");
-            } else {
-                printf("Project: %s\n", user->project);
-            }
-
-            if (strcmp(user->pgpkey, "") == 0) {
-                printf("No PGP Key.\n");
-            } else {
-                printf("PGP Key: %s\n", user->pgpkey);
+            for (int i = 0; i < USER_FILE_COUNT; i++) {
+                print_user_file(out, user, i);
             }
         }
-        printf("\n");
+        fprintf(out, "\n");
     }
     else {
         // Print headers
-        printf("%-10s %-15s %-15s %-15s %-15s %-15s %-10s\n",
+        fprintf(out, "%-10s %-15s %-15s %-15s %-15s %-15s %-10s %-16s %s\n",
                "Login", "Name", "Idle Time",
-               "Login Time", "Office", "Office Phone", "Tty");
+               "Login Time", "Office", "Office Phone", "Tty", "From", "What");
+
+        // Print user information, one line per session
+        if (user->session_count == 0) {
+            fprintf(out, "%-10s %-15s %-15s %-15s %-15s %-15s %-10s %-16s %s\n",
+                   user->login_name, user->real_name, "*",
+                   "*", user->office_location, user->office_phone,
+                   "*", "-", "-");
+        }
+        for (size_t i = 0; i < user->session_count; i++) {
+            const SessionInfo *session = &user->sessions[i];
+            char tty[64];
+            // A "*" after the terminal: messages are off (mesg n) or it cannot be written
+            snprintf(tty, sizeof(tty), "%s%s", session->terminal, session->write_status ? "" : "*");
+            fprintf(out, "%-10s %-15s %-15s %-15s %-15s %-15s %-10s %-16s %s\n",
+                   user->login_name, user->real_name, session->idle_time,
+                   session->login_time, user->office_location, user->office_phone,
+                   tty, session->host[0] != '\0' ? session->host : "-",
+                   session->what != NULL ? session->what : "-");
+        }
+    }
+}
 
-        // Print user information
-        printf("%-10s %-15s %-15s %-15s %-15s %-15s %-1s%s\n",
-               user->login_name, user->real_name, user->idle_time,
-               user->login_time, user->office_location, user->office_phone,
-               user->terminal, (user->write_status==0 && strcmp(user->login_time,"*")==0)? "*" : "");
-               
+// Append a copy of the first `len` bytes of `name` to the query list
+void query_list_add(QueryList *list, const char *name, size_t len) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 16;
+        char **names = realloc(list->names, capacity * sizeof(char *));
+        if (names == NULL) {
+            perror("Error allocating memory for query list");
+            exit(EXIT_FAILURE);
+        }
+        list->names = names;
+        list->capacity = capacity;
+    }
+    list->names[list->count] = strndup(name, len);
+    if (list->names[list->count] == NULL) {
+        perror("Error allocating memory for query list");
+        exit(EXIT_FAILURE);
     }
+    list->count++;
 }
 
-void parse_command_line(int argc, char *argv[], int *long_format, int *show_plan, int *match_names, char user_list[][32], int *user_count) {
+// Append every non-empty line of `path` ("-" for stdin) as a query
+int query_list_read(QueryList *list, const char *path) {
+    FILE *file = strcmp(path, "-") == 0 ? stdin : fopen(path, "re");
+    if (file == NULL) {
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    while ((len = getline(&line, &size, file)) != -1) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            len--;
+        }
+        if (len > 0) {
+            query_list_add(list, line, (size_t)len);
+        }
+    }
+    int failed = ferror(file);
+    free(line);
+    if (file != stdin) {
+        fclose(file);
+    }
+    return failed ? -1 : 0;
+}
+
+// Move the user@host queries of `list` to `remote`, keeping the order of both
+void query_list_split_remote(QueryList *list, QueryList *remote) {
+    size_t kept = 0;
+    for (size_t i = 0; i < list->count; i++) {
+        if (strchr(list->names[i], '@') == NULL) {
+            list->names[kept++] = list->names[i];
+            continue;
+        }
+        if (remote->count == remote->capacity) {
+            size_t capacity = remote->capacity ? remote->capacity * 2 : 16;
+            char **names = realloc(remote->names, capacity * sizeof(char *));
+            if (names == NULL) {
+                perror("Error allocating memory for query list");
+                exit(EXIT_FAILURE);
+            }
+            remote->names = names;
+            remote->capacity = capacity;
+        }
+        remote->names[remote->count++] = list->names[i];
+    }
+    list->count = kept;
+}
+
+void query_list_free(QueryList *list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->names[i]);
+    }
+    free(list->names);
+    memset(list, 0, sizeof(*list));
+}
+
+void parse_command_line(int argc, char *argv[], FingerOptions *options, QueryList *queries) {
+    static const struct option long_options[] = {
+        {"stats", optional_argument, NULL, 'T'},
+        {NULL, 0, NULL, 0},
+    };
     int opt;
-    while ((opt = getopt(argc, argv, "lpsm")) != -1) {
+    while ((opt = getopt_long(argc, argv, "lpsmfaj:uS:N:I:J0P:U:M:B:W:L:w:t:Z:X:", long_options, NULL)) != -1) {
         switch (opt) {
             case 'l':
-                *long_format = 1;
+                options->long_format = 1;
                 break;
             case 'p':
-                *long_format = 1;
-                *show_plan = 0;
+                options->long_format = 1;
+                options->show_plan = 0;
                 break;
             case 's':
-                *long_format = 0;
+                options->long_format = 0;
                 break;
             case 'm':
-                *match_names = 0;
+                options->match_names = 0;
+                break;
+            case 'a':
+                options->all_accounts = 1; // Every passwd account, streamed in batches
+                break;
+            case 'B':
+                options->batch_file = optarg; // More queries, one per line ("-" is stdin)
+                break;
+            case 'W':
+                options->wtmp_file = optarg; // Take last logins from another wtmp file
+                break;
+            case 'L':
+                options->wtmp_cache = optarg; // Keep wtmp offsets in a cache file between runs
+                break;
+            case 'w': {
+                char *end;
+                options->watch_interval = strtod(optarg, &end); // Live table, refreshed every N seconds
+                if (*end != '\0' || !(options->watch_interval >= WATCH_MIN_INTERVAL && options->watch_interval <= 86400)) {
+                    fprintf(stderr, "Invalid watch interval: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+            case 't': {
+                char *end;
+                options->remote_timeout = strtod(optarg, &end); // Deadline of every user@host query
+                if (*end != '\0' || !(options->remote_timeout > 0 && options->remote_timeout <= 86400)) {
+                    fprintf(stderr, "Invalid timeout: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+            case 'f':
+                options->match_names = 2; // Fall back to prefix and typo-tolerant real-name search
+                break;
+            case 'j':
+                options->jobs = atoi(optarg); // Number of users probed concurrently
+                if (options->jobs < 1) {
+                    fprintf(stderr, "Invalid job count: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'u':
+                options->use_uring = 1; // Batch the probes through io_uring when available
+                break;
+            case 'S':
+                options->serve_address = optarg; // Run as a finger daemon on [host:]port
+                break;
+            case 'N': {
+                char *end;
+                long workers = strtol(optarg, &end, 10); // Daemon worker processes, 0 for one per core
+                if (*end != '\0' || end == optarg || workers < 0 || workers > 1024) {
+                    fprintf(stderr, "Invalid worker count: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                options->server_workers = (int)workers;
+                break;
+            }
+            case 'I':
+                options->index_file = optarg; // Map passwd from an index file instead of enumerating it
+                break;
+            case 'J':
+                options->output_format = OUTPUT_JSON; // One JSON object per line
+                break;
+            case '0':
+                options->output_format = OUTPUT_NUL; // NUL-terminated name=value fields
+                break;
+            case 'P':
+                options->passwd_file = optarg; // Read passwd from a file (mapped, see pwsource.c) instead of NSS
+                break;
+            case 'U':
+                options->utmp_file = optarg; // Read sessions from another utmp file
+                break;
+            case 'X':
+                options->metrics_target = optarg; // Prometheus metrics: "-" prints once, else [host:]port serves them
+                break;
+            case 'Z':
+                options->snapshot_file = optarg; // Share sessions and terminal stats with concurrent runs
+                break;
+            case 'M':
+                options->mail_dir = optarg; // Look for mail spools in another directory
+                break;
+            case 'T':
+                // Phase and per-user timings on stderr, as text or JSON
+                if (optarg == NULL || strcmp(optarg, "text") == 0) {
+                    options->stats = 1;
+                } else if (strcmp(optarg, "json") == 0) {
+                    options->stats = 2;
+                } else {
+                    fprintf(stderr, "Invalid stats format: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
                 break;
             default:
-                fprintf(stderr, "Usage: %s [user ...] [-lpsm]\n", argv[0]);
+                fprintf(stderr, "Usage: %s [user ...] [-lpsmfauJ0] [-j jobs] [-S [host:]port] [-N workers] [-I index] [-P passwd] [-U utmp] [-M maildir] [-B file] [-W wtmp] [-L cache] [-w seconds] [-t timeout] [-Z snapshot] [-X -|[host:]port] [--stats[=json]]\n", argv[0]);
                 exit(EXIT_FAILURE);
         }
     }
 
     for (int i = optind; i < argc; i++) {
-        strncpy(user_list[*user_count], argv[i], 31);
-        user_list[*user_count][31] = '\0'; // Ensure null-termination
-        (*user_count)++;
+        query_list_add(queries, argv[i], strlen(argv[i]));
     }
 }
 
-void handle_user_info(UserInfo *user, int show_plan, int long_format, int match_names, char *processed_users[MAX_USERS]) {
-    // Gets user info and stores it in the user structure
-    get_user_info(user, show_plan, long_format, match_names);
-    
-    // Iterates through the list of processed users to avoid duplicates
-    for (int i = 0; i < MAX_USERS; i++) {
-        if (processed_users[i] == NULL) {
-            // If user hasn't been processed yet, store login_name and print info
-            processed_users[i] = strdup(user->login_name);
-            print_user_info(user, long_format, show_plan);
-            break;
-        } else if (strcmp(processed_users[i], user->login_name) == 0) {
-            // If user was already processed, exit function
-            return;
-        }
-    }
-}
-
-void remove_spaces(char *str) {
-    // Removes spaces from a string
-    int index = 0;
-    for (int i = 0; str[i] != '\0'; i++) {
-        if (str[i] != ' ') {
-            str[index++] = str[i];
+static void handle_user_info(const PwIndex *index, UserQueue *queue, UserInfo *user, int match_names, NameSet *processed_users) {
+    // Gets the passwd fields of the user; the filesystem probes run later in queue_run()
+    if (get_passwd_info(index, user, match_names) == -1) {
+        // Logged in but not in passwd: reported once, never fatal (the
+        // daemon and the watch must survive it)
+        if (nameset_add(processed_users, user->login_name)) {
+            queue_add_missing(queue, user->login_name);
         }
-    }
-    str[index] = '\0'; // Terminate new string without spaces
-}
-
-char **copy_gecos_list(char *gecos_list[]) {
-    // Copies a list of pointers dynamically
-    int num_users = 0;
-    while (gecos_list[num_users] != NULL) {
-        num_users++;
-    }
-
-    // Allocate new list of pointers
-    char **new_list = malloc(num_users * sizeof(char *));
-    if (new_list == NULL) {
-        perror("Error allocating memory for new_list");
-        exit(EXIT_FAILURE);
+        return;
     }
 
-    // Copy values from gecos_list to new_list
-    for (int i = 0; i < num_users; i++) {
-        new_list[i] = malloc(strlen(gecos_list[i]) + 1);
-        if (new_list[i] == NULL) {
-            perror("Error allocating memory for new_list[i]");
-            exit(EXIT_FAILURE);
-        }
-        strcpy(new_list[i], gecos_list[i]);
+    // Queue each user once, however many queries matched them
+    if (nameset_add(processed_users, user->login_name)) {
+        queue_add_user(queue, user);
     }
-
-    return new_list;
 }
 
-int main(int argc, char *argv[]) {
-    // Variables to handle flags and user list
-    int long_format = 1;
-    int show_plan = 1;
-    int match_names = 1;
-    char user_list[MAX_USERS][32];
-    int user_count = 0;
-    char *processed_users[MAX_USERS] = {NULL}; // Initialize all to NULL
-
-    // Parse command line arguments
-    parse_command_line(argc, argv, &long_format, &show_plan, &match_names, user_list, &user_count);
-
-    if (user_count == 0) {
-        // If no users specified, list all active users
-        struct utmp *ut;
-        setutent();
-        while ((ut = getutent()) != NULL) {
-            if (ut->ut_type == USER_PROCESS) {
-                UserInfo user = {0};
-                strncpy(user.login_name, ut->ut_user, sizeof(user.login_name) - 1);
-                user.login_name[sizeof(user.login_name) - 1] = '\0'; // Ensure null-termination
-                strncpy(user.terminal, ut->ut_line, sizeof(user.terminal) - 1);
-                user.terminal[sizeof(user.terminal) - 1] = '\0'; // Ensure null-termination
-                handle_user_info(&user, show_plan, long_format, match_names, processed_users);
-                break;
+// Resolve the query names to users (all logged-in users if there are none)
+// and append them, or "not found" entries, to the queue in request order
+void build_queue(const PwIndex *index, const UtmpSnapshot *utmp, UserQueue *queue, char *const names[], size_t name_count, int match_names) {
+    NameSet processed_users; // Login names queued so far (they live in the index or the queue arena)
+    nameset_init(&processed_users);
+
+    if (name_count == 0) {
+        // If no users specified, list all active users (each once, with all sessions)
+        for (size_t i = 0; i < utmp->count; i++) {
+            const struct utmp *ut = &utmp->records[i];
+            if (utmp_snapshot_first(utmp, ut->ut_user) != i) {
+                continue; // Already listed with the user's first session
             }
+            UserInfo user = {.arena = &queue->arena};
+            user.login_name = arena_strndup(&queue->arena, ut->ut_user, strnlen(ut->ut_user, sizeof(ut->ut_user)));
+            handle_user_info(index, queue, &user, match_names, &processed_users);
         }
-        endutent();
     } else {
-        struct passwd *pw;
-        char *gecos_list[MAX_USERS]; // Array of pointers to store pw->pw_gecos values
-        char *gecos_users[MAX_USERS]; // Array of pointers to store usernames
-        int count = 0; // Counter for number of stored entries
-        int num_users = 0; // Counter for number of stored users
-
-        // Initialize arrays to NULL
-        for (int i = 0; i < MAX_USERS; i++) {
-            gecos_list[i] = NULL;
-            gecos_users[i] = NULL;
-        }
-
-        // Populate gecos_list array with GECOS values
-        setpwent();
-        while ((pw = getpwent()) != NULL && num_users < MAX_USERS) {
-            char pw_gecos_copy[256];
-            strncpy(pw_gecos_copy, pw->pw_gecos, sizeof(pw_gecos_copy) - 1);
-            pw_gecos_copy[sizeof(pw_gecos_copy) - 1] = '\0';
-
-            char *first_element = strtok(pw_gecos_copy, ",");
-            if (first_element) {
-                char *gecos_copy = strdup(first_element);
-                if (gecos_copy == NULL) {
-                    exit(EXIT_FAILURE);
-                }
-                gecos_list[count] = gecos_copy;
-                count++;
-            }
-        }
-        endpwent();
-
-        // Populate gecos_users array with usernames
-        setpwent();
-        while ((pw = getpwent()) != NULL && num_users < MAX_USERS) {
-            char *username_copy = strdup(pw->pw_name);
-            if (username_copy == NULL) {
-                perror("strdup");
-                exit(EXIT_FAILURE);
-            }
-            gecos_users[num_users] = username_copy;
-            num_users++;
-        }
-        endpwent();
-
-        // Process user_list with name matching, including login names
-        for (int i = 0; i < user_count; i++) {
-            int user_found2 = 0; 
-
-            char *first_name = user_list[i];
-            for (int i = 0; i < num_users; i++) {
-                if (strcasecmp(gecos_users[i], first_name) == 0) {
-                    UserInfo user = {0};
-                    strncpy(user.login_name, gecos_users[i], sizeof(user.login_name) - 1);
-                    user.login_name[sizeof(user.login_name) - 1] = '\0';
-                    handle_user_info(&user, show_plan, long_format, match_names, processed_users);
-                    user_found2 = 1;
-                }
+        // Process the names with name matching, including login names
+        for (size_t i = 0; i < name_count; i++) {
+            size_t match_count;
+            size_t *matches;
+
+            // Login names are matched case-insensitively
+            matches = pwindex_match_login(index, names[i], &match_count);
+            int user_found2 = match_count > 0;
+            for (size_t j = 0; j < match_count; j++) {
+                UserInfo user = {.arena = &queue->arena};
+                user.login_name = pw_field(index, index->entries[matches[j]].login_name);
+                handle_user_info(index, queue, &user, match_names, &processed_users);
             }
+            free(matches);
 
             int user_found = 0;
             if (match_names) {
-                char name[32];
-                char **new_list = copy_gecos_list(gecos_list);
-
-                for (int j = 0; j < count; j++) {
-                    const char delim[] = "-";
-                    char *token;
-                    char element[32];
-                    strcpy(element, gecos_list[j]);
-
-                    token = strtok(element, delim);
-
-                    while (token != NULL) {
-                        strcpy(name, token);
-                        token = strtok(NULL, "-");
-
-                        remove_spaces(first_name);
-
-                        char *token2 = strtok(name, " ");
-
-                        while (token2 != NULL) {
-                            if (strcasecmp(first_name, token2) == 0) {
-                                token2 = strtok(NULL, " ");
-                                UserInfo user = {0};
-                                strcpy(user.login_name, new_list[j]);
-                                user.login_name[sizeof(user.login_name) - 1] = '\0';
-                                handle_user_info(&user, show_plan, long_format, match_names, processed_users);
-                                user_found = 1;
-                            } else {
-                                token2 = strtok(NULL, "");
-                            }
-                        }
-                    }
+                // Real names are matched word by word against the GECOS name tokens
+                matches = pwindex_match_name(index, names[i], &match_count);
+                user_found = match_count > 0;
+                for (size_t j = 0; j < match_count; j++) {
+                    UserInfo user = {.arena = &queue->arena};
+                    user.login_name = pw_field(index, index->entries[matches[j]].login_name);
+                    handle_user_info(index, queue, &user, match_names, &processed_users);
                 }
+                free(matches);
             }
 
-            if (!user_found && !user_found2) {
-                user_found2 = 0;
-                printf("User not found: %s\n", user_list[i]);
+            if (!user_found && !user_found2 && match_names == 2) {
+                // Nothing matched exactly: list the closest real names instead
+                matches = pwindex_search_name(index, names[i], NAME_SEARCH_LIMIT, &match_count);
+                user_found = match_count > 0;
+                for (size_t j = 0; j < match_count; j++) {
+                    UserInfo user = {.arena = &queue->arena};
+                    user.login_name = pw_field(index, index->entries[matches[j]].login_name);
+                    handle_user_info(index, queue, &user, match_names, &processed_users);
+                }
+                free(matches);
             }
 
-            for (int j = 0; j < count; j++) {
-                free(gecos_list[j]);
+            if (!user_found && !user_found2) {
+                queue_add_missing(queue, names[i]);
             }
         }
     }
 
-    
-    // Free memory allocated for processed user names
-    for (int i = 0; i < MAX_USERS; i++) {
-        if (processed_users[i] != NULL) {
-            free(processed_users[i]);
+    nameset_free(&processed_users);
+}
+
+int main(int argc, char *argv[]) {
+    // Variables to handle flags and user list
+    FingerOptions options = {
+        .long_format = 1,
+        .show_plan = 1,
+        .match_names = 1,
+        .jobs = 1,
+        .use_uring = 0,
+        .serve_address = NULL,
+        .server_workers = 1,
+        .index_file = NULL,
+        .output_format = OUTPUT_TEXT,
+        .passwd_file = NULL,
+        .utmp_file = NULL,
+        .mail_dir = NULL,
+        .stats = 0,
+        .all_accounts = 0,
+        .batch_file = NULL,
+        .wtmp_file = NULL,
+        .wtmp_cache = NULL,
+        .watch_interval = 0,
+        .remote_timeout = REMOTE_TIMEOUT,
+        .snapshot_file = NULL,
+        .metrics_target = NULL,
+    };
+    QueryList queries = {0};
+    QueryList remote_queries = {0};
+
+    // Parse command line arguments, then append the batch file (-B) to the names
+    parse_command_line(argc, argv, &options, &queries);
+    if (options.batch_file != NULL && query_list_read(&queries, options.batch_file) == -1) {
+        perror(options.batch_file);
+        exit(EXIT_FAILURE);
+    }
+    if (options.mail_dir != NULL) {
+        mail_directory = options.mail_dir;
+    }
+    wtmp_configure(options.wtmp_file, options.wtmp_cache);
+    if (options.all_accounts && queries.count > 0) {
+        fprintf(stderr, "%s: -a lists every account and takes no user names\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    query_list_split_remote(&queries, &remote_queries);
+
+    // The metrics exporter keeps utmp and the mail spool list between scrapes
+    if (options.metrics_target != NULL) {
+        int status = run_metrics(options.metrics_target, &options);
+        query_list_free(&queries);
+        query_list_free(&remote_queries);
+        return status == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // Daemon mode keeps its own resident copy of passwd and utmp
+    if (options.serve_address != NULL) {
+        return run_server(options.serve_address, &options) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // So does watch mode, which redraws a short-format table in place
+    if (options.watch_interval > 0) {
+        if (options.all_accounts || options.output_format != OUTPUT_TEXT || remote_queries.count > 0) {
+            fprintf(stderr, "%s: -w shows a live table of local users and cannot be combined with -a, -J, -0 or user@host\n", argv[0]);
+            exit(EXIT_FAILURE);
         }
+        int status = run_watch(&options, queries.names, queries.count);
+        query_list_free(&queries);
+        return status == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
     }
 
-    return 0;
-}
\ No newline at end of file
+    // Only user@host names: nothing local to look up (not even who is logged in)
+    if (remote_queries.count > 0 && queries.count == 0) {
+        int status = run_remote_queries(remote_queries.names, remote_queries.count, &options);
+        query_list_free(&remote_queries);
+        query_list_free(&queries);
+        return status == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // --stats: start the clock for the whole run (daemon mode has no report)
+    if (options.stats) {
+        stats_init();
+    }
+
+    // Enumerate (or map) passwd once; every lookup below goes through the index
+    PwIndex index;
+    uint64_t start = stats_start();
+    if (pwindex_load(&index, options.passwd_file, options.index_file) == -1) {
+        perror("Error reading passwd database");
+        exit(EXIT_FAILURE);
+    }
+    stats_stop(STAT_PASSWD, start);
+
+    // Read utmp once (or take it from the shared snapshot, -Z); every session
+    // lookup below goes through the snapshot
+    UtmpSnapshot utmp;
+    start = stats_start();
+    if ((options.snapshot_file != NULL ? shmsnap_load(&utmp, options.snapshot_file, options.utmp_file)
+                                       : utmp_snapshot_load(&utmp, options.utmp_file)) == -1) {
+        perror("Error reading utmp");
+        exit(EXIT_FAILURE);
+    }
+    stats_stop(STAT_UTMP, start);
+
+    UserQueue queue;
+    queue_init(&queue);
+    if (options.all_accounts) {
+        // Every account, a batch at a time; the report then only has the phase totals
+        queue_stream_accounts(&index, &utmp, &options, stdout);
+    } else {
+        start = stats_start();
+        build_queue(&index, &utmp, &queue, queries.names, queries.count, options.match_names);
+        stats_stop(STAT_QUERY, start);
+
+        // Probe every queued user (concurrently with -j, batched with -u) and print in request order
+        queue_run(&queue, &utmp, &options, stdout);
+    }
+    if (options.stats) {
+        fflush(stdout);
+        stats_report(stderr, &queue, options.stats == 2);
+    }
+    queue_free(&queue);
+    query_list_free(&queries);
+    wtmp_close();
+    ttyproc_free();
+    shmsnap_free();
+
+    // Remote names after the local ones, each answer as soon as it arrives
+    int status = EXIT_SUCCESS;
+    if (remote_queries.count > 0 && run_remote_queries(remote_queries.names, remote_queries.count, &options) == -1) {
+        status = EXIT_FAILURE;
+    }
+    query_list_free(&remote_queries);
+
+    utmp_snapshot_free(&utmp);
+    pwindex_free(&index);
+    return status;
+}
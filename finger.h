@@ -11,52 +11,422 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <ctype.h>   // For tolower
-#include <strings.h> // For strcasecmp and strcasestr
+#include <strings.h> // For strcasecmp
 #include <errno.h>
 #include <fcntl.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>  // For PATH_MAX
+#include <pthread.h>
+#include <sys/uio.h> // For struct iovec
 
-#define MAX_USERS 100
+#define MAX_USERS 100 // Names per daemon request
+#define PASSWD_FILE "/etc/passwd"
+
+// Dotfiles shown by the long format, in output order
+enum { USER_FILE_PLAN, USER_FILE_PROJECT, USER_FILE_PGPKEY, USER_FILE_COUNT };
 
 struct passwd; // Forward declaration of struct passwd
 
+#define PWINDEX_NONE ((size_t)-1)
+#define NAME_SEARCH_LIMIT 10 // Candidates listed for a prefix or misspelled name (-f)
+
+#define PWINDEX_NIL 0xffffffffu // End of a chain / empty slot inside the index
+
+// One passwd record; every field is an offset into PwIndex.strings
+typedef struct {
+    uint32_t login_name;
+    uint32_t gecos;           // Offset into PwIndex.gecos_block, not the string pool
+    uint32_t real_name;       // GECOS fields, split the way get_passwd_info() shows them
+    uint32_t office_location;
+    uint32_t office_phone;
+    uint32_t home_phone;
+    uint32_t home_directory;
+    uint32_t login_shell;
+    uint32_t next_login;      // Next entry in the same login hash chain
+} PwEntry;
+
+// Slot of the real-name token table
+typedef struct {
+    uint32_t token; // Lowercase token (string offset), PWINDEX_NIL if the slot is empty
+    uint32_t ids;   // First entry id in PwIndex.ids; ids are in passwd order
+    uint32_t count;
+} NameToken;
+
+// Passwd database indexed by login and by real-name token. All sections live
+// in one block, either built on the heap or mmap()ed from an index file.
+typedef struct {
+    const PwEntry *entries;
+    size_t count;
+    const uint32_t *login_buckets; // Heads of the login hash chains
+    uint32_t login_mask;
+    const NameToken *tokens;       // Open-addressing table of name tokens
+    uint32_t token_mask;
+    const uint32_t *ids;           // Posting lists of all tokens, back to back
+    const uint32_t *sorted_tokens; // Token slots in byte order of their token, for prefix walks
+    size_t sorted_count;
+    const char *strings;
+    size_t strings_size;
+    const char *gecos_block;       // Every GECOS string, NUL-separated, in entry order
+    size_t gecos_size;
+    void *storage;                 // The block itself
+    size_t storage_size;
+    int mapped;                    // Storage is an mmap() of an index file
+} PwIndex;
+
+// String field of an index entry
+static inline const char *pw_field(const PwIndex *index, uint32_t offset) {
+    return index->strings + offset;
+}
+
+// A field of a passwd record: `len` bytes at `data`, not NUL-terminated
+typedef struct {
+    const char *data;
+    size_t len;
+} PwSlice;
+
+// One passwd record as slices into the storage of its PwSource
+typedef struct {
+    PwSlice login_name;
+    PwSlice gecos;
+    PwSlice gecos_fields[4]; // Real name, office, office phone, home phone
+    PwSlice home_directory;
+    PwSlice login_shell;
+} PwRecord;
+
+// Where passwd records come from (pwsource.c)
+enum { PWSOURCE_NSS, PWSOURCE_FILE };
+typedef struct {
+    int kind;
+    const char *data;      // PWSOURCE_FILE: the mapped file and the parse position
+    size_t size;
+    size_t pos;
+    struct stat identity;  // PWSOURCE_FILE: the file that was mapped
+    int have_identity;
+} PwSource;
+
+// Per-run bump allocator owning every UserInfo string that does not point into the index
+typedef struct ArenaChunk ArenaChunk;
 typedef struct {
-    char element[32]; // Renamed from elemento
-    char login_name[32];
-    char real_name[64];
-    char office_location[32];
-    char office_phone[16];
-    char home_phone[16];
-    char home_directory[128];
-    char login_shell[64];
-    char terminal[32];
-    char idle_time[64];
-    char login_time[64];
-    char mail_status[256];
-    char plan[1024];
-    char project[1024];
-    char pgpkey[1024];
+    ArenaChunk *chunks; // Current chunk first
+    size_t total;       // Bytes handed out
+    pthread_mutex_t lock;
+} Arena;
+
+// One login session of a user, taken from the utmp snapshot
+typedef struct {
+    const char *terminal;
+    const char *idle_time;
+    const char *login_time;
+    time_t login_timestamp; // Raw utmp login time
+    time_t last_access;     // Raw atime of the terminal, -1 if unknown
     int write_status;
- 
+    const char *host;       // Remote host from utmp, "" for a local login
+    const char *what;       // Foreground command of the terminal, NULL if unknown
+    dev_t device;           // Device number of the terminal, 0 if unknown
+} SessionInfo;
+
+// What a mail spool (mbox file or Maildir) holds
+typedef struct {
+    int has_mail;
+    int counted;      // messages/unread are known (the spool could be scanned)
+    size_t messages;
+    size_t unread;
+    time_t received;  // Last delivery
+    time_t read;      // Last time the mail was read
+} MailSummary;
+
+#define MAIL_STATUS_SIZE 128
+#define PHONE_NUMBER_SIZE 16 // Longest format_phone_number() result, "+1-234-567-8901", and its NUL
+
+// Most recent wtmp login of a user who has no session now
+typedef struct {
+    time_t login_timestamp;
+    const char *login_time; // Formatted like SessionInfo.login_time
+    const char *terminal;
+    const char *host;
+} LastLogin;
+
+// A user being fingered. Strings are never truncated: passwd fields point into
+// the PwIndex, everything else lives in `arena`.
+typedef struct {
+    const char *login_name;
+    const char *real_name;
+    const char *office_location;
+    const char *office_phone;
+    const char *home_phone;
+    const char *home_directory;
+    const char *login_shell;
+    const char *mail_status;
+    MailSummary mail;                   // Counts and times behind mail_status
+    const char *files[USER_FILE_COUNT]; // Dotfile contents, NULL if missing
+    int files_loaded;                   // files[] is valid (see get_user_file())
+    SessionInfo *sessions;              // Every utmp session of the user, in utmp order
+    size_t session_count;
+    const LastLogin *last_login;        // Only looked up when there is no session; NULL if not in wtmp
+    Arena *arena;
 } UserInfo;
 
+// USER_PROCESS records of utmp, read once and chained by user name
+typedef struct {
+    struct utmp *records;
+    size_t count;
+    size_t *user_buckets;  // Heads of the per-user hash chains
+    size_t *next_session;  // Next session of the same chain
+    size_t user_mask;
+} UtmpSnapshot;
+
+// Instrumented phases of a run (--stats)
+enum {
+    STAT_PASSWD,    // Passwd enumeration / index load
+    STAT_UTMP,      // utmp snapshot load
+    STAT_QUERY,     // Resolving the query names (build_queue)
+    STAT_SESSIONS,  // Session lookups in the utmp snapshot
+    STAT_TTY,       // Terminal stat and write check
+    STAT_MAIL,      // Mail spool stat
+    STAT_DOTFILES,  // Dotfile reads and streaming
+    STAT_URING,     // Whole io_uring batch (-u)
+    STAT_WTMP,      // Last-login lookups in wtmp
+    STAT_PROCS,     // Walk of /proc for the foreground command of every terminal
+    STAT_PRINT,     // Output of one user, dotfile streaming included
+    STAT_PHASE_COUNT
+};
+
+// Per-user counters of the instrumented phases
+typedef struct {
+    uint64_t ns[STAT_PHASE_COUNT];
+    uint32_t calls[STAT_PHASE_COUNT];
+} UserStats;
+
+// One entry of the ordered gather queue: a user, or a query that matched nobody
+typedef struct {
+    UserInfo user;
+    char *missing; // Query text for "User not found", NULL for a user
+    int done;      // Set once probe_user_info() has finished
+    UserStats stats;
+} QueueItem;
+
+typedef struct {
+    QueueItem *items;
+    size_t count;
+    size_t capacity;
+    Arena arena; // Strings of every queued user
+} UserQueue;
+
+#define STREAM_BATCH 512 // Accounts queued at a time by the all-accounts listing (-a)
+#define REMOTE_TIMEOUT 10 // Default seconds a user@host query may take (-t)
+#define WATCH_MIN_INTERVAL 0.1 // Shortest refresh interval of the live table (-w), in seconds
+
+// Query names, from the command line and the batch file, in request order
+typedef struct {
+    char **names;
+    size_t count;
+    size_t capacity;
+} QueryList;
+
+// Set of login names, used to queue every user once. The strings are not
+// copied and must outlive the set.
+typedef struct {
+    const char **slots; // NULL marks an empty slot
+    size_t mask;
+    size_t count;
+} NameSet;
+
+// Command-line options shared by the local, daemon and gather paths
+typedef struct {
+    int long_format;
+    int show_plan;
+    int match_names;           // 0 logins only (-m), 1 real-name words, 2 also prefixes and near misses (-f)
+    int jobs;                  // Worker threads for the per-user probes (-j)
+    int use_uring;             // Batch the probes through io_uring (-u)
+    const char *serve_address; // [host:]port to serve the finger protocol on (-S)
+    int server_workers;        // Daemon worker processes, each with its own SO_REUSEPORT listener; 0 is one per core (-N)
+    const char *index_file;    // mmap-able passwd index, rebuilt when passwd changes (-I)
+    int output_format;         // OUTPUT_TEXT, or a structured mode (-J, -0)
+    const char *passwd_file;   // Read passwd from this file instead of NSS (-P)
+    const char *utmp_file;     // utmp file to read instead of UTMP_FILE (-U)
+    const char *mail_dir;      // Mail spool directory instead of /var/mail (-M)
+    int stats;                 // Report timings to stderr: 0 off, 1 text, 2 JSON (--stats[=json])
+    int all_accounts;          // List every passwd account instead of the logged-in users (-a)
+    const char *batch_file;    // Read more query names from this file, one per line; "-" is stdin (-B)
+    const char *wtmp_file;     // wtmp file to take last logins from instead of WTMP_FILE (-W)
+    const char *wtmp_cache;    // Sidecar cache of wtmp offsets, kept between runs (-L)
+    double watch_interval;     // Keep a live table on screen, refreshed this often in seconds; 0 is off (-w)
+    double remote_timeout;     // Seconds each user@host query may take (-t)
+    const char *snapshot_file; // Session snapshot shared with concurrent runs, e.g. in /dev/shm (-Z)
+    const char *metrics_target; // Export metrics: "-" prints them once, else [host:]port to serve them on (-X)
+} FingerOptions;
+
+// Output formats
+enum { OUTPUT_TEXT, OUTPUT_JSON, OUTPUT_NUL };
+
+// Buffered writer for the structured output modes: fixed-size chunks
+// collected as an iovec array and written with a single writev()
+#define OUTBUF_CHUNK_SIZE (64 * 1024)
+#define OUTBUF_MAX_CHUNKS 64 // Flushed automatically when this many are full
+
+typedef struct {
+    struct iovec chunks[OUTBUF_MAX_CHUNKS]; // iov_len is the used part of each chunk
+    int count;
+    FILE *out;
+} OutBuf;
+
 // Function prototypes
-void get_user_info(UserInfo *user, int show_plan, int long_format, int match_names);
+int get_user_info(const PwIndex *index, const UtmpSnapshot *utmp, UserInfo *user, int show_plan, int long_format, int match_names);
+int get_passwd_info(const PwIndex *index, UserInfo *user, int match_names);
+void probe_user_info(const UtmpSnapshot *utmp, UserInfo *user, int show_plan, int long_format);
 void print_full_gecos(const struct passwd *pw);
-char* format_phone_number(const char *input);
-void get_idle_time(const char *tty, char *login_time, char *idle_time, int long_format);
-void get_login_time(const char *login_name, char *login_time, int long_format);
-void read_user_files(UserInfo *user, int show_plan);
-void read_user_file(const char *directory, const char *filename, char *output, size_t output_size);
-void get_mail_status(const char *mail_path, char *mail_status);
-void read_file_content(const char *file_path, char *buffer, size_t buffer_size);
+char *format_phone_number(const char *input, char *output, size_t size);
+void get_user_sessions(const UtmpSnapshot *utmp, UserInfo *user, int long_format);
+void get_last_login(UserInfo *user, int long_format);
+time_t get_idle_time(const char *tty, const char *login_time, char *idle_time, int long_format, dev_t *device);
+void format_idle_time(time_t last_access, char *idle_time, int long_format);
+void get_login_time(time_t login_timestamp, char *login_time, int long_format);
+void read_user_files(UserInfo *user);
+const char *get_user_file(UserInfo *user, int file);
+void get_mail_path(const char *login_name, char *mail_path, size_t size);
+void get_mail_status(const char *mail_path, const char *home_directory, MailSummary *summary);
+void format_mail_status(const MailSummary *summary, char *mail_status);
+void set_mail_status(UserInfo *user, const MailSummary *summary);
+void set_session_command(UserInfo *user, SessionInfo *session);
+extern const char *const user_file_names[USER_FILE_COUNT];
+extern const char *mail_directory;
+extern int strict_user_files;
+int open_user_file(const UserInfo *user, int file);
+char *read_user_file(UserInfo *user, int file);
+char *read_fd_content(Arena *arena, int fd);
 
 int check_write_permission(const char *tty);
+int mode_writable(mode_t mode, uid_t uid, gid_t gid, const gid_t *groups, int group_count);
+int file_is_trusted(const struct stat *statbuf);
 void print_user_info(UserInfo *user, int long_format, int show_plan);
-void parse_command_line(int argc, char *argv[], int *long_format, int *show_plan, int *match_names, char user_list[][32], int *user_count);
+void fprint_user_info(FILE *out, UserInfo *user, int long_format, int show_plan);
+void parse_command_line(int argc, char *argv[], FingerOptions *options, QueryList *queries);
+void query_list_add(QueryList *list, const char *name, size_t len);
+int query_list_read(QueryList *list, const char *path);
+void query_list_split_remote(QueryList *list, QueryList *remote);
+void query_list_free(QueryList *list);
+void build_queue(const PwIndex *index, const UtmpSnapshot *utmp, UserQueue *queue, char *const names[], size_t name_count, int match_names);
+
+// Hash helpers (pwindex.c)
+uint32_t hash_lower(const char *str, size_t len);
+size_t table_size_for(size_t value);
+
+// Passwd sources (pwsource.c)
+int pwsource_open(PwSource *source, const char *passwd_file);
+int pwsource_next(PwSource *source, PwRecord *record);
+void pwsource_close(PwSource *source);
+void pwsource_split_gecos(PwSlice gecos, PwSlice fields[4]);
+
+// Passwd index (pwindex.c)
+int pwindex_build(PwIndex *index, const char *passwd_file);
+int pwindex_load(PwIndex *index, const char *passwd_file, const char *index_file);
+void pwindex_free(PwIndex *index);
+const PwEntry *pwindex_find_login(const PwIndex *index, const char *login_name);
+size_t *pwindex_match_login(const PwIndex *index, const char *login_name, size_t *count);
+size_t *pwindex_match_name(const PwIndex *index, const char *name, size_t *count);
+size_t *pwindex_search_name(const PwIndex *index, const char *name, size_t limit, size_t *count);
+size_t *pwindex_match_gecos(const PwIndex *index, const char *needle, size_t *count);
+const PwEntry *pwindex_find_gecos(const PwIndex *index, const char *needle);
+
+// Case-insensitive substring search (casefind.c)
+enum { CASEFIND_AUTO, CASEFIND_SCALAR, CASEFIND_SSE2, CASEFIND_AVX2 };
+int casefind_select(int which);
+const char *casefind(const char *haystack, size_t size, const char *needle, size_t needle_len);
+char *casefind_fold(char *needle);
+
+// Mail spool scanning (mailbox.c)
+void mail_summarize(const char *path, const struct stat *statbuf, MailSummary *summary);
+
+// Last logins (wtmp.c)
+void wtmp_configure(const char *wtmp_file, const char *cache_file);
+int wtmp_refresh(void);
+int wtmp_find(const char *login_name, struct utmp *record);
+void wtmp_close(void);
+
+// Foreground command of every terminal (ttyproc.c)
+int ttyproc_refresh(void);
+const char *ttyproc_find(dev_t tty);
+void ttyproc_free(void);
+
+// Shared session snapshot (shmsnap.c)
+int shmsnap_load(UtmpSnapshot *snapshot, const char *path, const char *utmp_file);
+int shmsnap_tty(const char *line, time_t *last_access, dev_t *device, int *writable);
+void shmsnap_free(void);
+
+// utmp snapshot (utmpsnap.c)
+int utmp_snapshot_load(UtmpSnapshot *snapshot, const char *path);
+int utmp_snapshot_index(UtmpSnapshot *snapshot, struct utmp *records, size_t count);
+void utmp_snapshot_free(UtmpSnapshot *snapshot);
+size_t utmp_snapshot_first(const UtmpSnapshot *snapshot, const char *login_name);
+size_t utmp_snapshot_next(const UtmpSnapshot *snapshot, size_t i);
+
+// Ordered gather queue (gather.c)
+void queue_init(UserQueue *queue);
+void queue_add_user(UserQueue *queue, const UserInfo *user);
+void queue_add_missing(UserQueue *queue, const char *query);
+void queue_run(UserQueue *queue, const UtmpSnapshot *utmp, const FingerOptions *options, FILE *out);
+void queue_reset(UserQueue *queue);
+void queue_free(UserQueue *queue);
+void queue_stream_accounts(const PwIndex *index, const UtmpSnapshot *utmp, const FingerOptions *options, FILE *out);
+void nameset_init(NameSet *set);
+int nameset_add(NameSet *set, const char *name);
+void nameset_free(NameSet *set);
+
+// Structured output (output.c)
+void outbuf_init(OutBuf *buf, FILE *out);
+void outbuf_write(OutBuf *buf, const char *data, size_t len);
+void outbuf_printf(OutBuf *buf, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void outbuf_flush(OutBuf *buf);
+void outbuf_free(OutBuf *buf);
+void emit_user_record(OutBuf *buf, QueueItem *item, int output_format, int show_plan);
+void emit_remote_record(OutBuf *buf, const char *query, const char *host, const char *response, const char *error, int output_format);
+
+// Run statistics (stats.c)
+extern int stats_enabled;
+uint64_t stats_now(void);
+void stats_init(void);
+void stats_record(int phase, uint64_t start);
+void stats_set_user(UserStats *stats);
+void stats_report(FILE *out, const UserQueue *queue, int json);
+const char *stats_phase_totals(int phase, uint64_t *ns, uint64_t *calls);
+
+// Start timing a phase (free when --stats is off)
+static inline uint64_t stats_start(void) {
+    return stats_enabled ? stats_now() : 0;
+}
+
+// Account the phase started at `start`
+static inline void stats_stop(int phase, uint64_t start) {
+    if (stats_enabled) {
+        stats_record(phase, start);
+    }
+}
+
+// Per-run arena (arena.c)
+void arena_init(Arena *arena);
+void *arena_alloc(Arena *arena, size_t size);
+char *arena_strndup(Arena *arena, const char *str, size_t len);
+char *arena_strdup(Arena *arena, const char *str);
+void arena_reset(Arena *arena);
+void arena_free(Arena *arena);
+
+// io_uring probe backend (iouring.c)
+int uring_probe_queue(UserQueue *queue, const UtmpSnapshot *utmp, int show_plan, int long_format);
+
+// Finger protocol daemon (fingerd.c)
+int run_server(const char *address, const FingerOptions *options);
+int open_listener(const char *address, int reuse_port);
+int watch_parent(int inotify_fd, const char *path);
+const char *base_name(const char *path);
+
+// Remote user@host queries (remote.c)
+int run_remote_queries(char *const queries[], size_t count, const FingerOptions *options);
+
+// Metrics exporter (metrics.c)
+int run_metrics(const char *target, const FingerOptions *options);
 
-// Helper functions (formerly Italian names)
-void remove_spaces(char *str); 
-char **copy_gecos_list(char *gecos_list[]);
+// Live watch mode (watch.c)
+int run_watch(const FingerOptions *options, char *const names[], size_t name_count);
 
 #endif // FINGER_H
\ No newline at end of file
@@ -0,0 +1,760 @@
+#include "finger.h"
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <grp.h>
+#include <netdb.h>
+#include <sched.h>
+#include <signal.h>
+
+// Finger protocol daemon (RFC 1288)
+// One process, one epoll loop. passwd and utmp are kept resident in the same
+// PwIndex/UtmpSnapshot structures the command-line path uses and are only
+// reloaded after inotify reports a change to /etc/passwd or the utmp file.
+// Rendered responses are cached for RESPONSE_TTL seconds (idle times are
+// shown to the second) and dropped early on any passwd, utmp or mail spool
+// change. Output goes through queue_run()/fprint_user_info(), so a remote
+// query prints exactly what the same local query prints, with CRLF line ends.
+//
+// With -N the daemon runs one worker process per core instead. Each worker
+// has its own SO_REUSEPORT listener on the same address, so the kernel spreads
+// connections over them without a shared accept queue, and its own epoll
+// loop, response cache and inotify watches. passwd and utmp are loaded once
+// before the workers are forked: the workers read them as copy-on-write pages
+// (with -I the index is a shared mapping of the file) and each reloads its
+// own copy after a change. The parent only forwards SIGINT/SIGTERM and
+// restarts a worker that dies, on the listener it had; the new worker reloads
+// passwd and utmp instead of using the copy loaded at startup.
+//
+// Started as root, the daemon binds its port and then runs as DAEMON_USER,
+// so network clients get only what any local user could read. Dotfiles are
+// opened without following a final symlink and without blocking on a FIFO,
+// and served only when they are regular files of their user (see
+// open_user_file()).
+
+#define MAX_QUERY 512        // Longest query line accepted
+#define MAX_EVENTS 64
+#define CLIENT_TIMEOUT 10    // Seconds a client gets to send its query
+#define RESPONSE_TTL 1       // Seconds a rendered response may be reused
+#define RESPONSE_SLOTS 256   // Direct-mapped response cache size
+#define MAX_WORKERS 1024     // Worker processes of -N
+#define DAEMON_USER "nobody" // Account the daemon runs as once its port is bound
+
+typedef struct Client {
+    int fd;
+    char query[MAX_QUERY];
+    size_t query_len;
+    char *response;
+    size_t response_len;
+    size_t sent;
+    time_t deadline;
+    struct Client *prev;
+    struct Client *next;
+} Client;
+
+typedef struct {
+    char *key;        // Normalized query ("L" or "S", then the names)
+    char *response;
+    size_t len;
+    time_t created;
+} CachedResponse;
+
+typedef struct {
+    const FingerOptions *options;
+    int epoll_fd;
+    int listen_fd;
+    int inotify_fd;
+    const char *passwd_file; // Watched files (-P and -U, or the system defaults)
+    const char *utmp_file;
+    int passwd_wd;    // -1 if the file could not be watched
+    int utmp_wd;
+    int mail_wd;
+    int passwd_dirty;
+    int utmp_dirty;
+    PwIndex index;
+    UtmpSnapshot utmp;
+    CachedResponse cache[RESPONSE_SLOTS];
+    Client *clients;
+} Server;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void handle_stop_signal(int signo) {
+    (void)signo;
+    stop_requested = 1;
+}
+
+// Only there to end the supervisor's sigsuspend() when a worker exits
+static void handle_child_signal(int signo) {
+    (void)signo;
+}
+
+// Open a non-blocking listening socket on "[host:]port", in a SO_REUSEPORT
+// group if `reuse_port` is set
+int open_listener(const char *address, int reuse_port) {
+    char host[256] = "";
+    const char *port = address;
+
+    const char *colon = strrchr(address, ':');
+    if (colon != NULL) {
+        size_t len = (size_t)(colon - address);
+        if (len > 0 && address[0] == '[' && address[len - 1] == ']') { // [::1]:79
+            address++;
+            len -= 2;
+        }
+        if (len >= sizeof(host)) {
+            fprintf(stderr, "Invalid listen address: %s\n", address);
+            return -1;
+        }
+        memcpy(host, address, len);
+        host[len] = '\0';
+        port = colon + 1;
+    }
+
+    struct addrinfo hints = {0};
+    struct addrinfo *result;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    int rc = getaddrinfo(host[0] ? host : NULL, port, &hints, &result);
+    if (rc != 0) {
+        fprintf(stderr, "Invalid listen address %s: %s\n", address, gai_strerror(rc));
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo *ai = result; ai != NULL; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd == -1) {
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1) {
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, SOMAXCONN) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+
+    if (fd == -1) {
+        perror("Error opening listening socket");
+    }
+    return fd;
+}
+
+// Another listener in the SO_REUSEPORT group of `first`, on the address it
+// is bound to (so port 0 resolves to the same port for every worker)
+static int add_listener(int first) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (getsockname(first, (struct sockaddr *)&addr, &len) == -1) {
+        return -1;
+    }
+    int fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    int one = 1;
+    if (addr.ss_family == AF_INET6) {
+        int v6only = 0;
+        socklen_t size = sizeof(v6only);
+        getsockopt(first, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, &size);
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1 ||
+        bind(fd, (struct sockaddr *)&addr, len) == -1 || listen(fd, SOMAXCONN) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Watch the directory holding `path`, so replacing the file is seen too
+int watch_parent(int inotify_fd, const char *path) {
+    char dir[256];
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL || (size_t)(slash - path) >= sizeof(dir)) {
+        return -1;
+    }
+    size_t len = slash == path ? 1 : (size_t)(slash - path);
+    memcpy(dir, path, len);
+    dir[len] = '\0';
+
+    return inotify_add_watch(inotify_fd, dir, IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_ATTRIB);
+}
+
+const char *base_name(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+static void flush_response_cache(Server *server) {
+    for (int i = 0; i < RESPONSE_SLOTS; i++) {
+        free(server->cache[i].key);
+        free(server->cache[i].response);
+        memset(&server->cache[i], 0, sizeof(server->cache[i]));
+    }
+}
+
+// Drain inotify and mark whatever changed as stale
+static void handle_inotify(Server *server) {
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    for (;;) {
+        ssize_t len = read(server->inotify_fd, buffer, sizeof(buffer));
+        if (len <= 0) {
+            break;
+        }
+
+        for (char *p = buffer; p < buffer + len; ) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            const char *name = event->len ? event->name : "";
+
+            // The three watches may share a directory, so check each of them
+            if (event->wd == server->passwd_wd && strcmp(name, base_name(server->passwd_file)) == 0) {
+                server->passwd_dirty = 1;
+                flush_response_cache(server);
+            }
+            if (event->wd == server->utmp_wd && strcmp(name, base_name(server->utmp_file)) == 0) {
+                server->utmp_dirty = 1;
+                flush_response_cache(server);
+            }
+            if (event->wd == server->mail_wd) {
+                flush_response_cache(server);
+            }
+            if (event->mask & IN_Q_OVERFLOW) { // Lost events: assume everything changed
+                server->passwd_dirty = 1;
+                server->utmp_dirty = 1;
+                flush_response_cache(server);
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+// Reload passwd and utmp if they changed (or cannot be watched)
+static void refresh_data(Server *server) {
+    if (server->passwd_dirty || server->passwd_wd == -1) {
+        PwIndex index;
+        if (pwindex_load(&index, server->options->passwd_file, server->options->index_file) == 0) {
+            pwindex_free(&server->index);
+            server->index = index;
+            server->passwd_dirty = 0;
+        }
+    }
+    if (server->utmp_dirty || server->utmp_wd == -1) {
+        UtmpSnapshot utmp;
+        if (utmp_snapshot_load(&utmp, server->utmp_file) == 0) {
+            utmp_snapshot_free(&server->utmp);
+            server->utmp = utmp;
+            server->utmp_dirty = 0;
+        }
+    }
+}
+
+// Copy `text` converting every LF to CRLF, as the protocol requires
+static char *to_crlf(const char *text, size_t len, size_t *out_len) {
+    size_t lines = 0;
+    for (size_t i = 0; i < len; i++) {
+        lines += text[i] == '\n';
+    }
+
+    char *out = malloc(len + lines + 1);
+    if (out == NULL) {
+        return NULL;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (text[i] == '\n' && (i == 0 || text[i - 1] != '\r')) {
+            out[n++] = '\r';
+        }
+        out[n++] = text[i];
+    }
+    out[n] = '\0';
+    *out_len = n;
+    return out;
+}
+
+static char *copy_bytes(const char *data, size_t len) {
+    char *copy = malloc(len ? len : 1);
+    if (copy != NULL) {
+        memcpy(copy, data, len);
+    }
+    return copy;
+}
+
+// Answer one query line; returns a malloc'd response
+static char *render_response(Server *server, char *line, size_t *len) {
+    FingerOptions options = *server->options;
+    char *names[MAX_USERS];
+    int name_count = 0;
+    char key[MAX_QUERY + 2];
+    size_t key_len = 1;
+
+    // {Q1} ::= [{W}|{W}{S}{U}]{C}, {Q2} (user@host) is refused
+    for (char *save = NULL, *token = strtok_r(line, " \t\r\n", &save); token != NULL; token = strtok_r(NULL, " \t\r\n", &save)) {
+        if (strcasecmp(token, "/W") == 0) {
+            options.long_format = 1; // Verbose request
+        } else if (strchr(token, '@') != NULL) {
+            const char *denied = "Finger forwarding service denied.\r\n";
+            *len = strlen(denied);
+            return copy_bytes(denied, *len);
+        } else if (name_count < MAX_USERS) {
+            names[name_count++] = token;
+            key_len += (size_t)snprintf(key + key_len, sizeof(key) - key_len, " %s", token);
+            if (key_len >= sizeof(key)) {
+                key_len = sizeof(key) - 1;
+            }
+        }
+    }
+    key[0] = options.long_format ? 'L' : 'S';
+    key[key_len] = '\0';
+
+    // Reuse a fresh enough rendering of the same query
+    time_t now = time(NULL);
+    CachedResponse *slot = &server->cache[hash_lower(key, key_len) % RESPONSE_SLOTS];
+    if (slot->key != NULL && strcmp(slot->key, key) == 0 && now - slot->created < RESPONSE_TTL) {
+        *len = slot->len;
+        return copy_bytes(slot->response, slot->len);
+    }
+
+    refresh_data(server);
+
+    char *text = NULL;
+    size_t text_len = 0;
+    FILE *out = open_memstream(&text, &text_len);
+    if (out == NULL) {
+        return NULL;
+    }
+    UserQueue queue;
+    queue_init(&queue);
+    build_queue(&server->index, &server->utmp, &queue, names, name_count, options.match_names);
+    queue_run(&queue, &server->utmp, &options, out);
+    queue_free(&queue);
+    fclose(out);
+
+    char *response = to_crlf(text, text_len, len);
+    free(text);
+    if (response == NULL) {
+        return NULL;
+    }
+
+    free(slot->key);
+    free(slot->response);
+    slot->key = strdup(key);
+    slot->response = copy_bytes(response, *len);
+    slot->len = *len;
+    slot->created = now;
+    if (slot->key == NULL || slot->response == NULL) {
+        free(slot->key);
+        free(slot->response);
+        memset(slot, 0, sizeof(*slot));
+    }
+    return response;
+}
+
+static void close_client(Server *server, Client *client) {
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    if (client->prev != NULL) {
+        client->prev->next = client->next;
+    } else {
+        server->clients = client->next;
+    }
+    if (client->next != NULL) {
+        client->next->prev = client->prev;
+    }
+    free(client->response);
+    free(client);
+}
+
+static void accept_clients(Server *server) {
+    for (;;) {
+        int fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            break; // EAGAIN once the backlog is drained
+        }
+
+        Client *client = calloc(1, sizeof(Client));
+        if (client == NULL) {
+            close(fd);
+            continue;
+        }
+        client->fd = fd;
+        client->deadline = time(NULL) + CLIENT_TIMEOUT;
+
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = client};
+        if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            close(fd);
+            free(client);
+            continue;
+        }
+        client->next = server->clients;
+        if (server->clients != NULL) {
+            server->clients->prev = client;
+        }
+        server->clients = client;
+    }
+}
+
+// Send as much of the response as the socket takes; 1 when finished
+static int flush_client(Client *client) {
+    while (client->sent < client->response_len) {
+        ssize_t n = send(client->fd, client->response + client->sent, client->response_len - client->sent, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : 1;
+        }
+        client->sent += (size_t)n;
+    }
+    return 1;
+}
+
+static void handle_client(Server *server, Client *client, uint32_t events) {
+    if (client->response == NULL && (events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        int complete = 0;
+        for (;;) {
+            ssize_t n = recv(client->fd, client->query + client->query_len, sizeof(client->query) - 1 - client->query_len, 0);
+            if (n > 0) {
+                client->query_len += (size_t)n;
+                client->query[client->query_len] = '\0';
+                if (memchr(client->query, '\n', client->query_len) != NULL || client->query_len == sizeof(client->query) - 1) {
+                    complete = 1;
+                    break;
+                }
+            } else if (n == 0) {
+                complete = 1; // Half-closed without CRLF: answer what we have
+                break;
+            } else if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            } else {
+                close_client(server, client);
+                return;
+            }
+        }
+        if (!complete) {
+            return;
+        }
+
+        char *newline = strchr(client->query, '\n');
+        if (newline != NULL) {
+            *newline = '\0';
+        }
+        client->response = render_response(server, client->query, &client->response_len);
+        if (client->response == NULL) {
+            close_client(server, client);
+            return;
+        }
+    }
+
+    if (client->response != NULL) {
+        if (flush_client(client)) {
+            close_client(server, client);
+            return;
+        }
+        struct epoll_event event = {.events = EPOLLOUT, .data.ptr = client};
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, client->fd, &event);
+    }
+}
+
+// Drop clients that never finished their query or stopped reading
+static void expire_clients(Server *server) {
+    time_t now = time(NULL);
+    Client *client = server->clients;
+    while (client != NULL) {
+        Client *next = client->next;
+        if (now > client->deadline) {
+            close_client(server, client);
+        }
+        client = next;
+    }
+}
+
+// Print the port actually bound (useful with port 0)
+static void report_listener(int fd, int workers) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    char host[NI_MAXHOST], port[NI_MAXSERV];
+    if (getsockname(fd, (struct sockaddr *)&addr, &len) == 0 &&
+        getnameinfo((struct sockaddr *)&addr, len, host, sizeof(host), port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV) == 0) {
+        if (workers > 1) {
+            fprintf(stderr, "finger: serving on %s port %s with %d workers\n", host, port, workers);
+        } else {
+            fprintf(stderr, "finger: serving on %s port %s\n", host, port);
+        }
+    }
+}
+
+// Event loop of one server (the whole daemon, or one worker of -N) on
+// server->listen_fd, until SIGINT/SIGTERM
+static int serve(Server *server) {
+    server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (server->epoll_fd == -1) {
+        perror("epoll_create1");
+        return -1;
+    }
+
+    // Without inotify every query reloads passwd and utmp (refresh_data)
+    server->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (server->inotify_fd != -1) {
+        server->passwd_wd = watch_parent(server->inotify_fd, server->passwd_file);
+        server->utmp_wd = watch_parent(server->inotify_fd, server->utmp_file);
+        server->mail_wd = inotify_add_watch(server->inotify_fd, mail_directory, IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_ATTRIB);
+
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = &server->inotify_fd};
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->inotify_fd, &event);
+    }
+
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = &server->listen_fd};
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->listen_fd, &event);
+
+    struct epoll_event events[MAX_EVENTS];
+    while (!stop_requested) {
+        int ready = epoll_wait(server->epoll_fd, events, MAX_EVENTS, 1000);
+        if (ready == -1 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == &server->listen_fd) {
+                accept_clients(server);
+            } else if (ptr == &server->inotify_fd) {
+                handle_inotify(server);
+            } else {
+                handle_client(server, ptr, events[i].events);
+            }
+        }
+        expire_clients(server);
+    }
+
+    while (server->clients != NULL) {
+        close_client(server, server->clients);
+    }
+    flush_response_cache(server);
+    if (server->inotify_fd != -1) {
+        close(server->inotify_fd);
+    }
+    close(server->epoll_fd);
+    return 0;
+}
+
+// Pin the calling worker to the `worker`-th CPU it may run on
+static void pin_worker(int worker) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1 || CPU_COUNT(&allowed) == 0) {
+        return;
+    }
+    int target = worker % CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && target-- == 0) {
+            cpu_set_t one;
+            CPU_ZERO(&one);
+            CPU_SET(cpu, &one);
+            sched_setaffinity(0, sizeof(one), &one);
+            return;
+        }
+    }
+}
+
+// Fork worker `worker`, serving on listeners[worker]; returns its pid or -1.
+// A `restarted` worker would start from the passwd and utmp the parent loaded
+// at startup, so it reloads them first. `mask` is the signal mask to serve with.
+static pid_t start_worker(Server *server, const int *listeners, int workers, int worker, int restarted, const sigset_t *mask) {
+    pid_t pid = fork();
+    if (pid != 0) {
+        return pid;
+    }
+    signal(SIGCHLD, SIG_DFL);
+    sigprocmask(SIG_SETMASK, mask, NULL);
+    if (restarted) {
+        server->passwd_dirty = 1;
+        server->utmp_dirty = 1;
+    }
+    for (int i = 0; i < workers; i++) {
+        if (i != worker) {
+            close(listeners[i]);
+        }
+    }
+    pin_worker(worker);
+    server->listen_fd = listeners[worker];
+    _exit(serve(server) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+// Run `workers` worker processes until SIGINT/SIGTERM, restarting any that dies.
+// SIGINT, SIGTERM and SIGCHLD stay blocked except inside sigsuspend(), so a
+// stop request or an exit that arrives while the loop is busy is seen on the
+// next wait instead of being lost before a blocking waitpid().
+static int run_workers(Server *server, const int *listeners, int workers) {
+    pid_t pids[MAX_WORKERS];
+    time_t started[MAX_WORKERS];
+    int running = 0;
+
+    struct sigaction action = {0};
+    action.sa_handler = handle_child_signal;
+    sigaction(SIGCHLD, &action, NULL);
+    sigset_t blocked;
+    sigset_t mask;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    sigaddset(&blocked, SIGTERM);
+    sigaddset(&blocked, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &blocked, &mask);
+
+    for (int i = 0; i < workers; i++) {
+        pids[i] = start_worker(server, listeners, workers, i, 0, &mask);
+        started[i] = time(NULL);
+        if (pids[i] == -1) {
+            perror("fork");
+            stop_requested = 1;
+            break;
+        }
+        running++;
+    }
+
+    int stopping = 0;
+    while (running > 0) {
+        if (stop_requested && !stopping) {
+            stopping = 1;
+            for (int i = 0; i < workers; i++) {
+                if (pids[i] > 0) {
+                    kill(pids[i], SIGTERM);
+                }
+            }
+        }
+        int status;
+        pid_t pid = waitpid(-1, &status, WNOHANG);
+        if (pid == 0) {
+            sigsuspend(&mask); // Returns once a stop or child signal was handled
+            continue;
+        }
+        if (pid == -1) {
+            break;
+        }
+        for (int i = 0; i < workers; i++) {
+            if (pids[i] != pid) {
+                continue;
+            }
+            pids[i] = 0;
+            running--;
+            if (!stop_requested) {
+                // Its listener would otherwise keep taking connections nobody accepts
+                fprintf(stderr, "finger: worker %d exited, restarting\n", i);
+                if (time(NULL) - started[i] < 1) {
+                    sleep(1); // Do not spin on a worker that dies at once
+                }
+                pids[i] = start_worker(server, listeners, workers, i, 1, &mask);
+                started[i] = time(NULL);
+                running += pids[i] > 0;
+            }
+        }
+    }
+
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    signal(SIGCHLD, SIG_DFL);
+    return 0;
+}
+
+// Give up root once the listeners are open: nothing the daemon reads for a
+// network client needs more than an unprivileged account may read
+static int drop_privileges(void) {
+    if (geteuid() != 0) {
+        return 0;
+    }
+    struct passwd *pw = getpwnam(DAEMON_USER);
+    if (pw == NULL) {
+        fprintf(stderr, "finger: cannot run the daemon as %s: no such user\n", DAEMON_USER);
+        return -1;
+    }
+    if (setgroups(0, NULL) == -1 || setgid(pw->pw_gid) == -1 || setuid(pw->pw_uid) == -1) {
+        perror("Error dropping privileges");
+        return -1;
+    }
+    return 0;
+}
+
+// Run the daemon until SIGINT/SIGTERM: one event loop, or with -N one
+// worker process per listener of a SO_REUSEPORT group
+int run_server(const char *address, const FingerOptions *options) {
+    static Server server;
+    static int listeners[MAX_WORKERS];
+
+    memset(&server, 0, sizeof(server));
+    server.options = options;
+    server.passwd_wd = server.utmp_wd = server.mail_wd = -1;
+    server.inotify_fd = -1;
+    server.passwd_file = options->passwd_file ? options->passwd_file : PASSWD_FILE;
+    server.utmp_file = options->utmp_file ? options->utmp_file : UTMP_FILE;
+    strict_user_files = 1;
+
+    int workers = options->server_workers;
+    if (workers == 0) {
+        workers = (int)sysconf(_SC_NPROCESSORS_ONLN); // One per core
+    }
+    if (workers < 1) {
+        workers = 1;
+    } else if (workers > MAX_WORKERS) {
+        workers = MAX_WORKERS;
+    }
+
+    if (pwindex_load(&server.index, options->passwd_file, options->index_file) == -1) {
+        perror("Error reading passwd database");
+        return -1;
+    }
+    if (utmp_snapshot_load(&server.utmp, server.utmp_file) == -1) {
+        perror("Error reading utmp");
+        pwindex_free(&server.index);
+        return -1;
+    }
+
+    int status = -1;
+    int opened = 0;
+    listeners[0] = open_listener(address, options->server_workers != 1);
+    if (listeners[0] != -1) {
+        for (opened = 1; opened < workers; opened++) {
+            listeners[opened] = add_listener(listeners[0]);
+            if (listeners[opened] == -1) {
+                perror("Error opening listening socket");
+                break;
+            }
+        }
+    }
+
+    if (listeners[0] != -1 && opened == workers && drop_privileges() == 0) {
+        struct sigaction action = {0};
+        action.sa_handler = handle_stop_signal; // No SA_RESTART: epoll_wait returns EINTR
+        sigaction(SIGINT, &action, NULL);
+        sigaction(SIGTERM, &action, NULL);
+        signal(SIGPIPE, SIG_IGN);
+
+        report_listener(listeners[0], workers);
+        if (options->server_workers == 1) {
+            server.listen_fd = listeners[0];
+            status = serve(&server);
+        } else {
+            fflush(NULL); // Nothing buffered may be written twice by the workers
+            status = run_workers(&server, listeners, workers);
+        }
+    }
+
+    for (int i = 0; i < opened; i++) {
+        close(listeners[i]);
+    }
+    utmp_snapshot_free(&server.utmp);
+    pwindex_free(&server.index);
+    return status;
+}
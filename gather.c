@@ -0,0 +1,332 @@
+#include "finger.h"
+
+// Ordered gather queue
+// main() resolves every query to a list of users (and "not found" entries)
+// first; queue_run() then performs the blocking filesystem probes of
+// probe_user_info() on a bounded pool of worker threads while the calling
+// thread prints the results strictly in queue order.
+//
+// queue_stream_accounts() feeds every passwd account through the same path,
+// STREAM_BATCH users at a time, so listing 100k accounts needs no more memory
+// than listing a few hundred.
+
+// Make room for one more item and return it zeroed
+static QueueItem *queue_push(UserQueue *queue) {
+    if (queue->count == queue->capacity) {
+        size_t capacity = queue->capacity ? queue->capacity * 2 : 16;
+        QueueItem *items = realloc(queue->items, capacity * sizeof(QueueItem));
+        if (items == NULL) {
+            perror("Error allocating memory for user queue");
+            exit(EXIT_FAILURE);
+        }
+        queue->items = items;
+        queue->capacity = capacity;
+    }
+
+    QueueItem *item = &queue->items[queue->count++];
+    memset(item, 0, sizeof(*item));
+    return item;
+}
+
+void queue_init(UserQueue *queue) {
+    memset(queue, 0, sizeof(*queue));
+    arena_init(&queue->arena);
+}
+
+// Queue a user whose passwd fields are already filled in
+void queue_add_user(UserQueue *queue, const UserInfo *user) {
+    QueueItem *item = queue_push(queue);
+    item->user = *user;
+}
+
+// Queue a "User not found" line for a query that matched nobody
+void queue_add_missing(UserQueue *queue, const char *query) {
+    QueueItem *item = queue_push(queue);
+    item->missing = strdup(query);
+    if (item->missing == NULL) {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Empty the queue for the next batch, keeping its buffers
+void queue_reset(UserQueue *queue) {
+    for (size_t i = 0; i < queue->count; i++) {
+        free(queue->items[i].missing);
+    }
+    queue->count = 0;
+    arena_reset(&queue->arena);
+}
+
+void queue_free(UserQueue *queue) {
+    for (size_t i = 0; i < queue->count; i++) {
+        free(queue->items[i].missing);
+    }
+    free(queue->items);
+    arena_free(&queue->arena); // Every string and session of the queued users
+    memset(queue, 0, sizeof(*queue));
+}
+
+// Print one finished item, or append it to `buf` in a structured output mode
+static void print_item(FILE *out, OutBuf *buf, QueueItem *item, const FingerOptions *options) {
+    int long_format = options->long_format;
+    int show_plan = options->show_plan;
+    stats_set_user(&item->stats);
+    uint64_t start = stats_start();
+
+    if (options->output_format != OUTPUT_TEXT) {
+        emit_user_record(buf, item, options->output_format, show_plan);
+    } else if (item->missing != NULL) {
+        fprintf(out, "User not found: %s\n", item->missing);
+    } else {
+        fprint_user_info(out, &item->user, long_format, show_plan);
+    }
+    stats_stop(STAT_PRINT, start);
+    stats_set_user(NULL);
+}
+
+typedef struct {
+    UserQueue *queue;
+    const UtmpSnapshot *utmp;
+    int show_plan;
+    int long_format;
+    size_t next;             // Next item to hand out to a worker
+    pthread_mutex_t lock;
+    pthread_cond_t finished; // Signalled every time an item is done
+} WorkerPool;
+
+static void *worker_main(void *arg) {
+    WorkerPool *pool = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        size_t i = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (i >= pool->queue->count) {
+            break;
+        }
+
+        QueueItem *item = &pool->queue->items[i];
+        if (item->missing == NULL) {
+            stats_set_user(&item->stats);
+            probe_user_info(pool->utmp, &item->user, pool->show_plan, pool->long_format);
+            stats_set_user(NULL);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        item->done = 1;
+        pthread_cond_broadcast(&pool->finished);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+// Last logins of the queued users who have no session. The lookups share
+// one backward walk of wtmp, so they run here, before the probes are spread
+// over threads. The short format has no room for them.
+static void queue_last_logins(UserQueue *queue, const UtmpSnapshot *utmp, const FingerOptions *options) {
+    if (!options->long_format && options->output_format == OUTPUT_TEXT) {
+        return;
+    }
+
+    uint64_t start = stats_start();
+    if (wtmp_refresh() == 0) {
+        for (size_t i = 0; i < queue->count; i++) {
+            QueueItem *item = &queue->items[i];
+            if (item->missing == NULL && utmp_snapshot_first(utmp, item->user.login_name) == PWINDEX_NONE) {
+                get_last_login(&item->user, options->long_format);
+            }
+        }
+    }
+    stats_stop(STAT_WTMP, start);
+}
+
+// Foreground commands of the terminals of the queued users. One walk of
+// /proc serves every session (and, while it is fresh, the next batches);
+// the probes then only look their terminal up.
+static void queue_session_commands(UserQueue *queue, const UtmpSnapshot *utmp) {
+    for (size_t i = 0; i < queue->count; i++) {
+        QueueItem *item = &queue->items[i];
+        if (item->missing == NULL && utmp_snapshot_first(utmp, item->user.login_name) != PWINDEX_NONE) {
+            uint64_t start = stats_start();
+            ttyproc_refresh();
+            stats_stop(STAT_PROCS, start);
+            return;
+        }
+    }
+}
+
+// Probe every queued item and print it in order
+static void queue_probe_and_print(UserQueue *queue, const UtmpSnapshot *utmp, const FingerOptions *options, FILE *out, OutBuf *buf) {
+    int jobs = options->jobs;
+    int show_plan = options->show_plan;
+    int long_format = options->long_format;
+
+    queue_last_logins(queue, utmp, options);
+    queue_session_commands(queue, utmp);
+
+    uint64_t start = stats_start();
+    int batched = options->use_uring && uring_probe_queue(queue, utmp, show_plan, long_format) == 0;
+    if (options->use_uring) {
+        stats_stop(STAT_URING, start);
+    }
+    if (batched) {
+        for (size_t i = 0; i < queue->count; i++) {
+            print_item(out, buf, &queue->items[i], options);
+        }
+        return;
+    }
+
+    if (jobs > (int)queue->count) {
+        jobs = (int)queue->count;
+    }
+
+    // Serial path: probe and print one user at a time
+    if (jobs <= 1) {
+        for (size_t i = 0; i < queue->count; i++) {
+            QueueItem *item = &queue->items[i];
+            if (item->missing == NULL) {
+                stats_set_user(&item->stats);
+                probe_user_info(utmp, &item->user, show_plan, long_format);
+                stats_set_user(NULL);
+            }
+            print_item(out, buf, item, options);
+        }
+        return;
+    }
+
+    WorkerPool pool = {
+        .queue = queue,
+        .utmp = utmp,
+        .show_plan = show_plan,
+        .long_format = long_format,
+        .next = 0,
+    };
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.finished, NULL);
+
+    pthread_t *threads = malloc(jobs * sizeof(pthread_t));
+    if (threads == NULL) {
+        perror("Error allocating memory for worker threads");
+        exit(EXIT_FAILURE);
+    }
+
+    int started = 0;
+    for (int t = 0; t < jobs; t++) {
+        if (pthread_create(&threads[t], NULL, worker_main, &pool) != 0) {
+            break; // Run with the threads we have
+        }
+        started++;
+    }
+    if (started == 0) {
+        worker_main(&pool); // No threads at all: do the work here
+    }
+
+    // Print in request order, waiting for each item as needed
+    for (size_t i = 0; i < queue->count; i++) {
+        pthread_mutex_lock(&pool.lock);
+        while (!queue->items[i].done) {
+            pthread_cond_wait(&pool.finished, &pool.lock);
+        }
+        pthread_mutex_unlock(&pool.lock);
+        print_item(out, buf, &queue->items[i], options);
+    }
+
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+    pthread_cond_destroy(&pool.finished);
+    pthread_mutex_destroy(&pool.lock);
+}
+
+// Probe and print every queued item to `out`, using up to options->jobs
+// worker threads or, with options->use_uring, one io_uring batch for the whole queue
+void queue_run(UserQueue *queue, const UtmpSnapshot *utmp, const FingerOptions *options, FILE *out) {
+    OutBuf buf;
+    outbuf_init(&buf, out);
+    queue_probe_and_print(queue, utmp, options, out, &buf);
+    outbuf_flush(&buf);
+    outbuf_free(&buf);
+}
+
+// Probe and print every account of the index in passwd order (-a). A login
+// listed more than once in passwd is shown once, like a repeated query: only
+// the entry a login lookup finds (its first one) is printed, so nothing but
+// the current batch is held in memory.
+void queue_stream_accounts(const PwIndex *index, const UtmpSnapshot *utmp, const FingerOptions *options, FILE *out) {
+    UserQueue queue;
+    queue_init(&queue);
+
+    size_t id = 0;
+    while (id < index->count) {
+        uint64_t start = stats_start();
+        for ( ; id < index->count && queue.count < STREAM_BATCH; id++) {
+            const char *login_name = pw_field(index, index->entries[id].login_name);
+            if (pwindex_find_login(index, login_name) != &index->entries[id]) {
+                continue; // A later duplicate of a login already printed
+            }
+            UserInfo user = {.arena = &queue.arena, .login_name = login_name};
+            get_passwd_info(index, &user, options->match_names);
+            queue_add_user(&queue, &user);
+        }
+        stats_stop(STAT_QUERY, start);
+
+        queue_run(&queue, utmp, options, out);
+        queue_reset(&queue);
+    }
+
+    queue_free(&queue);
+}
+
+void nameset_init(NameSet *set) {
+    set->mask = 15;
+    set->count = 0;
+    set->slots = calloc(set->mask + 1, sizeof(const char *));
+    if (set->slots == NULL) {
+        perror("Error allocating memory for user set");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Slot holding `name`, or the empty slot where it belongs
+static size_t nameset_slot(const NameSet *set, const char *name) {
+    size_t slot = hash_lower(name, strlen(name)) & set->mask;
+    while (set->slots[slot] != NULL && strcmp(set->slots[slot], name) != 0) {
+        slot = (slot + 1) & set->mask;
+    }
+    return slot;
+}
+
+// Add a name; returns 0 if it was already in the set
+int nameset_add(NameSet *set, const char *name) {
+    if ((set->count + 1) * 10 > (set->mask + 1) * 7) {
+        // Double the table once it is 70% full
+        NameSet grown = {.mask = set->mask * 2 + 1, .count = set->count};
+        grown.slots = calloc(grown.mask + 1, sizeof(const char *));
+        if (grown.slots == NULL) {
+            perror("Error allocating memory for user set");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i <= set->mask; i++) {
+            if (set->slots[i] != NULL) {
+                grown.slots[nameset_slot(&grown, set->slots[i])] = set->slots[i];
+            }
+        }
+        free(set->slots);
+        *set = grown;
+    }
+
+    size_t slot = nameset_slot(set, name);
+    if (set->slots[slot] != NULL) {
+        return 0;
+    }
+    set->slots[slot] = name;
+    set->count++;
+    return 1;
+}
+
+void nameset_free(NameSet *set) {
+    free(set->slots);
+    memset(set, 0, sizeof(*set));
+}
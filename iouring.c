@@ -0,0 +1,480 @@
+#include "finger.h"
+
+// io_uring probe backend
+// Runs every probe of a whole gather queue through io_uring instead of one
+// blocking syscall at a time: phase 1 submits a statx for every terminal and
+// mail spool plus a statx and an openat for every dotfile, phase 2 submits a
+// read of the whole file hard linked to a close for every dotfile that opened. Each phase costs one
+// io_uring_enter() per ring-full of requests. The raw syscall interface is
+// used so there is no dependency on liburing.
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h> // For makedev
+#include <grp.h>
+#include <limits.h>
+
+#define RING_MAX_ENTRIES 4096
+
+#define STATX_PROBE_MASK (STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID | STATX_ATIME | STATX_MTIME | STATX_SIZE | STATX_INO)
+
+typedef struct {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned in_flight;          // Published submissions whose completion was not reaped
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} Ring;
+
+enum { PROBE_TTY, PROBE_MAIL, PROBE_FILE };
+
+// One probe of one user; `path` must stay valid until its completion arrives
+typedef struct {
+    int kind;
+    UserInfo *user;
+    int index;          // Session index (PROBE_TTY) or dotfile number (PROBE_FILE)
+    char path[PATH_MAX];
+    struct statx stx;
+    int res;            // Result of the statx or openat, -1 until it completes
+    int stat_res;       // Result of the statx (PROBE_FILE only)
+    int read_res;       // Result of the read (PROBE_FILE only)
+    int close_res;      // Result of the CLOSE of the dotfile, 1 until one completes
+    char *buffer;       // Arena buffer of the dotfile (PROBE_FILE only)
+} UringProbe;
+
+static void ring_exit(Ring *ring) {
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+// Check that the kernel knows every opcode this backend submits
+static int ring_supports_probes(Ring *ring) {
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    if (probe == NULL) {
+        return 0;
+    }
+
+    int supported = 0;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+        const int opcodes[] = {IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE};
+        supported = 1;
+        for (size_t i = 0; i < sizeof(opcodes) / sizeof(opcodes[0]); i++) {
+            if (opcodes[i] > probe->last_op || !(probe->ops[opcodes[i]].flags & IO_URING_OP_SUPPORTED)) {
+                supported = 0;
+            }
+        }
+    }
+    free(probe);
+    return supported;
+}
+
+static int ring_init(Ring *ring, unsigned entries) {
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        ring->fd = -1;
+        return -1; // ENOSYS, EPERM (seccomp, io_uring_disabled), ...
+    }
+
+    ring->entries = params.sq_entries;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring_exit(ring);
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring_exit(ring);
+            return -1;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring_exit(ring);
+        return -1;
+    }
+
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    if (!ring_supports_probes(ring)) {
+        ring_exit(ring);
+        return -1;
+    }
+    return 0;
+}
+
+// Claim the next free submission slot (the caller never queues more than `entries`)
+static struct io_uring_sqe *ring_get_sqe(Ring *ring, unsigned queued) {
+    unsigned tail = *ring->sq_tail + queued;
+    unsigned slot = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[slot];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[slot] = slot;
+    return sqe;
+}
+
+// Store the result of every completion that has arrived in the int its
+// user_data points to
+static void ring_reap(Ring *ring) {
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for ( ; head != tail; head++) {
+        const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        int *result = (int *)(uintptr_t)cqe->user_data;
+        if (result != NULL) {
+            *result = cqe->res;
+        }
+        ring->in_flight--;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Publish `queued` submissions, then wait for all of their completions.
+// On failure some of them may still be in flight: see ring_drain().
+static int ring_submit_and_wait(Ring *ring, unsigned queued) {
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + queued, __ATOMIC_RELEASE);
+    ring->in_flight += queued;
+
+    while (ring->in_flight > 0) {
+        unsigned to_submit = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        int ret = (int)syscall(__NR_io_uring_enter, ring->fd, to_submit, ring->in_flight, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR) {
+            return -1;
+        }
+        ring_reap(ring);
+    }
+    return 0;
+}
+
+// After a failure: take back the submissions the kernel never consumed (only
+// io_uring_enter() consumes them, there is no SQPOLL thread) and wait for
+// every other one, so no request is left that could write into the probes or
+// return an fd after they are gone
+static void ring_drain(Ring *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    ring->in_flight -= *ring->sq_tail - head;
+    __atomic_store_n(ring->sq_tail, head, __ATOMIC_RELEASE);
+
+    ring_reap(ring);
+    while (ring->in_flight > 0) {
+        int ret = (int)syscall(__NR_io_uring_enter, ring->fd, 0, ring->in_flight, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR) {
+            // Freeing the probes now would let the kernel write into freed memory
+            perror("io_uring_enter");
+            exit(EXIT_FAILURE);
+        }
+        ring_reap(ring);
+    }
+}
+
+// Build the probe list of every user in the queue
+static UringProbe *plan_probes(UserQueue *queue, const UtmpSnapshot *utmp, int show_plan, int long_format, size_t *count) {
+    size_t capacity = 0;
+    for (size_t i = 0; i < queue->count; i++) {
+        QueueItem *item = &queue->items[i];
+        if (item->missing != NULL) {
+            continue;
+        }
+        get_user_sessions(utmp, &item->user, long_format);
+        capacity += 1 + item->user.session_count + (show_plan && long_format && !strict_user_files ? USER_FILE_COUNT : 0);
+    }
+
+    UringProbe *probes = calloc(capacity ? capacity : 1, sizeof(UringProbe));
+    if (probes == NULL) {
+        perror("Error allocating memory for io_uring probes");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < queue->count; i++) {
+        UserInfo *user = &queue->items[i].user;
+        if (queue->items[i].missing != NULL) {
+            continue;
+        }
+
+        UringProbe *probe = &probes[n++];
+        probe->kind = PROBE_MAIL;
+        probe->user = user;
+        probe->res = -1;
+        get_mail_path(user->login_name, probe->path, sizeof(probe->path));
+
+        for (size_t s = 0; s < user->session_count; s++) {
+            probe = &probes[n++];
+            probe->kind = PROBE_TTY;
+            probe->user = user;
+            probe->res = -1;
+            probe->index = (int)s;
+            snprintf(probe->path, sizeof(probe->path), "/dev/%s", user->sessions[s].terminal);
+        }
+
+        // Dotfiles only when the output shows them, like probe_user_info().
+        // The daemon's are checked on the open descriptor (open_user_file()),
+        // which a path-based STATX cannot do, so they are read when printed.
+        for (int f = 0; show_plan && long_format && !strict_user_files && f < USER_FILE_COUNT; f++) {
+            probe = &probes[n++];
+            probe->kind = PROBE_FILE;
+            probe->user = user;
+            probe->index = f;
+            probe->res = -1; // No fd until the OPENAT completes
+            probe->read_res = -1;
+            probe->close_res = 1;
+            snprintf(probe->path, sizeof(probe->path), "%s/%s", user->home_directory, user_file_names[f]);
+        }
+    }
+
+    *count = n;
+    return probes;
+}
+
+// Phase 1: statx every terminal, spool and dotfile, open every dotfile
+static int submit_stats_and_opens(Ring *ring, UringProbe *probes, size_t count) {
+    unsigned queued = 0;
+    for (size_t i = 0; i < count; i++) {
+        UringProbe *probe = &probes[i];
+        struct io_uring_sqe *sqe = ring_get_sqe(ring, queued++);
+
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t)probe->path;
+        sqe->len = STATX_PROBE_MASK;
+        sqe->off = (uintptr_t)&probe->stx;
+        sqe->user_data = (uintptr_t)(probe->kind == PROBE_FILE ? &probe->stat_res : &probe->res);
+
+        if (probe->kind == PROBE_FILE) {
+            sqe = ring_get_sqe(ring, queued++);
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uintptr_t)probe->path;
+            sqe->open_flags = O_RDONLY | O_CLOEXEC;
+            sqe->user_data = (uintptr_t)&probe->res;
+        }
+
+        if (queued + 2 > ring->entries) {
+            if (ring_submit_and_wait(ring, queued) == -1) {
+                return -1;
+            }
+            queued = 0;
+        }
+    }
+    return queued ? ring_submit_and_wait(ring, queued) : 0;
+}
+
+// Phase 2: read every opened regular dotfile whole into an arena buffer and
+// close it. Other opened dotfiles (FIFOs, devices) are only closed here and
+// read synchronously by apply_results(), since their size is unknown.
+static int submit_reads(Ring *ring, UringProbe *probes, size_t count) {
+    unsigned queued = 0;
+    for (size_t i = 0; i < count; i++) {
+        UringProbe *probe = &probes[i];
+        if (probe->kind != PROBE_FILE || probe->res < 0) {
+            continue;
+        }
+
+        struct io_uring_sqe *sqe;
+        if (probe->stat_res == 0 && S_ISREG(probe->stx.stx_mode)) {
+            size_t size = probe->stx.stx_size;
+            probe->buffer = arena_alloc(probe->user->arena, size + 1);
+
+            sqe = ring_get_sqe(ring, queued++);
+            sqe->opcode = IORING_OP_READ;
+            sqe->flags = IOSQE_IO_HARDLINK; // Close even if the read fails
+            sqe->fd = probe->res;
+            sqe->addr = (uintptr_t)probe->buffer;
+            sqe->len = (unsigned)size;
+            sqe->off = 0;
+            sqe->user_data = (uintptr_t)&probe->read_res;
+        } else {
+            probe->read_res = 0; // Closed below, read later
+        }
+
+        sqe = ring_get_sqe(ring, queued++);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = probe->res;
+        sqe->user_data = (uintptr_t)&probe->close_res;
+
+        if (queued + 2 > ring->entries) {
+            if (ring_submit_and_wait(ring, queued) == -1) {
+                return -1;
+            }
+            queued = 0;
+        }
+    }
+    return queued ? ring_submit_and_wait(ring, queued) : 0;
+}
+
+// Turn the completions into the same strings the synchronous probes produce
+static void apply_results(UringProbe *probes, size_t count, int long_format) {
+    gid_t groups[NGROUPS_MAX];
+    int group_count = getgroups(NGROUPS_MAX, groups);
+    if (group_count < 0) {
+        group_count = 0;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        UringProbe *probe = &probes[i];
+        UserInfo *user = probe->user;
+
+        if (probe->kind == PROBE_MAIL) {
+            MailSummary mail;
+            if (probe->res < 0) {
+                // No spool: the ~/Maildir fallback is checked synchronously
+                get_mail_status(probe->path, user->home_directory, &mail);
+            } else {
+                // The statx result stands in for stat(); only the contents still need reading
+                struct stat statbuf = {
+                    .st_dev = makedev(probe->stx.stx_dev_major, probe->stx.stx_dev_minor),
+                    .st_ino = probe->stx.stx_ino,
+                    .st_mode = probe->stx.stx_mode,
+                    .st_size = (off_t)probe->stx.stx_size,
+                    .st_atim = {probe->stx.stx_atime.tv_sec, probe->stx.stx_atime.tv_nsec},
+                    .st_mtim = {probe->stx.stx_mtime.tv_sec, probe->stx.stx_mtime.tv_nsec},
+                };
+                mail_summarize(probe->path, &statbuf, &mail);
+            }
+            set_mail_status(user, &mail);
+        } else if (probe->kind == PROBE_TTY) {
+            SessionInfo *session = &user->sessions[probe->index];
+            if (probe->res < 0 || strcmp(session->terminal, "*") == 0 || strcmp(session->login_time, "*") == 0) {
+                session->idle_time = "*";
+                session->write_status = 0;
+            } else {
+                char idle_time[64];
+                format_idle_time(probe->stx.stx_atime.tv_sec, idle_time, long_format);
+                session->idle_time = arena_strdup(user->arena, idle_time);
+                session->last_access = probe->stx.stx_atime.tv_sec;
+                session->write_status = mode_writable(probe->stx.stx_mode, probe->stx.stx_uid, probe->stx.stx_gid, groups, group_count);
+                session->device = makedev(probe->stx.stx_rdev_major, probe->stx.stx_rdev_minor);
+                set_session_command(user, session);
+            }
+        } else {
+            if (probe->res < 0) {
+                user->files[probe->index] = NULL; // Missing, like read_user_file()
+            } else if (probe->buffer != NULL && probe->read_res >= 0 && (uint64_t)probe->read_res == probe->stx.stx_size) {
+                probe->buffer[probe->read_res] = '\0'; // Ensure null termination
+                user->files[probe->index] = probe->buffer;
+            } else {
+                // Not regular, or the single READ failed or came back short
+                // (the file changed, or it is larger than one read returns)
+                user->files[probe->index] = read_user_file(user, probe->index);
+            }
+            user->files_loaded = 1;
+        }
+    }
+}
+
+// Probe every user of the queue through io_uring. Returns -1 without touching
+// the queue when io_uring is unavailable so the caller can fall back.
+int uring_probe_queue(UserQueue *queue, const UtmpSnapshot *utmp, int show_plan, int long_format) {
+    Ring ring;
+    unsigned entries = 8;
+    size_t estimate = queue->count * (2 + (show_plan && long_format ? USER_FILE_COUNT * 3 : 0));
+    while (entries < estimate && entries < RING_MAX_ENTRIES) {
+        entries <<= 1;
+    }
+    if (ring_init(&ring, entries) == -1) {
+        return -1;
+    }
+
+    size_t count;
+    UringProbe *probes = plan_probes(queue, utmp, show_plan, long_format, &count);
+
+    int result = submit_stats_and_opens(&ring, probes, count);
+    if (result == 0) {
+        result = submit_reads(&ring, probes, count);
+    }
+    if (result == -1) {
+        // The ring broke mid-batch: let every request it still holds finish,
+        // close the dotfiles it opened and did not close, and redo
+        // everything synchronously
+        ring_drain(&ring);
+        for (size_t i = 0; i < count; i++) {
+            if (probes[i].kind == PROBE_FILE && probes[i].res >= 0 && probes[i].close_res == 1) {
+                close(probes[i].res);
+            }
+        }
+        for (size_t i = 0; i < queue->count; i++) {
+            queue->items[i].user.files_loaded = 0; // Sessions are redone by probe_user_info()
+        }
+    } else {
+        apply_results(probes, count, long_format);
+        for (size_t i = 0; i < queue->count; i++) {
+            queue->items[i].done = 1;
+        }
+    }
+
+    ring_exit(&ring);
+    free(probes);
+    return result;
+}
+
+#else
+
+// Built without io_uring headers: always use the synchronous probes
+int uring_probe_queue(UserQueue *queue, const UtmpSnapshot *utmp, int show_plan, int long_format) {
+    (void)queue;
+    (void)utmp;
+    (void)show_plan;
+    (void)long_format;
+    return -1;
+}
+
+#endif
@@ -0,0 +1,278 @@
+#include "finger.h"
+#include <dirent.h>
+#include <sys/mman.h>
+
+// Mail spool scanning
+// An mbox spool is mapped and walked line by line with memchr(). A line that
+// starts with "From " opens a message; its header block (up to the first
+// empty line) is searched for a Status: header, and the message counts as
+// read if that header holds an 'R'. A Maildir is counted from its directory
+// entries: everything in new/ is unread, and so is anything in cur/ whose
+// info part (after ":2,") lacks the 'S' flag.
+//
+// Spools are opened with O_NOATIME: reading a spool must not make it look
+// read. Where that is not allowed (someone else's spool, without
+// CAP_FOWNER) only the times are reported.
+//
+// mbox results are cached by device and inode, and reused while the size and
+// mtime are unchanged. When a spool only grew (the bytes before the old end
+// are the same and a new "From " line starts right there), only the appended
+// messages are scanned.
+
+#define MAIL_TAIL_CHECK 64 // Bytes before the old end compared to detect an append
+#define MAIL_SCAN_WINDOW (64 * 1024 * 1024) // Scanned pages are dropped this often
+
+typedef struct {
+    dev_t dev;
+    ino_t ino;           // 0 marks an empty slot
+    off_t size;
+    struct timespec mtime;
+    uint64_t tail_hash;  // Of the MAIL_TAIL_CHECK bytes before `size`
+    size_t messages;
+    size_t unread;
+} MailCacheEntry;
+
+static struct {
+    MailCacheEntry *slots;
+    size_t mask;
+    size_t count;
+    pthread_mutex_t lock;
+} mail_cache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static uint64_t hash_bytes(const char *data, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static uint64_t tail_hash(const char *data, size_t size) {
+    size_t len = size < MAIL_TAIL_CHECK ? size : MAIL_TAIL_CHECK;
+    return hash_bytes(data + size - len, len);
+}
+
+// Slot of (dev, ino), or the empty slot where it belongs. Call with the lock held.
+static MailCacheEntry *cache_slot(dev_t dev, ino_t ino) {
+    size_t slot = (size_t)((uint64_t)ino * 0x9e3779b97f4a7c15ULL >> 32 ^ (uint64_t)dev) & mail_cache.mask;
+    while (mail_cache.slots[slot].ino != 0 &&
+           (mail_cache.slots[slot].ino != ino || mail_cache.slots[slot].dev != dev)) {
+        slot = (slot + 1) & mail_cache.mask;
+    }
+    return &mail_cache.slots[slot];
+}
+
+// Copy of the cache entry of a spool, if there is one
+static int cache_lookup(dev_t dev, ino_t ino, MailCacheEntry *entry) {
+    int found = 0;
+    pthread_mutex_lock(&mail_cache.lock);
+    if (mail_cache.slots != NULL) {
+        MailCacheEntry *slot = cache_slot(dev, ino);
+        if (slot->ino != 0) {
+            *entry = *slot;
+            found = 1;
+        }
+    }
+    pthread_mutex_unlock(&mail_cache.lock);
+    return found;
+}
+
+static void cache_store(const MailCacheEntry *entry) {
+    pthread_mutex_lock(&mail_cache.lock);
+    if (mail_cache.slots == NULL || (mail_cache.count + 1) * 10 > (mail_cache.mask + 1) * 7) {
+        // Double the table once it is 70% full
+        MailCacheEntry *old = mail_cache.slots;
+        size_t old_size = old != NULL ? mail_cache.mask + 1 : 0;
+        size_t size = old_size ? old_size * 2 : 64;
+        mail_cache.slots = calloc(size, sizeof(MailCacheEntry));
+        if (mail_cache.slots == NULL) {
+            perror("Error allocating memory for mail cache");
+            exit(EXIT_FAILURE);
+        }
+        mail_cache.mask = size - 1;
+        for (size_t i = 0; i < old_size; i++) {
+            if (old[i].ino != 0) {
+                *cache_slot(old[i].dev, old[i].ino) = old[i];
+            }
+        }
+        free(old);
+    }
+
+    MailCacheEntry *slot = cache_slot(entry->dev, entry->ino);
+    if (slot->ino == 0) {
+        mail_cache.count++;
+    }
+    *slot = *entry;
+    pthread_mutex_unlock(&mail_cache.lock);
+}
+
+// Count the messages in mbox bytes [start, end), and those whose header block
+// has no Status: header with an 'R'
+static void scan_mbox(const char *data, size_t start, size_t end, size_t *messages, size_t *unread) {
+    const char *line = data + start;
+    const char *stop = data + end;
+    const char *released = data; // Pages below this were handed back
+    long page_size = sysconf(_SC_PAGESIZE);
+    int in_headers = 0;
+    int read = 0;
+
+    while (line < stop) {
+        // Keep a multi-GB spool from piling up in the resident set
+        if ((size_t)(line - released) >= MAIL_SCAN_WINDOW) {
+            const char *upto = data + (size_t)(line - data) / (size_t)page_size * (size_t)page_size;
+            madvise((void *)released, (size_t)(upto - released), MADV_DONTNEED);
+            released = upto;
+        }
+
+        const char *newline = memchr(line, '\n', (size_t)(stop - line));
+        const char *line_end = newline != NULL ? newline : stop;
+        size_t len = (size_t)(line_end - line);
+
+        if (len >= 5 && memcmp(line, "From ", 5) == 0 && !in_headers) {
+            (*messages)++;
+            in_headers = 1;
+            read = 0;
+        } else if (in_headers) {
+            if (len == 0 || (len == 1 && line[0] == '\r')) {
+                in_headers = 0; // End of the header block
+                *unread += !read;
+            } else if (len >= 7 && strncasecmp(line, "Status:", 7) == 0 && memchr(line + 7, 'R', len - 7) != NULL) {
+                read = 1;
+            }
+        }
+
+        if (newline == NULL) {
+            break;
+        }
+        line = newline + 1;
+    }
+    if (in_headers) {
+        *unread += !read; // Spool ends inside a header block
+    }
+}
+
+// Summary of an mbox spool described by `statbuf`
+static void summarize_mbox(const char *path, const struct stat *statbuf, MailSummary *summary) {
+    summary->received = statbuf->st_mtime;
+    summary->read = statbuf->st_atime;
+    if (statbuf->st_size == 0) {
+        return;
+    }
+    summary->has_mail = 1; // Until a scan says otherwise
+
+    MailCacheEntry cached = {0};
+    int have_cached = cache_lookup(statbuf->st_dev, statbuf->st_ino, &cached);
+    if (have_cached && cached.size == statbuf->st_size &&
+        cached.mtime.tv_sec == statbuf->st_mtim.tv_sec && cached.mtime.tv_nsec == statbuf->st_mtim.tv_nsec) {
+        summary->has_mail = cached.messages > 0;
+        summary->messages = cached.messages;
+        summary->unread = cached.unread;
+        summary->counted = 1;
+        return;
+    }
+
+    int fd = open(path, O_RDONLY | O_NOATIME | O_CLOEXEC);
+    if (fd == -1) {
+        return; // Without O_NOATIME the scan would mark the spool read
+    }
+    struct stat current;
+    if (fstat(fd, &current) == -1 || current.st_size == 0 || !S_ISREG(current.st_mode)) {
+        close(fd);
+        return;
+    }
+    size_t size = (size_t)current.st_size;
+    char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    MailCacheEntry entry = {
+        .dev = current.st_dev,
+        .ino = current.st_ino,
+        .size = current.st_size,
+        .mtime = current.st_mtim,
+    };
+
+    // Grown by a delivery: only the new messages need a scan
+    size_t old_size = have_cached ? (size_t)cached.size : 0;
+    if (have_cached && old_size > 0 && old_size < size &&
+        tail_hash(data, old_size) == cached.tail_hash &&
+        size - old_size >= 5 && memcmp(data + old_size, "From ", 5) == 0) {
+        entry.messages = cached.messages;
+        entry.unread = cached.unread;
+        scan_mbox(data, old_size, size, &entry.messages, &entry.unread);
+    } else {
+        scan_mbox(data, 0, size, &entry.messages, &entry.unread);
+    }
+    entry.tail_hash = tail_hash(data, size);
+    munmap(data, size);
+    cache_store(&entry);
+
+    summary->received = current.st_mtime;
+    summary->has_mail = entry.messages > 0;
+    summary->messages = entry.messages;
+    summary->unread = entry.unread;
+    summary->counted = 1;
+}
+
+// Count the entries of one Maildir subdirectory; with `check_seen`, those
+// without the 'S' flag are also added to `unread`
+static int count_maildir(const char *maildir, const char *sub, int check_seen, size_t *messages, size_t *unread, time_t *mtime) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", maildir, sub);
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return -1;
+    }
+
+    struct stat statbuf;
+    if (fstat(dirfd(dir), &statbuf) == 0) {
+        *mtime = statbuf.st_mtime;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        (*messages)++;
+        if (!check_seen) {
+            (*unread)++;
+        } else {
+            const char *info = strstr(entry->d_name, ":2,");
+            if (info == NULL || strchr(info + 3, 'S') == NULL) {
+                (*unread)++;
+            }
+        }
+    }
+    closedir(dir);
+    return 0;
+}
+
+// Summary of a Maildir: deliveries touch new/, a mail reader moves mail to cur/
+static void summarize_maildir(const char *path, MailSummary *summary) {
+    time_t new_mtime = 0;
+    time_t cur_mtime = 0;
+    if (count_maildir(path, "new", 0, &summary->messages, &summary->unread, &new_mtime) == -1 ||
+        count_maildir(path, "cur", 1, &summary->messages, &summary->unread, &cur_mtime) == -1) {
+        memset(summary, 0, sizeof(*summary)); // Not a Maildir
+        return;
+    }
+    summary->received = new_mtime;
+    summary->read = cur_mtime;
+    summary->has_mail = summary->messages > 0;
+    summary->counted = 1;
+}
+
+// Summarize the spool at `path` (an mbox file or a Maildir), whose stat() is
+// `statbuf`. Safe to call from the probe worker threads.
+void mail_summarize(const char *path, const struct stat *statbuf, MailSummary *summary) {
+    memset(summary, 0, sizeof(*summary));
+    if (S_ISDIR(statbuf->st_mode)) {
+        summarize_maildir(path, summary);
+    } else if (S_ISREG(statbuf->st_mode)) {
+        summarize_mbox(path, statbuf, summary);
+    }
+}
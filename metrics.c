@@ -0,0 +1,476 @@
+#include "finger.h"
+#include <dirent.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+
+// Metrics exporter (-X)
+// Session and mail statistics in the Prometheus text exposition format,
+// printed once (-X -) or served over HTTP at /metrics (-X [host:]port).
+//
+// Scrapes are meant to come every few seconds, so the collected state is
+// kept between them. The utmp snapshot and the list of spools in the mail
+// directory (with their sizes and message counts) stay resident and are read
+// again only after inotify reports a change, like in the daemon. A scrape
+// itself only stat()s the session terminals for their idle time, through
+// get_idle_time(). Message counts come from mail_summarize(), whose cache
+// makes an unchanged spool free.
+//
+// The exporter turns on the --stats phase timers: every reload, terminal
+// stat, mail scan and rendering is added to per-phase counters that are
+// exported as finger_phase_seconds_total and finger_phase_calls_total.
+
+#define METRICS_REQUEST_SIZE 4096
+#define METRICS_CLIENT_TIMEOUT 5 // Seconds a scraper gets to send its request and read the answer
+
+// Upper bounds of the idle-time histogram, in seconds
+static const double idle_buckets[] = {60, 300, 900, 3600, 4 * 3600, 24 * 3600};
+#define IDLE_BUCKET_COUNT (sizeof(idle_buckets) / sizeof(idle_buckets[0]))
+
+typedef struct {
+    char *user;         // File name in the mail directory
+    off_t size;
+    MailSummary mail;
+} MailSpool;
+
+typedef struct {
+    const char *utmp_file;
+    UtmpSnapshot utmp;
+    MailSpool *spools;
+    size_t spool_count;
+    int inotify_fd;
+    int utmp_wd;        // -1 if the file could not be watched
+    int mail_wd;
+    int utmp_dirty;
+    int mail_dirty;
+    uint64_t scrapes;
+    uint64_t last_scrape_ns;
+} Exporter;
+
+static volatile sig_atomic_t metrics_stop = 0;
+
+static void handle_metrics_signal(int signo) {
+    (void)signo;
+    metrics_stop = 1;
+}
+
+static void free_spools(Exporter *exporter) {
+    for (size_t i = 0; i < exporter->spool_count; i++) {
+        free(exporter->spools[i].user);
+    }
+    free(exporter->spools);
+    exporter->spools = NULL;
+    exporter->spool_count = 0;
+}
+
+// List the mbox spools of the mail directory with their size and counts
+static void scan_mail_directory(Exporter *exporter) {
+    uint64_t start = stats_start();
+    free_spools(exporter);
+    DIR *dir = opendir(mail_directory);
+    if (dir == NULL) {
+        stats_stop(STAT_MAIL, start);
+        return;
+    }
+
+    size_t capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        struct stat statbuf;
+        if (entry->d_name[0] == '.' ||
+            fstatat(dirfd(dir), entry->d_name, &statbuf, AT_SYMLINK_NOFOLLOW) == -1 || !S_ISREG(statbuf.st_mode)) {
+            continue;
+        }
+        if (exporter->spool_count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            MailSpool *spools = realloc(exporter->spools, capacity * sizeof(MailSpool));
+            if (spools == NULL) {
+                perror("Error allocating memory for mail spools");
+                exit(EXIT_FAILURE);
+            }
+            exporter->spools = spools;
+        }
+        MailSpool *spool = &exporter->spools[exporter->spool_count];
+        spool->user = strdup(entry->d_name);
+        if (spool->user == NULL) {
+            perror("Error allocating memory for mail spools");
+            exit(EXIT_FAILURE);
+        }
+        spool->size = statbuf.st_size;
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", mail_directory, entry->d_name);
+        mail_summarize(path, &statbuf, &spool->mail);
+        exporter->spool_count++;
+    }
+    closedir(dir);
+    stats_stop(STAT_MAIL, start);
+}
+
+// Drain inotify and mark whatever changed as stale
+static void handle_metrics_events(Exporter *exporter) {
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    for (;;) {
+        ssize_t len = read(exporter->inotify_fd, buffer, sizeof(buffer));
+        if (len <= 0) {
+            break;
+        }
+        for (char *p = buffer; p < buffer + len; ) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            const char *name = event->len ? event->name : "";
+            if (event->wd == exporter->utmp_wd && strcmp(name, base_name(exporter->utmp_file)) == 0) {
+                exporter->utmp_dirty = 1;
+            }
+            if (event->wd == exporter->mail_wd) {
+                exporter->mail_dirty = 1;
+            }
+            if (event->mask & IN_Q_OVERFLOW) {
+                exporter->utmp_dirty = 1;
+                exporter->mail_dirty = 1;
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+// Re-read what changed since the last scrape (everything that cannot be watched)
+static void refresh_state(Exporter *exporter) {
+    if (exporter->inotify_fd != -1) {
+        handle_metrics_events(exporter);
+    }
+    if (exporter->utmp_dirty || exporter->utmp_wd == -1) {
+        UtmpSnapshot utmp;
+        uint64_t start = stats_start();
+        if (utmp_snapshot_load(&utmp, exporter->utmp_file) == 0) {
+            utmp_snapshot_free(&exporter->utmp);
+            exporter->utmp = utmp;
+            exporter->utmp_dirty = 0;
+        }
+        stats_stop(STAT_UTMP, start);
+    }
+    if (exporter->mail_dirty || exporter->mail_wd == -1) {
+        scan_mail_directory(exporter);
+        exporter->mail_dirty = 0;
+    }
+}
+
+// Write a label value with \, " and newlines escaped
+static void write_label(FILE *out, const char *value, size_t len) {
+    for (size_t i = 0; i < len && value[i] != '\0'; i++) {
+        if (value[i] == '\\' || value[i] == '"') {
+            fprintf(out, "\\%c", value[i]);
+        } else if (value[i] == '\n') {
+            fputs("\\n", out);
+        } else {
+            fputc(value[i], out);
+        }
+    }
+}
+
+// Collect and render one scrape; returns a malloc'd text of `*len` bytes
+static char *render_metrics(Exporter *exporter, size_t *len) {
+    uint64_t scrape_start = stats_now();
+    refresh_state(exporter);
+
+    // Idle time of every session, from the atime of its terminal
+    const UtmpSnapshot *utmp = &exporter->utmp;
+    time_t now = time(NULL);
+    double *idle = malloc((utmp->count ? utmp->count : 1) * sizeof(double));
+    if (idle == NULL) {
+        return NULL;
+    }
+    uint64_t start = stats_start();
+    for (size_t i = 0; i < utmp->count; i++) {
+        const struct utmp *ut = &utmp->records[i];
+        char tty[sizeof(ut->ut_line) + 1];
+        char idle_time[64];
+        dev_t device;
+        snprintf(tty, sizeof(tty), "%.*s", (int)sizeof(ut->ut_line), ut->ut_line);
+        time_t last_access = tty[0] != '\0' ? get_idle_time(tty, "", idle_time, 0, &device) : -1;
+        idle[i] = last_access == -1 ? -1 : (last_access < now ? difftime(now, last_access) : 0);
+    }
+    stats_stop(STAT_TTY, start);
+
+    start = stats_start();
+    char *text = NULL;
+    FILE *out = open_memstream(&text, len);
+    if (out == NULL) {
+        free(idle);
+        return NULL;
+    }
+
+    fprintf(out, "# HELP finger_sessions Login sessions in utmp.\n# TYPE finger_sessions gauge\nfinger_sessions %zu\n", utmp->count);
+
+    // Per user: session count and the idle time of the least idle terminal
+    fprintf(out, "# HELP finger_user_sessions Login sessions of each logged-in user.\n# TYPE finger_user_sessions gauge\n");
+    for (size_t i = 0; i < utmp->count; i++) {
+        const char *user = utmp->records[i].ut_user;
+        if (utmp_snapshot_first(utmp, user) != i) {
+            continue; // Counted with the user's first session
+        }
+        size_t sessions = 0;
+        for (size_t s = i; s != PWINDEX_NONE; s = utmp_snapshot_next(utmp, s)) {
+            sessions++;
+        }
+        fprintf(out, "finger_user_sessions{user=\"");
+        write_label(out, user, sizeof(utmp->records[i].ut_user));
+        fprintf(out, "\"} %zu\n", sessions);
+    }
+    fprintf(out, "# HELP finger_user_idle_seconds Idle time of each logged-in user's least idle terminal.\n# TYPE finger_user_idle_seconds gauge\n");
+    for (size_t i = 0; i < utmp->count; i++) {
+        const char *user = utmp->records[i].ut_user;
+        if (utmp_snapshot_first(utmp, user) != i) {
+            continue;
+        }
+        double least = -1;
+        for (size_t s = i; s != PWINDEX_NONE; s = utmp_snapshot_next(utmp, s)) {
+            if (idle[s] >= 0 && (least < 0 || idle[s] < least)) {
+                least = idle[s];
+            }
+        }
+        if (least >= 0) {
+            fprintf(out, "finger_user_idle_seconds{user=\"");
+            write_label(out, user, sizeof(utmp->records[i].ut_user));
+            fprintf(out, "\"} %.0f\n", least);
+        }
+    }
+
+    // Idle times of the current sessions (terminals that could be stat()ed)
+    size_t bucket_counts[IDLE_BUCKET_COUNT] = {0};
+    size_t idle_count = 0;
+    double idle_sum = 0;
+    for (size_t i = 0; i < utmp->count; i++) {
+        if (idle[i] < 0) {
+            continue;
+        }
+        idle_count++;
+        idle_sum += idle[i];
+        for (size_t b = 0; b < IDLE_BUCKET_COUNT; b++) {
+            bucket_counts[b] += idle[i] <= idle_buckets[b];
+        }
+    }
+    fprintf(out, "# HELP finger_session_idle_seconds Idle time of the terminals of the current sessions.\n# TYPE finger_session_idle_seconds histogram\n");
+    for (size_t b = 0; b < IDLE_BUCKET_COUNT; b++) {
+        fprintf(out, "finger_session_idle_seconds_bucket{le=\"%.0f\"} %zu\n", idle_buckets[b], bucket_counts[b]);
+    }
+    fprintf(out, "finger_session_idle_seconds_bucket{le=\"+Inf\"} %zu\n", idle_count);
+    fprintf(out, "finger_session_idle_seconds_sum %.0f\nfinger_session_idle_seconds_count %zu\n", idle_sum, idle_count);
+    free(idle);
+
+    // Mail spools
+    fprintf(out, "# HELP finger_mail_spool_bytes Size of each mail spool in the mail directory.\n# TYPE finger_mail_spool_bytes gauge\n");
+    for (size_t i = 0; i < exporter->spool_count; i++) {
+        fprintf(out, "finger_mail_spool_bytes{user=\"");
+        write_label(out, exporter->spools[i].user, SIZE_MAX);
+        fprintf(out, "\"} %lld\n", (long long)exporter->spools[i].size);
+    }
+    fprintf(out, "# HELP finger_mail_messages Messages in each mail spool that could be counted.\n# TYPE finger_mail_messages gauge\n");
+    for (size_t i = 0; i < exporter->spool_count; i++) {
+        if (exporter->spools[i].mail.counted) {
+            fprintf(out, "finger_mail_messages{user=\"");
+            write_label(out, exporter->spools[i].user, SIZE_MAX);
+            fprintf(out, "\"} %zu\n", exporter->spools[i].mail.messages);
+        }
+    }
+    fprintf(out, "# HELP finger_mail_unread Unread messages in each mail spool that could be counted.\n# TYPE finger_mail_unread gauge\n");
+    for (size_t i = 0; i < exporter->spool_count; i++) {
+        if (exporter->spools[i].mail.counted) {
+            fprintf(out, "finger_mail_unread{user=\"");
+            write_label(out, exporter->spools[i].user, SIZE_MAX);
+            fprintf(out, "\"} %zu\n", exporter->spools[i].mail.unread);
+        }
+    }
+    stats_stop(STAT_PRINT, start);
+
+    // The exporter's own cost, rendering of this scrape included
+    exporter->scrapes++;
+    exporter->last_scrape_ns = stats_now() - scrape_start;
+    fprintf(out, "# HELP finger_phase_seconds_total Time spent collecting, by phase.\n# TYPE finger_phase_seconds_total counter\n");
+    for (int p = 0; p < STAT_PHASE_COUNT; p++) {
+        uint64_t ns, calls;
+        const char *name = stats_phase_totals(p, &ns, &calls);
+        if (calls > 0) {
+            fprintf(out, "finger_phase_seconds_total{phase=\"%s\"} %.9f\n", name, ns / 1e9);
+        }
+    }
+    fprintf(out, "# HELP finger_phase_calls_total Collection steps run, by phase.\n# TYPE finger_phase_calls_total counter\n");
+    for (int p = 0; p < STAT_PHASE_COUNT; p++) {
+        uint64_t ns, calls;
+        const char *name = stats_phase_totals(p, &ns, &calls);
+        if (calls > 0) {
+            fprintf(out, "finger_phase_calls_total{phase=\"%s\"} %llu\n", name, (unsigned long long)calls);
+        }
+    }
+    fprintf(out, "# HELP finger_scrape_seconds Time the latest scrape took to collect and render.\n# TYPE finger_scrape_seconds gauge\nfinger_scrape_seconds %.9f\n",
+            exporter->last_scrape_ns / 1e9);
+    fprintf(out, "# HELP finger_scrapes_total Scrapes answered.\n# TYPE finger_scrapes_total counter\nfinger_scrapes_total %llu\n",
+            (unsigned long long)exporter->scrapes);
+
+    if (fclose(out) != 0) {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
+
+static void send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+}
+
+// Answer one HTTP request on `fd`: GET or HEAD of /metrics (or /)
+static void handle_scrape(Exporter *exporter, int fd) {
+    struct timeval timeout = {.tv_sec = METRICS_CLIENT_TIMEOUT};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    char request[METRICS_REQUEST_SIZE];
+    size_t used = 0;
+    while (used < sizeof(request) - 1) {
+        ssize_t n = recv(fd, request + used, sizeof(request) - 1 - used, 0);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        used += (size_t)n;
+        request[used] = '\0';
+        if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL) {
+            break;
+        }
+    }
+    request[used] = '\0';
+
+    char method[8] = "";
+    char path[256] = "";
+    if (sscanf(request, "%7s %255s", method, path) != 2) {
+        return;
+    }
+    char *query = strchr(path, '?');
+    if (query != NULL) {
+        *query = '\0';
+    }
+
+    char header[256];
+    int head = strcmp(method, "HEAD") == 0;
+    if (strcmp(method, "GET") != 0 && !head) {
+        const char *answer = "HTTP/1.1 405 Method Not Allowed\r\nAllow: GET, HEAD\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        send_all(fd, answer, strlen(answer));
+        return;
+    }
+    if (strcmp(path, "/metrics") != 0 && strcmp(path, "/") != 0) {
+        const char *answer = "HTTP/1.1 404 Not Found\r\nContent-Type: text/plain\r\nContent-Length: 10\r\nConnection: close\r\n\r\nNot Found\n";
+        send_all(fd, answer, strlen(answer));
+        return;
+    }
+
+    size_t len;
+    char *text = render_metrics(exporter, &len);
+    if (text == NULL) {
+        const char *answer = "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        send_all(fd, answer, strlen(answer));
+        return;
+    }
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                              "Content-Length: %zu\r\nConnection: close\r\n\r\n", len);
+    send_all(fd, header, (size_t)header_len);
+    if (!head) {
+        send_all(fd, text, len);
+    }
+    free(text);
+}
+
+// Export the metrics: print them once if `target` is "-", otherwise serve
+// them on [host:]port until SIGINT/SIGTERM
+int run_metrics(const char *target, const FingerOptions *options) {
+    static Exporter exporter;
+
+    memset(&exporter, 0, sizeof(exporter));
+    exporter.utmp_file = options->utmp_file ? options->utmp_file : UTMP_FILE;
+    exporter.inotify_fd = exporter.utmp_wd = exporter.mail_wd = -1;
+    stats_init(); // Per-phase collection times
+
+    int status = 0;
+    if (strcmp(target, "-") == 0) {
+        size_t len;
+        char *text = render_metrics(&exporter, &len);
+        if (text == NULL || fwrite(text, 1, len, stdout) != len) {
+            status = -1;
+        }
+        free(text);
+    } else {
+        int listen_fd = open_listener(target, 0);
+        if (listen_fd == -1) {
+            return -1;
+        }
+
+        // Without inotify every scrape reloads utmp and rescans the mail directory
+        exporter.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (exporter.inotify_fd != -1) {
+            exporter.utmp_wd = watch_parent(exporter.inotify_fd, exporter.utmp_file);
+            exporter.mail_wd = inotify_add_watch(exporter.inotify_fd, mail_directory, IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_ATTRIB);
+        }
+        exporter.utmp_dirty = exporter.mail_dirty = 1;
+
+        struct sigaction action = {0};
+        action.sa_handler = handle_metrics_signal; // No SA_RESTART: poll returns EINTR
+        sigaction(SIGINT, &action, NULL);
+        sigaction(SIGTERM, &action, NULL);
+        signal(SIGPIPE, SIG_IGN);
+
+        struct sockaddr_storage addr;
+        socklen_t addr_len = sizeof(addr);
+        char host[NI_MAXHOST], port[NI_MAXSERV];
+        if (getsockname(listen_fd, (struct sockaddr *)&addr, &addr_len) == 0 &&
+            getnameinfo((struct sockaddr *)&addr, addr_len, host, sizeof(host), port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV) == 0) {
+            fprintf(stderr, "finger: metrics on http://%s:%s/metrics\n", host, port);
+        }
+
+        while (!metrics_stop) {
+            struct pollfd fds[2] = {
+                {.fd = listen_fd, .events = POLLIN},
+                {.fd = exporter.inotify_fd, .events = POLLIN},
+            };
+            int ready = poll(fds, exporter.inotify_fd != -1 ? 2 : 1, -1);
+            if (ready == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("poll");
+                status = -1;
+                break;
+            }
+            if (exporter.inotify_fd != -1 && (fds[1].revents & POLLIN)) {
+                handle_metrics_events(&exporter); // Keep the queue from overflowing between scrapes
+            }
+            if (fds[0].revents & POLLIN) {
+                int fd;
+                while ((fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC)) != -1) {
+                    handle_scrape(&exporter, fd);
+                    close(fd);
+                }
+            }
+        }
+        if (exporter.inotify_fd != -1) {
+            close(exporter.inotify_fd);
+        }
+        close(listen_fd);
+    }
+
+    free_spools(&exporter);
+    utmp_snapshot_free(&exporter.utmp);
+    return status;
+}
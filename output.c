@@ -0,0 +1,356 @@
+#include "finger.h"
+#include <stdarg.h>
+
+// Structured output
+// -J prints one JSON object per user and -0 prints NUL-terminated name=value
+// fields, a record ending with an empty field. Both carry every UserInfo
+// field, every session and the raw login and idle timestamps. Records are
+// appended to an OutBuf, whose chunks go out with one writev() per flush
+// instead of one stdio call per field.
+
+// Start a fresh chunk
+static char *outbuf_new_chunk(OutBuf *buf) {
+    if (buf->count == OUTBUF_MAX_CHUNKS) {
+        outbuf_flush(buf);
+    }
+
+    struct iovec *chunk = &buf->chunks[buf->count];
+    if (chunk->iov_base == NULL) {
+        chunk->iov_base = malloc(OUTBUF_CHUNK_SIZE);
+        if (chunk->iov_base == NULL) {
+            perror("Error allocating memory for output buffer");
+            exit(EXIT_FAILURE);
+        }
+    }
+    chunk->iov_len = 0;
+    buf->count++;
+    return chunk->iov_base;
+}
+
+void outbuf_init(OutBuf *buf, FILE *out) {
+    memset(buf, 0, sizeof(*buf));
+    buf->out = out;
+}
+
+void outbuf_write(OutBuf *buf, const char *data, size_t len) {
+    while (len > 0) {
+        struct iovec *chunk = buf->count ? &buf->chunks[buf->count - 1] : NULL;
+        if (chunk == NULL || chunk->iov_len == OUTBUF_CHUNK_SIZE) {
+            outbuf_new_chunk(buf);
+            chunk = &buf->chunks[buf->count - 1];
+        }
+
+        size_t room = OUTBUF_CHUNK_SIZE - chunk->iov_len;
+        size_t n = len < room ? len : room;
+        memcpy((char *)chunk->iov_base + chunk->iov_len, data, n);
+        chunk->iov_len += n;
+        data += n;
+        len -= n;
+    }
+}
+
+void outbuf_printf(OutBuf *buf, const char *format, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    if (len < 0) {
+        return;
+    }
+    if ((size_t)len < sizeof(line)) {
+        outbuf_write(buf, line, (size_t)len);
+        return;
+    }
+
+    // Longer than the stack line: format again into a heap copy
+    char *text = malloc((size_t)len + 1);
+    if (text == NULL) {
+        perror("Error allocating memory for output buffer");
+        exit(EXIT_FAILURE);
+    }
+    va_start(args, format);
+    vsnprintf(text, (size_t)len + 1, format, args);
+    va_end(args);
+    outbuf_write(buf, text, (size_t)len);
+    free(text);
+}
+
+// Write every buffered chunk to the output. Streams without a descriptor
+// (the daemon's open_memstream() answer) take the chunks through fwrite().
+void outbuf_flush(OutBuf *buf) {
+    int fd = fileno(buf->out);
+    fflush(buf->out); // Anything printed before must come first
+
+    struct iovec iov[OUTBUF_MAX_CHUNKS];
+    int count = buf->count;
+    memcpy(iov, buf->chunks, count * sizeof(struct iovec));
+
+    if (fd < 0) {
+        for (int i = 0; i < count; i++) {
+            fwrite(iov[i].iov_base, 1, iov[i].iov_len, buf->out);
+        }
+    } else {
+        struct iovec *next = iov;
+        while (count > 0) {
+            ssize_t n = writev(fd, next, count);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break; // Output closed: drop the rest, like printf() would
+            }
+
+            // Skip what was written, resuming inside a partly written chunk
+            while (count > 0 && (size_t)n >= next->iov_len) {
+                n -= (ssize_t)next->iov_len;
+                next++;
+                count--;
+            }
+            if (count > 0) {
+                next->iov_base = (char *)next->iov_base + n;
+                next->iov_len -= (size_t)n;
+            }
+        }
+    }
+
+    buf->count = 0;
+}
+
+void outbuf_free(OutBuf *buf) {
+    for (int i = 0; i < OUTBUF_MAX_CHUNKS; i++) {
+        free(buf->chunks[i].iov_base);
+    }
+    memset(buf, 0, sizeof(*buf));
+}
+
+// Length of the well-formed UTF-8 sequence (RFC 3629: no overlongs,
+// surrogates or code points above U+10FFFF) that starts with the byte >= 0x80
+// at `p`, or 0 if there is none. The terminating NUL is never a continuation.
+static size_t utf8_sequence_length(const unsigned char *p) {
+    unsigned char c = p[0];
+    unsigned char low = 0x80;
+    unsigned char high = 0xbf;
+    size_t len;
+    if (c >= 0xc2 && c <= 0xdf) {
+        len = 2;
+    } else if (c >= 0xe0 && c <= 0xef) {
+        len = 3;
+        low = c == 0xe0 ? 0xa0 : 0x80;
+        high = c == 0xed ? 0x9f : 0xbf;
+    } else if (c >= 0xf0 && c <= 0xf4) {
+        len = 4;
+        low = c == 0xf0 ? 0x90 : 0x80;
+        high = c == 0xf4 ? 0x8f : 0xbf;
+    } else {
+        return 0;
+    }
+    if (p[1] < low || p[1] > high) {
+        return 0;
+    }
+    for (size_t i = 2; i < len; i++) {
+        if (p[i] < 0x80 || p[i] > 0xbf) {
+            return 0;
+        }
+    }
+    return len;
+}
+
+// Append a JSON string literal, or null. Bytes that are not well-formed
+// UTF-8 (a Latin-1 GECOS, a binary .plan) become U+FFFD, so every line
+// stays valid JSON.
+static void json_string(OutBuf *buf, const char *str) {
+    if (str == NULL) {
+        outbuf_write(buf, "null", 4);
+        return;
+    }
+
+    outbuf_write(buf, "\"", 1);
+    const char *run = str; // Start of the bytes that need no escaping
+    for (const char *p = str; *p != '\0'; p++) {
+        unsigned char c = (unsigned char)*p;
+        if (c >= 0x80) {
+            size_t len = utf8_sequence_length((const unsigned char *)p);
+            if (len > 0) {
+                p += len - 1;
+                continue;
+            }
+            outbuf_write(buf, run, (size_t)(p - run));
+            outbuf_write(buf, "\\ufffd", 6);
+            run = p + 1;
+            continue;
+        }
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+
+        outbuf_write(buf, run, (size_t)(p - run));
+        run = p + 1;
+        switch (c) {
+            case '"':  outbuf_write(buf, "\\\"", 2); break;
+            case '\\': outbuf_write(buf, "\\\\", 2); break;
+            case '\n': outbuf_write(buf, "\\n", 2); break;
+            case '\r': outbuf_write(buf, "\\r", 2); break;
+            case '\t': outbuf_write(buf, "\\t", 2); break;
+            default:   outbuf_printf(buf, "\\u%04x", c); break;
+        }
+    }
+    outbuf_write(buf, run, strlen(run));
+    outbuf_write(buf, "\"", 1);
+}
+
+// Append a "name": string member
+static void json_member(OutBuf *buf, const char *name, const char *value, int first) {
+    outbuf_printf(buf, "%s\"%s\":", first ? "" : ",", name);
+    json_string(buf, value);
+}
+
+// Append a name=value field of the NUL mode (NULL values are left out)
+static void nul_field(OutBuf *buf, const char *name, const char *value) {
+    if (value == NULL) {
+        return;
+    }
+    outbuf_printf(buf, "%s=", name);
+    outbuf_write(buf, value, strlen(value) + 1);
+}
+
+static void emit_json(OutBuf *buf, UserInfo *user, int show_plan, time_t now) {
+    json_member(buf, "login", user->login_name, 1);
+    json_member(buf, "name", user->real_name, 0);
+    json_member(buf, "office", user->office_location, 0);
+    json_member(buf, "office_phone", user->office_phone, 0);
+    json_member(buf, "home_phone", user->home_phone, 0);
+    json_member(buf, "directory", user->home_directory, 0);
+    json_member(buf, "shell", user->login_shell, 0);
+    json_member(buf, "mail", user->mail_status, 0);
+    if (user->mail.counted) {
+        outbuf_printf(buf, ",\"mail_messages\":%zu,\"mail_unread\":%zu", user->mail.messages, user->mail.unread);
+    } else {
+        outbuf_printf(buf, ",\"mail_messages\":null,\"mail_unread\":null");
+    }
+
+    outbuf_printf(buf, ",\"sessions\":[");
+    for (size_t i = 0; i < user->session_count; i++) {
+        const SessionInfo *session = &user->sessions[i];
+        outbuf_printf(buf, "%s{", i ? "," : "");
+        json_member(buf, "tty", session->terminal, 1);
+        outbuf_printf(buf, ",\"login_time\":%lld", (long long)session->login_timestamp);
+        json_member(buf, "login_text", session->login_time, 0);
+        if (session->last_access == -1) {
+            outbuf_printf(buf, ",\"idle_seconds\":null");
+        } else {
+            outbuf_printf(buf, ",\"idle_seconds\":%lld", (long long)(now - session->last_access));
+        }
+        json_member(buf, "idle_text", session->idle_time, 0);
+        outbuf_printf(buf, ",\"writable\":%s", session->write_status ? "true" : "false");
+        json_member(buf, "host", session->host, 0);
+        json_member(buf, "what", session->what, 0);
+        outbuf_printf(buf, "}");
+    }
+    outbuf_printf(buf, "]");
+
+    // Last login from wtmp, only known for users with no session
+    const LastLogin *last = user->last_login;
+    if (last != NULL) {
+        outbuf_printf(buf, ",\"last_login\":{\"login_time\":%lld", (long long)last->login_timestamp);
+        json_member(buf, "login_text", last->login_time, 0);
+        json_member(buf, "tty", last->terminal, 0);
+        json_member(buf, "host", last->host, 0);
+        outbuf_printf(buf, "}");
+    } else {
+        outbuf_printf(buf, ",\"last_login\":null");
+    }
+
+    if (show_plan) {
+        for (int i = 0; i < USER_FILE_COUNT; i++) {
+            get_user_file(user, i);
+            json_member(buf, user_file_names[i] + 1, user->files[i], 0);
+        }
+    }
+}
+
+static void emit_nul(OutBuf *buf, UserInfo *user, int show_plan, time_t now) {
+    nul_field(buf, "login", user->login_name);
+    nul_field(buf, "name", user->real_name);
+    nul_field(buf, "office", user->office_location);
+    nul_field(buf, "office_phone", user->office_phone);
+    nul_field(buf, "home_phone", user->home_phone);
+    nul_field(buf, "directory", user->home_directory);
+    nul_field(buf, "shell", user->login_shell);
+    nul_field(buf, "mail", user->mail_status);
+    if (user->mail.counted) {
+        outbuf_printf(buf, "mail_messages=%zu%cmail_unread=%zu%c", user->mail.messages, '\0', user->mail.unread, '\0');
+    }
+
+    // Each session starts with its tty field
+    for (size_t i = 0; i < user->session_count; i++) {
+        const SessionInfo *session = &user->sessions[i];
+        nul_field(buf, "tty", session->terminal);
+        outbuf_printf(buf, "login_time=%lld%c", (long long)session->login_timestamp, '\0');
+        nul_field(buf, "login_text", session->login_time);
+        if (session->last_access != -1) {
+            outbuf_printf(buf, "idle_seconds=%lld%c", (long long)(now - session->last_access), '\0');
+        }
+        nul_field(buf, "idle_text", session->idle_time);
+        nul_field(buf, "writable", session->write_status ? "1" : "0");
+        nul_field(buf, "host", session->host);
+        nul_field(buf, "what", session->what);
+    }
+
+    const LastLogin *last = user->last_login;
+    if (last != NULL) {
+        outbuf_printf(buf, "last_login_time=%lld%c", (long long)last->login_timestamp, '\0');
+        nul_field(buf, "last_login_text", last->login_time);
+        nul_field(buf, "last_tty", last->terminal);
+        nul_field(buf, "last_host", last->host);
+    }
+
+    if (show_plan) {
+        for (int i = 0; i < USER_FILE_COUNT; i++) {
+            get_user_file(user, i);
+            nul_field(buf, user_file_names[i] + 1, user->files[i]);
+        }
+    }
+}
+
+// Append the record of one finished remote query (user@host): the answer
+// as `response`, or why there is none as `error`
+void emit_remote_record(OutBuf *buf, const char *query, const char *host, const char *response, const char *error, int output_format) {
+    if (output_format == OUTPUT_JSON) {
+        outbuf_write(buf, "{", 1);
+        json_member(buf, "query", query, 1);
+        json_member(buf, "host", host, 0);
+        json_member(buf, error != NULL ? "error" : "response", error != NULL ? error : response, 0);
+        outbuf_write(buf, "}\n", 2);
+    } else {
+        nul_field(buf, "query", query);
+        nul_field(buf, "host", host);
+        nul_field(buf, error != NULL ? "error" : "response", error != NULL ? error : response);
+        outbuf_write(buf, "", 1); // Empty field: end of record
+    }
+}
+
+// Append the record of one finished queue item
+void emit_user_record(OutBuf *buf, QueueItem *item, int output_format, int show_plan) {
+    time_t now = time(NULL);
+
+    if (output_format == OUTPUT_JSON) {
+        outbuf_write(buf, "{", 1);
+        if (item->missing != NULL) {
+            json_member(buf, "query", item->missing, 1);
+            json_member(buf, "error", "User not found", 0);
+        } else {
+            emit_json(buf, &item->user, show_plan, now);
+        }
+        outbuf_write(buf, "}\n", 2);
+    } else {
+        if (item->missing != NULL) {
+            nul_field(buf, "query", item->missing);
+            nul_field(buf, "error", "User not found");
+        } else {
+            emit_nul(buf, &item->user, show_plan, now);
+        }
+        outbuf_write(buf, "", 1); // Empty field: end of record
+    }
+}
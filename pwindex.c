@@ -0,0 +1,1041 @@
+#include "finger.h"
+#include <sys/mman.h>
+
+// Passwd index
+// A single passwd enumeration fills an entry array, then two hash tables are
+// built on top of it: one keyed by login name and one inverted index that maps
+// every lowercase real-name token (GECOS name split on spaces and hyphens) to
+// the entries that contain it. The token slots are also listed in byte order
+// of their token, which acts as a flattened trie: every prefix is a range of
+// that list, so prefix and edit-distance searches walk it depth first.
+//
+// Everything lives in one flat block that only uses 32-bit offsets (entries,
+// hash tables, posting lists, a string pool and the GECOS strings back to back
+// for casefind()), so the same block can be written to disk as is and mapped
+// back with mmap() without any parsing.
+// The file header records the size, mtime and inode of the passwd file it was
+// built from; pwindex_load() rebuilds the file as soon as they change.
+
+#define TOKEN_DELIMS " -"
+#define PWINDEX_MAGIC "FNGRIDX1"
+#define PWINDEX_VERSION 3
+
+// On-disk header of an index file, followed by the sections it describes
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;   // 0x01020304 as written by the building host
+    uint64_t total_size;
+    uint64_t source_size;  // Identity of the passwd file the index was built from
+    int64_t source_mtime_sec;
+    int64_t source_mtime_nsec;
+    uint64_t source_ino;
+    uint32_t entry_count;
+    uint32_t login_mask;
+    uint32_t token_mask;
+    uint32_t id_count;
+    uint64_t entries_offset;
+    uint64_t buckets_offset;
+    uint64_t tokens_offset;
+    uint64_t ids_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+    uint64_t gecos_offset;
+    uint64_t gecos_size;
+    uint64_t sorted_offset;
+    uint64_t sorted_count;
+} PwIndexHeader;
+
+// Hash a string ignoring case (FNV-1a over lowercase bytes)
+uint32_t hash_lower(const char *str, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)tolower((unsigned char)str[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Smallest power of two that is >= value (and at least 16)
+size_t table_size_for(size_t value) {
+    size_t size = 16;
+    while (size < value) {
+        size <<= 1;
+    }
+    return size;
+}
+
+static void *xrealloc(void *ptr, size_t size) {
+    void *grown = realloc(ptr, size);
+    if (grown == NULL) {
+        perror("Error allocating memory for passwd index");
+        exit(EXIT_FAILURE);
+    }
+    return grown;
+}
+
+// Scratch state used while building; flattened into one block at the end
+typedef struct {
+    char *strings;
+    size_t strings_size;
+    size_t strings_capacity;
+    char *gecos;             // GECOS strings in entry order, NUL-separated
+    size_t gecos_size;
+    size_t gecos_capacity;
+    PwEntry *entries;
+    size_t count;
+    size_t capacity;
+    struct {
+        uint32_t token;  // String offset, PWINDEX_NIL if the slot is empty
+        uint32_t *ids;
+        uint32_t count;
+        uint32_t capacity;
+    } *tokens;
+    size_t token_mask;
+    size_t token_count;
+    size_t id_count;
+} Builder;
+
+// Append a string (of `len` bytes) to the pool and return its offset
+static uint32_t add_string(Builder *builder, const char *str, size_t len) {
+    if (builder->strings_size + len + 1 > builder->strings_capacity) {
+        size_t capacity = builder->strings_capacity ? builder->strings_capacity * 2 : 65536;
+        while (capacity < builder->strings_size + len + 1) {
+            capacity *= 2;
+        }
+        builder->strings = xrealloc(builder->strings, capacity);
+        builder->strings_capacity = capacity;
+    }
+    uint32_t offset = (uint32_t)builder->strings_size;
+    memcpy(builder->strings + offset, str, len);
+    builder->strings[offset + len] = '\0';
+    builder->strings_size += len + 1;
+    return offset;
+}
+
+// Append a GECOS string (of `len` bytes) to the GECOS block and return its offset
+static uint32_t add_gecos(Builder *builder, const char *gecos, size_t len) {
+    if (builder->gecos_size + len + 1 > builder->gecos_capacity) {
+        size_t capacity = builder->gecos_capacity ? builder->gecos_capacity * 2 : 65536;
+        while (capacity < builder->gecos_size + len + 1) {
+            capacity *= 2;
+        }
+        builder->gecos = xrealloc(builder->gecos, capacity);
+        builder->gecos_capacity = capacity;
+    }
+    uint32_t offset = (uint32_t)builder->gecos_size;
+    memcpy(builder->gecos + offset, gecos, len);
+    builder->gecos[offset + len] = '\0';
+    builder->gecos_size += len + 1;
+    return offset;
+}
+
+// Append a passwd record to the entry array
+static void builder_add(Builder *builder, const PwRecord *record) {
+    if (builder->count == builder->capacity) {
+        builder->capacity = builder->capacity ? builder->capacity * 2 : 256;
+        builder->entries = xrealloc(builder->entries, builder->capacity * sizeof(PwEntry));
+    }
+
+    // The GECOS fields were split the way get_passwd_info() always has
+    // (strtok() on ",", see pwsource_split_gecos())
+    PwEntry *entry = &builder->entries[builder->count++];
+    entry->login_name = add_string(builder, record->login_name.data, record->login_name.len);
+    entry->gecos = add_gecos(builder, record->gecos.data, record->gecos.len);
+    entry->real_name = add_string(builder, record->gecos_fields[0].data, record->gecos_fields[0].len);
+    entry->office_location = add_string(builder, record->gecos_fields[1].data, record->gecos_fields[1].len);
+    entry->office_phone = add_string(builder, record->gecos_fields[2].data, record->gecos_fields[2].len);
+    entry->home_phone = add_string(builder, record->gecos_fields[3].data, record->gecos_fields[3].len);
+    entry->home_directory = add_string(builder, record->home_directory.data, record->home_directory.len);
+    entry->login_shell = add_string(builder, record->login_shell.data, record->login_shell.len);
+    entry->next_login = PWINDEX_NIL;
+}
+
+// Find the builder slot of a token (or the empty slot where it belongs)
+static size_t builder_token_slot(const Builder *builder, const char *token, size_t len) {
+    size_t slot = hash_lower(token, len) & builder->token_mask;
+    while (builder->tokens[slot].token != PWINDEX_NIL) {
+        const char *existing = builder->strings + builder->tokens[slot].token;
+        if (strncmp(existing, token, len) == 0 && existing[len] == '\0') {
+            break;
+        }
+        slot = (slot + 1) & builder->token_mask;
+    }
+    return slot;
+}
+
+static void builder_init_tokens(Builder *builder, size_t size) {
+    builder->tokens = xrealloc(NULL, size * sizeof(*builder->tokens));
+    builder->token_mask = size - 1;
+    for (size_t i = 0; i < size; i++) {
+        builder->tokens[i].token = PWINDEX_NIL;
+        builder->tokens[i].ids = NULL;
+        builder->tokens[i].count = 0;
+        builder->tokens[i].capacity = 0;
+    }
+}
+
+// Double the token table once it is 70% full
+static void grow_token_table(Builder *builder) {
+    size_t old_size = builder->token_mask + 1;
+    __typeof__(builder->tokens) old = builder->tokens;
+
+    builder_init_tokens(builder, old_size * 2);
+    for (size_t i = 0; i < old_size; i++) {
+        if (old[i].token != PWINDEX_NIL) {
+            const char *token = builder->strings + old[i].token;
+            builder->tokens[builder_token_slot(builder, token, strlen(token))] = old[i];
+        }
+    }
+    free(old);
+}
+
+// Record that entry `id` contains the (already lowercase) token
+static void add_token(Builder *builder, const char *token, size_t len, uint32_t id) {
+    if ((builder->token_count + 1) * 10 > (builder->token_mask + 1) * 7) {
+        grow_token_table(builder);
+    }
+
+    size_t slot = builder_token_slot(builder, token, len);
+    if (builder->tokens[slot].token == PWINDEX_NIL) {
+        builder->tokens[slot].token = add_string(builder, token, len);
+        builder->token_count++;
+    }
+
+    // A name like "Anna-Anna" must not list the same entry twice
+    __typeof__(builder->tokens) bucket = &builder->tokens[slot];
+    if (bucket->count > 0 && bucket->ids[bucket->count - 1] == id) {
+        return;
+    }
+
+    if (bucket->count == bucket->capacity) {
+        bucket->capacity = bucket->capacity ? bucket->capacity * 2 : 2;
+        bucket->ids = xrealloc(bucket->ids, bucket->capacity * sizeof(uint32_t));
+    }
+    bucket->ids[bucket->count++] = id;
+    builder->id_count++;
+}
+
+// Split the real name of every entry into tokens
+static void build_tokens(Builder *builder) {
+    builder_init_tokens(builder, table_size_for(builder->count * 2));
+
+    char token[256];
+    for (size_t id = 0; id < builder->count; id++) {
+        const char *name = builder->strings + builder->entries[id].real_name;
+
+        size_t pos = 0;
+        for (;;) {
+            pos += strspn(name + pos, TOKEN_DELIMS);
+            size_t len = strcspn(name + pos, TOKEN_DELIMS);
+            if (len == 0) {
+                break;
+            }
+            if (len < sizeof(token)) {
+                for (size_t k = 0; k < len; k++) {
+                    token[k] = (char)tolower((unsigned char)name[pos + k]);
+                }
+                // add_token() may grow the pool, so `name` is re-derived each round
+                add_token(builder, token, len, (uint32_t)id);
+                name = builder->strings + builder->entries[id].real_name;
+            }
+            pos += len;
+        }
+    }
+}
+
+static size_t align8(size_t value) {
+    return (value + 7) & ~(size_t)7;
+}
+
+// Point the index at the sections of a complete block
+static void attach_block(PwIndex *index, void *block, size_t size, int mapped) {
+    const PwIndexHeader *header = block;
+    char *base = block;
+
+    index->storage = block;
+    index->storage_size = size;
+    index->mapped = mapped;
+    index->count = header->entry_count;
+    index->entries = (const PwEntry *)(base + header->entries_offset);
+    index->login_buckets = (const uint32_t *)(base + header->buckets_offset);
+    index->login_mask = header->login_mask;
+    index->tokens = (const NameToken *)(base + header->tokens_offset);
+    index->token_mask = header->token_mask;
+    index->ids = (const uint32_t *)(base + header->ids_offset);
+    index->sorted_tokens = (const uint32_t *)(base + header->sorted_offset);
+    index->sorted_count = header->sorted_count;
+    index->strings = base + header->strings_offset;
+    index->strings_size = header->strings_size;
+    index->gecos_block = base + header->gecos_offset;
+    index->gecos_size = header->gecos_size;
+}
+
+// Order token slots by their token (strcmp() compares bytes as unsigned)
+static int compare_token_slots(const void *a, const void *b, void *arg) {
+    const NameToken *tokens = ((const void **)arg)[0];
+    const char *strings = ((const void **)arg)[1];
+    return strcmp(strings + tokens[*(const uint32_t *)a].token, strings + tokens[*(const uint32_t *)b].token);
+}
+
+// Lay the builder out as one block: header, entries, buckets, tokens, ids,
+// sorted token slots, strings, GECOS
+static void flatten(Builder *builder, PwIndex *index, const struct stat *source) {
+    size_t login_size = table_size_for(builder->count * 2);
+    size_t token_size = builder->token_mask + 1;
+
+    size_t entries_offset = align8(sizeof(PwIndexHeader));
+    size_t buckets_offset = align8(entries_offset + builder->count * sizeof(PwEntry));
+    size_t tokens_offset = align8(buckets_offset + login_size * sizeof(uint32_t));
+    size_t ids_offset = align8(tokens_offset + token_size * sizeof(NameToken));
+    size_t sorted_offset = align8(ids_offset + builder->id_count * sizeof(uint32_t));
+    size_t strings_offset = align8(sorted_offset + builder->token_count * sizeof(uint32_t));
+    size_t gecos_offset = align8(strings_offset + builder->strings_size);
+    size_t total_size = align8(gecos_offset + builder->gecos_size);
+
+    char *block = calloc(1, total_size);
+    if (block == NULL) {
+        perror("Error allocating memory for passwd index");
+        exit(EXIT_FAILURE);
+    }
+
+    PwIndexHeader *header = (PwIndexHeader *)block;
+    memcpy(header->magic, PWINDEX_MAGIC, sizeof(header->magic));
+    header->version = PWINDEX_VERSION;
+    header->byte_order = 0x01020304;
+    header->total_size = total_size;
+    if (source != NULL) {
+        header->source_size = (uint64_t)source->st_size;
+        header->source_mtime_sec = source->st_mtim.tv_sec;
+        header->source_mtime_nsec = source->st_mtim.tv_nsec;
+        header->source_ino = (uint64_t)source->st_ino;
+    }
+    header->entry_count = (uint32_t)builder->count;
+    header->login_mask = (uint32_t)(login_size - 1);
+    header->token_mask = (uint32_t)(token_size - 1);
+    header->id_count = (uint32_t)builder->id_count;
+    header->entries_offset = entries_offset;
+    header->buckets_offset = buckets_offset;
+    header->tokens_offset = tokens_offset;
+    header->ids_offset = ids_offset;
+    header->strings_offset = strings_offset;
+    header->strings_size = builder->strings_size;
+    header->gecos_offset = gecos_offset;
+    header->gecos_size = builder->gecos_size;
+    header->sorted_offset = sorted_offset;
+    header->sorted_count = builder->token_count;
+
+    // Entries, chained by login name (inserted in reverse to keep passwd order)
+    PwEntry *entries = (PwEntry *)(block + entries_offset);
+    uint32_t *buckets = (uint32_t *)(block + buckets_offset);
+    memcpy(entries, builder->entries, builder->count * sizeof(PwEntry));
+    for (size_t i = 0; i < login_size; i++) {
+        buckets[i] = PWINDEX_NIL;
+    }
+    for (size_t i = builder->count; i-- > 0; ) {
+        const char *login = builder->strings + entries[i].login_name;
+        size_t slot = hash_lower(login, strlen(login)) & (login_size - 1);
+        entries[i].next_login = buckets[slot];
+        buckets[slot] = (uint32_t)i;
+    }
+
+    // Token slots keep their position; posting lists are packed back to back
+    NameToken *tokens = (NameToken *)(block + tokens_offset);
+    uint32_t *ids = (uint32_t *)(block + ids_offset);
+    uint32_t next_id = 0;
+    for (size_t i = 0; i < token_size; i++) {
+        tokens[i].token = builder->tokens[i].token;
+        tokens[i].ids = next_id;
+        tokens[i].count = builder->tokens[i].count;
+        if (builder->tokens[i].count > 0) {
+            memcpy(ids + next_id, builder->tokens[i].ids, builder->tokens[i].count * sizeof(uint32_t));
+            next_id += builder->tokens[i].count;
+        }
+        free(builder->tokens[i].ids);
+    }
+
+    memcpy(block + strings_offset, builder->strings, builder->strings_size);
+    memcpy(block + gecos_offset, builder->gecos, builder->gecos_size);
+
+    // Occupied slots, sorted by token
+    uint32_t *sorted = (uint32_t *)(block + sorted_offset);
+    size_t sorted_count = 0;
+    for (size_t i = 0; i < token_size; i++) {
+        if (tokens[i].token != PWINDEX_NIL) {
+            sorted[sorted_count++] = (uint32_t)i;
+        }
+    }
+    const void *sort_context[2] = {tokens, block + strings_offset};
+    qsort_r(sorted, sorted_count, sizeof(uint32_t), compare_token_slots, sort_context);
+
+    free(builder->tokens);
+    free(builder->entries);
+    free(builder->strings);
+    free(builder->gecos);
+
+    attach_block(index, block, total_size, 0);
+}
+
+// Enumerate passwd once and build both lookup tables. With a NULL
+// `passwd_file` the NSS database is used (getpwent), otherwise the flat file
+// is mapped and parsed in place (see pwsource.c).
+int pwindex_build(PwIndex *index, const char *passwd_file) {
+    Builder builder = {0};
+    PwSource source;
+    PwRecord record;
+    int rc;
+
+    memset(index, 0, sizeof(*index));
+
+    if (pwsource_open(&source, passwd_file) == -1) {
+        return -1;
+    }
+    while ((rc = pwsource_next(&source, &record)) == 1) {
+        builder_add(&builder, &record);
+    }
+    int saved_errno = errno;
+    struct stat identity = source.identity;
+    int have_identity = source.have_identity;
+    pwsource_close(&source);
+
+    if (rc == -1 && builder.count == 0) {
+        errno = saved_errno;
+        return -1;
+    }
+
+    if (builder.strings == NULL) {
+        add_string(&builder, "", 0); // Keep offset 0 valid for an empty database
+        add_gecos(&builder, "", 0);
+    }
+    build_tokens(&builder);
+    flatten(&builder, index, have_identity ? &identity : NULL);
+    return 0;
+}
+
+// Write the block of a built index to `index_file` (atomically, via rename)
+static int pwindex_save(const PwIndex *index, const char *index_file) {
+    char temp_path[4096];
+    snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", index_file);
+
+    int fd = mkstemp(temp_path);
+    if (fd == -1) {
+        return -1;
+    }
+
+    const char *data = index->storage;
+    size_t written = 0;
+    while (written < index->storage_size) {
+        ssize_t n = write(fd, data + written, index->storage_size - written);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            close(fd);
+            unlink(temp_path);
+            return -1;
+        }
+        written += (size_t)n;
+    }
+    fchmod(fd, 0644);
+    if (close(fd) == -1 || rename(temp_path, index_file) == -1) {
+        unlink(temp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Whether `count` items of `item_size` bytes at `offset` lie inside a block
+// of `size` bytes, at the 8-byte alignment flatten() gives every section
+static int section_fits(uint64_t offset, uint64_t count, size_t item_size, size_t size) {
+    return offset % 8 == 0 && offset <= size && count <= (size - offset) / item_size;
+}
+
+// Check every offset and index stored in the sections of a block whose
+// header is valid, so that a corrupt or foreign index file can never make a
+// lookup read outside the mapping or loop forever
+static int sections_are_valid(const char *block, const PwIndexHeader *header) {
+    const PwEntry *entries = (const PwEntry *)(block + header->entries_offset);
+    const uint32_t *buckets = (const uint32_t *)(block + header->buckets_offset);
+    const NameToken *tokens = (const NameToken *)(block + header->tokens_offset);
+    const uint32_t *ids = (const uint32_t *)(block + header->ids_offset);
+    const uint32_t *sorted = (const uint32_t *)(block + header->sorted_offset);
+    uint64_t strings_size = header->strings_size;
+    uint64_t login_size = (uint64_t)header->login_mask + 1;
+    uint64_t token_size = (uint64_t)header->token_mask + 1;
+
+    // Both string sections end with a NUL, so every offset inside them starts
+    // a terminated string
+    if (block[header->strings_offset + strings_size - 1] != '\0' ||
+        block[header->gecos_offset + header->gecos_size - 1] != '\0') {
+        return 0;
+    }
+
+    for (uint64_t i = 0; i < header->entry_count; i++) {
+        const PwEntry *entry = &entries[i];
+        if (entry->login_name >= strings_size || entry->real_name >= strings_size ||
+            entry->office_location >= strings_size || entry->office_phone >= strings_size ||
+            entry->home_phone >= strings_size || entry->home_directory >= strings_size ||
+            entry->login_shell >= strings_size || entry->gecos >= header->gecos_size) {
+            return 0;
+        }
+        // GECOS strings are stored in entry order (gecos_entry_at() bisects them)
+        if (i > 0 && entry->gecos <= entries[i - 1].gecos) {
+            return 0;
+        }
+        // Chains only point forward (flatten() links them in reverse), which
+        // also rules out cycles
+        if (entry->next_login != PWINDEX_NIL && (entry->next_login <= i || entry->next_login >= header->entry_count)) {
+            return 0;
+        }
+    }
+    for (uint64_t i = 0; i < login_size; i++) {
+        if (buckets[i] != PWINDEX_NIL && buckets[i] >= header->entry_count) {
+            return 0;
+        }
+    }
+
+    uint64_t occupied = 0;
+    for (uint64_t i = 0; i < token_size; i++) {
+        const NameToken *token = &tokens[i];
+        if (token->token == PWINDEX_NIL) {
+            continue;
+        }
+        if (token->token >= strings_size || (uint64_t)token->ids + token->count > header->id_count) {
+            return 0;
+        }
+        occupied++;
+    }
+    // Probing stops at an empty slot, so one must exist
+    if (occupied != header->sorted_count || occupied >= token_size) {
+        return 0;
+    }
+    for (uint64_t i = 0; i < header->id_count; i++) {
+        if (ids[i] >= header->entry_count) {
+            return 0;
+        }
+    }
+    for (uint64_t i = 0; i < header->sorted_count; i++) {
+        if (sorted[i] >= token_size || tokens[sorted[i]].token == PWINDEX_NIL) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Check that a mapped block is an index of the expected shape, in bounds,
+// and built from the passwd file described by `source`
+static int header_is_valid(const PwIndexHeader *header, size_t size, const struct stat *source) {
+    if (size < sizeof(PwIndexHeader) ||
+        memcmp(header->magic, PWINDEX_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != PWINDEX_VERSION ||
+        header->byte_order != 0x01020304 ||
+        header->total_size != size) {
+        return 0;
+    }
+
+    if (header->source_size != (uint64_t)source->st_size ||
+        header->source_mtime_sec != source->st_mtim.tv_sec ||
+        header->source_mtime_nsec != source->st_mtim.tv_nsec ||
+        header->source_ino != (uint64_t)source->st_ino) {
+        return 0; // passwd changed since the index was written
+    }
+
+    uint64_t login_size = (uint64_t)header->login_mask + 1;
+    uint64_t token_size = (uint64_t)header->token_mask + 1;
+    return section_fits(header->entries_offset, header->entry_count, sizeof(PwEntry), size) &&
+           section_fits(header->buckets_offset, login_size, sizeof(uint32_t), size) &&
+           section_fits(header->tokens_offset, token_size, sizeof(NameToken), size) &&
+           section_fits(header->ids_offset, header->id_count, sizeof(uint32_t), size) &&
+           section_fits(header->sorted_offset, header->sorted_count, sizeof(uint32_t), size) &&
+           section_fits(header->strings_offset, header->strings_size, 1, size) &&
+           header->strings_size > 0 && header->strings_size <= PWINDEX_NIL &&
+           section_fits(header->gecos_offset, header->gecos_size, 1, size) &&
+           header->gecos_size > 0 && header->gecos_size <= PWINDEX_NIL &&
+           (login_size & (login_size - 1)) == 0 &&
+           (token_size & (token_size - 1)) == 0 &&
+           sections_are_valid((const char *)header, header);
+}
+
+// Map an existing index file if it is current for `source`. Its entries
+// decide which home directories (and dotfiles) are read, so a file that
+// another user could have written is never used.
+static int pwindex_map(PwIndex *index, const char *index_file, const struct stat *source) {
+    int fd = open(index_file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) == -1 || !file_is_trusted(&statbuf) ||
+        statbuf.st_size < (off_t)sizeof(PwIndexHeader)) {
+        close(fd);
+        return -1;
+    }
+
+    size_t size = (size_t)statbuf.st_size;
+    void *block = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (block == MAP_FAILED) {
+        return -1;
+    }
+
+    if (!header_is_valid(block, size, source)) {
+        munmap(block, size);
+        return -1;
+    }
+
+    memset(index, 0, sizeof(*index));
+    attach_block(index, block, size, 1);
+    return 0;
+}
+
+// Open the passwd index. Without `index_file` this is pwindex_build().
+// Otherwise the index file is mapped if it matches the current size, mtime and
+// inode of `passwd_file` (default /etc/passwd); if not, it is rebuilt from
+// that file and saved for the next run.
+int pwindex_load(PwIndex *index, const char *passwd_file, const char *index_file) {
+    if (index_file == NULL) {
+        return pwindex_build(index, passwd_file);
+    }
+    if (passwd_file == NULL) {
+        passwd_file = PASSWD_FILE;
+    }
+
+    struct stat source;
+    if (stat(passwd_file, &source) == -1) {
+        return -1;
+    }
+    if (pwindex_map(index, index_file, &source) == 0) {
+        return 0;
+    }
+
+    if (pwindex_build(index, passwd_file) == -1) {
+        return -1;
+    }
+    if (pwindex_save(index, index_file) == -1) {
+        fprintf(stderr, "Warning: cannot write passwd index %s: %s\n", index_file, strerror(errno));
+    }
+    return 0;
+}
+
+void pwindex_free(PwIndex *index) {
+    if (index->mapped) {
+        munmap(index->storage, index->storage_size);
+    } else {
+        free(index->storage);
+    }
+    memset(index, 0, sizeof(*index));
+}
+
+// Exact (case-sensitive) login lookup, same semantics as getpwnam()
+const PwEntry *pwindex_find_login(const PwIndex *index, const char *login_name) {
+    if (index->login_buckets == NULL) {
+        return NULL;
+    }
+
+    uint32_t i = index->login_buckets[hash_lower(login_name, strlen(login_name)) & index->login_mask];
+    for ( ; i != PWINDEX_NIL; i = index->entries[i].next_login) {
+        if (strcmp(pw_field(index, index->entries[i].login_name), login_name) == 0) {
+            return &index->entries[i];
+        }
+    }
+    return NULL;
+}
+
+// Append an id to a growable result array
+static void push_id(size_t **ids, size_t *count, size_t *capacity, size_t id) {
+    if (*count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 4;
+        size_t *grown = realloc(*ids, *capacity * sizeof(size_t));
+        if (grown == NULL) {
+            perror("Error allocating memory for match list");
+            exit(EXIT_FAILURE);
+        }
+        *ids = grown;
+    }
+    (*ids)[(*count)++] = id;
+}
+
+// Case-insensitive login lookup; returns a malloc'd array of entry ids
+size_t *pwindex_match_login(const PwIndex *index, const char *login_name, size_t *count) {
+    size_t *ids = NULL;
+    size_t capacity = 0;
+
+    *count = 0;
+    if (index->login_buckets == NULL) {
+        return NULL;
+    }
+
+    uint32_t i = index->login_buckets[hash_lower(login_name, strlen(login_name)) & index->login_mask];
+    for ( ; i != PWINDEX_NIL; i = index->entries[i].next_login) {
+        if (strcasecmp(pw_field(index, index->entries[i].login_name), login_name) == 0) {
+            push_id(&ids, count, &capacity, i);
+        }
+    }
+    return ids;
+}
+
+// Look up the posting list of a single lowercase token
+static const NameToken *find_token(const PwIndex *index, const char *token, size_t len) {
+    if (index->tokens == NULL) {
+        return NULL;
+    }
+
+    size_t slot = hash_lower(token, len) & index->token_mask;
+    while (index->tokens[slot].token != PWINDEX_NIL) {
+        const char *existing = pw_field(index, index->tokens[slot].token);
+        if (strncmp(existing, token, len) == 0 && existing[len] == '\0') {
+            return &index->tokens[slot];
+        }
+        slot = (slot + 1) & index->token_mask;
+    }
+    return NULL;
+}
+
+// Real-name lookup: every word of `name` must be a token of the entry's real
+// name. Returns a malloc'd array of entry ids in passwd order.
+size_t *pwindex_match_name(const PwIndex *index, const char *name, size_t *count) {
+    size_t *ids = NULL;
+    size_t capacity = 0;
+    char token[256];
+    int first = 1;
+
+    *count = 0;
+
+    size_t pos = 0;
+    for (;;) {
+        pos += strspn(name + pos, TOKEN_DELIMS);
+        size_t len = strcspn(name + pos, TOKEN_DELIMS);
+        if (len == 0) {
+            break;
+        }
+        if (len >= sizeof(token)) {
+            free(ids);
+            *count = 0;
+            return NULL;
+        }
+        for (size_t k = 0; k < len; k++) {
+            token[k] = (char)tolower((unsigned char)name[pos + k]);
+        }
+        pos += len;
+
+        const NameToken *bucket = find_token(index, token, len);
+        if (bucket == NULL) {
+            free(ids);
+            *count = 0;
+            return NULL;
+        }
+        const uint32_t *postings = index->ids + bucket->ids;
+
+        if (first) {
+            for (size_t k = 0; k < bucket->count; k++) {
+                push_id(&ids, count, &capacity, postings[k]);
+            }
+            first = 0;
+        } else {
+            // Both lists are sorted by id, so intersect them in one merge pass
+            size_t kept = 0, a = 0, b = 0;
+            while (a < *count && b < bucket->count) {
+                if (ids[a] < postings[b]) {
+                    a++;
+                } else if (ids[a] > postings[b]) {
+                    b++;
+                } else {
+                    ids[kept++] = ids[a];
+                    a++;
+                    b++;
+                }
+            }
+            *count = kept;
+        }
+
+        if (*count == 0) {
+            break;
+        }
+    }
+
+    if (*count == 0) {
+        free(ids);
+        return NULL;
+    }
+    return ids;
+}
+
+#define FUZZY_MAX_WORD 64 // Longer words are only matched exactly or as prefixes
+#define TOKEN_MAX_LEN 255 // build_tokens() skips anything longer
+#define TYPO_SCORE 64     // Score of one edit; a prefix match scores less than that
+#define NO_SCORE UINT32_MAX
+
+static const char *sorted_token(const PwIndex *index, size_t position) {
+    return pw_field(index, index->tokens[index->sorted_tokens[position]].token);
+}
+
+// First position in [low, high) of the sorted tokens whose first `len` bytes
+// compare >= the prefix (or > it, with `after`). The tokens starting with a
+// prefix are the range between the two bounds.
+static size_t prefix_bound(const PwIndex *index, size_t low, size_t high, const char *prefix, size_t len, int after) {
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        int cmp = strncmp(sorted_token(index, mid), prefix, len);
+        if (cmp < 0 || (after && cmp == 0)) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// First position after `position` (whose token starts with the prefix) that
+// does not start with it. Ranges skipped by a walk are mostly short, so this
+// gallops forward before the binary search.
+static size_t skip_prefix(const PwIndex *index, size_t position, const char *prefix, size_t len) {
+    size_t low = position + 1;
+    size_t step = 1;
+    while (low < index->sorted_count && strncmp(sorted_token(index, low), prefix, len) == 0) {
+        position = low;
+        low = position + step;
+        step *= 2;
+    }
+    size_t high = low < index->sorted_count ? low : index->sorted_count;
+    return prefix_bound(index, position + 1, high, prefix, len, 1);
+}
+
+// Give every entry that has the token in sorted position `position` at most `score`
+static void score_token(const PwIndex *index, size_t position, uint32_t score, uint32_t *scores) {
+    const NameToken *bucket = &index->tokens[index->sorted_tokens[position]];
+    const uint32_t *postings = index->ids + bucket->ids;
+    for (uint32_t k = 0; k < bucket->count; k++) {
+        if (score < scores[postings[k]]) {
+            scores[postings[k]] = score;
+        }
+    }
+}
+
+// Tokens within `max_distance` edits of `word`, counted as optimal string
+// alignment: Levenshtein plus swapping two adjacent letters ("smiht" is one
+// edit from "smith"). The sorted tokens are walked like a trie: the distance
+// rows of the prefix shared with the previous token are kept, and once every
+// cell of a row is over the bound the whole range of tokens below that prefix
+// is skipped (a swap reaches back two rows, and no row is more than one below
+// the one before, so nothing under it can come back within the bound).
+static void score_near_tokens(const PwIndex *index, const char *word, size_t len, uint32_t max_distance, uint32_t *scores) {
+    size_t width = len + 1;
+    uint32_t *rows = xrealloc(NULL, (TOKEN_MAX_LEN + 1) * width * sizeof(uint32_t));
+    char path[TOKEN_MAX_LEN];
+    size_t depth = 0; // rows[0 .. depth] describe path[0 .. depth)
+
+    for (size_t j = 0; j <= len; j++) {
+        rows[j] = (uint32_t)j;
+    }
+
+    size_t position = 0;
+    while (position < index->sorted_count) {
+        const char *token = sorted_token(index, position);
+        size_t token_len = strnlen(token, TOKEN_MAX_LEN + 1);
+        if (token_len > TOKEN_MAX_LEN) {
+            position++;
+            continue;
+        }
+
+        size_t common = 0;
+        while (common < depth && path[common] == token[common]) {
+            common++;
+        }
+        depth = common;
+
+        int pruned = 0;
+        while (depth < token_len) {
+            const uint32_t *above = rows + depth * width;
+            uint32_t *row = rows + (depth + 1) * width;
+            char c = token[depth];
+            uint32_t best = row[0] = (uint32_t)(depth + 1);
+            for (size_t j = 1; j <= len; j++) {
+                uint32_t cost = above[j - 1] + (word[j - 1] != c);
+                uint32_t insert = row[j - 1] + 1;
+                uint32_t remove = above[j] + 1;
+                row[j] = cost < insert ? (cost < remove ? cost : remove) : (insert < remove ? insert : remove);
+                if (depth > 0 && j > 1 && word[j - 1] == path[depth - 1] && word[j - 2] == c) {
+                    uint32_t swap = rows[(depth - 1) * width + j - 2] + 1;
+                    row[j] = swap < row[j] ? swap : row[j];
+                }
+                best = row[j] < best ? row[j] : best;
+            }
+            path[depth++] = c;
+            if (best > max_distance) {
+                pruned = 1;
+                break;
+            }
+        }
+
+        if (pruned) {
+            position = skip_prefix(index, position, path, depth);
+            continue;
+        }
+        uint32_t distance = rows[depth * width + len];
+        if (distance <= max_distance) {
+            score_token(index, position, distance * TYPO_SCORE, scores);
+        }
+        position++;
+    }
+    free(rows);
+}
+
+// Best score of every entry for one (lowercase) word: 0 for the whole token,
+// the number of missing letters for a longer token it is a prefix of, and
+// TYPO_SCORE per edit for a token a typo or two away
+static void score_word(const PwIndex *index, const char *word, size_t len, uint32_t *scores) {
+    size_t end = prefix_bound(index, 0, index->sorted_count, word, len, 1);
+    for (size_t position = prefix_bound(index, 0, end, word, len, 0); position < end; position++) {
+        size_t missing = strlen(sorted_token(index, position)) - len;
+        score_token(index, position, missing < TYPO_SCORE ? (uint32_t)missing : TYPO_SCORE - 1, scores);
+    }
+
+    // One typo per word of up to five letters, two beyond that
+    if (len >= 3 && len <= FUZZY_MAX_WORD) {
+        score_near_tokens(index, word, len, len <= 5 ? 1 : 2, scores);
+    }
+}
+
+// Approximate real-name search for when pwindex_match_name() finds nothing:
+// every word of `name` must match a token of the entry's real name exactly,
+// as a prefix or within one or two typos. Returns a malloc'd array of at most
+// `limit` entry ids, closest matches first and then in passwd order.
+size_t *pwindex_search_name(const PwIndex *index, const char *name, size_t limit, size_t *count) {
+    char word[256];
+    size_t matched = 0;
+
+    *count = 0;
+    if (index->count == 0 || limit == 0) {
+        return NULL;
+    }
+
+    // Summed scores of the entries still in the running, and those of the current word
+    uint32_t *totals = xrealloc(NULL, index->count * sizeof(uint32_t));
+    uint32_t *scores = xrealloc(NULL, index->count * sizeof(uint32_t));
+    memset(totals, 0, index->count * sizeof(uint32_t));
+
+    size_t pos = 0;
+    for (;;) {
+        pos += strspn(name + pos, TOKEN_DELIMS);
+        size_t len = strcspn(name + pos, TOKEN_DELIMS);
+        if (len == 0) {
+            break;
+        }
+        if (len >= sizeof(word)) {
+            matched = 0;
+            break;
+        }
+        for (size_t k = 0; k < len; k++) {
+            word[k] = (char)tolower((unsigned char)name[pos + k]);
+        }
+        word[len] = '\0';
+        pos += len;
+
+        memset(scores, 0xff, index->count * sizeof(uint32_t));
+        score_word(index, word, len, scores);
+
+        matched = 0;
+        for (size_t id = 0; id < index->count; id++) {
+            if (totals[id] == NO_SCORE || scores[id] == NO_SCORE) {
+                totals[id] = NO_SCORE;
+            } else {
+                totals[id] += scores[id];
+                matched++;
+            }
+        }
+        if (matched == 0) {
+            break;
+        }
+    }
+
+    size_t *ids = NULL;
+    if (matched > 0) {
+        // Keep the `limit` best in rank order with an insertion pass; ids are
+        // visited in passwd order, so equal scores stay in that order
+        ids = xrealloc(NULL, limit * sizeof(size_t));
+        for (size_t id = 0; id < index->count; id++) {
+            if (totals[id] == NO_SCORE) {
+                continue;
+            }
+            if (*count == limit && totals[ids[limit - 1]] <= totals[id]) {
+                continue;
+            }
+            size_t slot = *count < limit ? (*count)++ : limit - 1;
+            while (slot > 0 && totals[ids[slot - 1]] > totals[id]) {
+                ids[slot] = ids[slot - 1];
+                slot--;
+            }
+            ids[slot] = id;
+        }
+    }
+
+    free(scores);
+    free(totals);
+    return ids;
+}
+
+// Entry whose GECOS string contains byte `offset` of the GECOS block. Entries
+// store their strings in order, so this is a binary search on their offsets.
+static size_t gecos_entry_at(const PwIndex *index, size_t offset) {
+    size_t low = 0;
+    size_t high = index->count;
+    while (high - low > 1) {
+        size_t mid = low + (high - low) / 2;
+        if (index->entries[mid].gecos <= offset) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Case-insensitive substring search over every GECOS field in one pass of
+// casefind() over the GECOS block. Returns the ids of all matching entries in
+// passwd order (malloc'd, NULL if there are none).
+size_t *pwindex_match_gecos(const PwIndex *index, const char *needle, size_t *count) {
+    size_t *ids = NULL;
+    size_t capacity = 0;
+    *count = 0;
+    if (index->count == 0) {
+        return NULL;
+    }
+
+    char *folded = strdup(needle);
+    if (folded == NULL) {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+    size_t needle_len = strlen(casefind_fold(folded));
+
+    size_t offset = 0;
+    while (offset < index->gecos_size) {
+        const char *hit = casefind(index->gecos_block + offset, index->gecos_size - offset, folded, needle_len);
+        if (hit == NULL) {
+            break;
+        }
+        size_t id = gecos_entry_at(index, (size_t)(hit - index->gecos_block));
+        if (*count == capacity) {
+            capacity = capacity ? capacity * 2 : 8;
+            ids = xrealloc(ids, capacity * sizeof(size_t));
+        }
+        ids[(*count)++] = id;
+
+        // Resume after this entry's string: one hit per entry
+        offset = id + 1 < index->count ? index->entries[id + 1].gecos : index->gecos_size;
+    }
+
+    free(folded);
+    return ids;
+}
+
+// Substring search over every GECOS field; returns the first match.
+// Only used by get_passwd_info() when it is handed something that is not a login.
+const PwEntry *pwindex_find_gecos(const PwIndex *index, const char *needle) {
+    size_t count;
+    size_t *ids = pwindex_match_gecos(index, needle, &count);
+    const PwEntry *entry = count > 0 ? &index->entries[ids[0]] : NULL;
+    free(ids);
+    return entry;
+}
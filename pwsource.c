@@ -0,0 +1,205 @@
+#include "finger.h"
+#include <sys/mman.h>
+
+// Passwd sources
+// The passwd index is built from one enumeration of a passwd source:
+//   - PWSOURCE_NSS: the system database through getpwent(), so LDAP, SSSD or
+//     any other NSS module keeps working (the default)
+//   - PWSOURCE_FILE: a passwd-format file (-P), mapped with mmap() and parsed
+//     in place
+// Both hand out PwRecords whose fields are slices (pointer and length) into
+// storage the source owns, valid until the next pwsource_next(). The file
+// parser never copies, allocates or NUL-terminates anything: it finds the
+// colons and commas with memchr() and the index builder copies each slice
+// straight into its string pool. It accepts and rejects exactly the lines
+// fgetpwent() does, so -P builds the same index as before.
+
+static const PwSlice empty_slice = {"", 0};
+
+static PwSlice slice_of(const char *str) {
+    return str ? (PwSlice){str, strlen(str)} : empty_slice;
+}
+
+// Split GECOS like strtok() on ",": empty fields collapse and only the
+// first four are kept; missing ones are empty
+void pwsource_split_gecos(PwSlice gecos, PwSlice fields[4]) {
+    const char *p = gecos.data;
+    const char *end = gecos.data + gecos.len;
+
+    for (int i = 0; i < 4; i++) {
+        while (p < end && *p == ',') {
+            p++;
+        }
+        const char *comma = p < end ? memchr(p, ',', (size_t)(end - p)) : NULL;
+        const char *stop = comma ? comma : end;
+        fields[i] = p < end ? (PwSlice){p, (size_t)(stop - p)} : empty_slice;
+        p = stop;
+    }
+}
+
+// Take the field that starts at `*p` and ends at the next ':' (or at `end`).
+// 1 if a ':' ended it; `*p` is left after the colon.
+static int take_field(const char **p, const char *end, PwSlice *field) {
+    const char *colon = memchr(*p, ':', (size_t)(end - *p));
+    const char *stop = colon ? colon : end;
+    *field = (PwSlice){*p, (size_t)(stop - *p)};
+    *p = colon ? colon + 1 : end;
+    return colon != NULL;
+}
+
+// Check a uid/gid field the way fgetpwent() reads it (strtoul() into 32
+// bits, nothing after the digits). `allow_empty` accepts a field without
+// digits, as NIS compat entries may have.
+static int valid_id(PwSlice field, int allow_empty) {
+    const char *p = field.data;
+    const char *end = field.data + field.len;
+    while (p < end && isspace((unsigned char)*p)) {
+        p++;
+    }
+    int negative = p < end && *p == '-';
+    if (p < end && (*p == '+' || *p == '-')) {
+        p++;
+    }
+    if (p == end || !isdigit((unsigned char)*p)) {
+        return allow_empty && field.len == 0;
+    }
+    uint64_t value = 0;
+    for (; p < end && isdigit((unsigned char)*p); p++) {
+        value = value * 10 + (uint64_t)(*p - '0');
+        if (value > UINT32_MAX) {
+            return 0;
+        }
+    }
+    return p == end && !(negative && value != 0);
+}
+
+// Parse one line of a passwd file; 0 if fgetpwent() would skip it
+static int parse_line(const char *line, const char *end, PwRecord *record) {
+    const char *p = line;
+    PwSlice password;
+    PwSlice uid;
+    PwSlice gid;
+
+    *record = (PwRecord){empty_slice, empty_slice, {empty_slice, empty_slice, empty_slice, empty_slice},
+                         empty_slice, empty_slice};
+    take_field(&p, end, &record->login_name);
+    int compat = record->login_name.len > 0 && (line[0] == '+' || line[0] == '-');
+    if (compat && p == end) {
+        return 1; // "+name" or "-name" alone includes or excludes a NIS user
+    }
+    if (!take_field(&p, end, &password) || !take_field(&p, end, &uid) || !valid_id(uid, compat)) {
+        return 0;
+    }
+    if (p == end) {
+        return 0; // Even an empty gid needs its field
+    }
+    if (take_field(&p, end, &gid)) {
+        if (take_field(&p, end, &record->gecos)) {
+            if (take_field(&p, end, &record->home_directory)) {
+                record->login_shell = (PwSlice){p, (size_t)(end - p)}; // The rest, colons included
+            }
+        }
+    }
+    if (!valid_id(gid, compat)) {
+        return 0;
+    }
+    pwsource_split_gecos(record->gecos, record->gecos_fields);
+    return 1;
+}
+
+// Next record of the mapped file; 0 at the end
+static int next_file_record(PwSource *source, PwRecord *record) {
+    while (source->pos < source->size) {
+        const char *line = source->data + source->pos;
+        size_t left = source->size - source->pos;
+        const char *newline = memchr(line, '\n', left);
+        const char *end = newline ? newline : line + left;
+        source->pos += (size_t)(end - line) + (newline != NULL);
+
+        const char *nul = memchr(line, '\0', (size_t)(end - line));
+        if (nul != NULL) {
+            end = nul; // fgetpwent() parses C strings: a NUL byte ends the line
+        }
+        while (line < end && isspace((unsigned char)*line)) {
+            line++;
+        }
+        if (line == end || *line == '#') {
+            continue;
+        }
+        if (parse_line(line, end, record)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Next record of the NSS database; 0 at the end
+static int next_nss_record(PwRecord *record) {
+    errno = 0;
+    struct passwd *pw = getpwent();
+    if (pw == NULL) {
+        return errno == 0 || errno == ENOENT ? 0 : -1;
+    }
+    record->login_name = slice_of(pw->pw_name);
+    record->gecos = slice_of(pw->pw_gecos);
+    record->home_directory = slice_of(pw->pw_dir);
+    record->login_shell = slice_of(pw->pw_shell);
+    pwsource_split_gecos(record->gecos, record->gecos_fields);
+    return 1;
+}
+
+// Open the NSS database (NULL `passwd_file`) or map a passwd-format file
+int pwsource_open(PwSource *source, const char *passwd_file) {
+    memset(source, 0, sizeof(*source));
+
+    if (passwd_file == NULL) {
+        source->kind = PWSOURCE_NSS;
+        setpwent(); // Reset passwd file to beginning
+        return 0;
+    }
+
+    source->kind = PWSOURCE_FILE;
+    int fd = open(passwd_file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    if (fstat(fd, &source->identity) == -1) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    source->have_identity = 1;
+    if (source->identity.st_size > 0) {
+        void *data = mmap(NULL, (size_t)source->identity.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            int saved_errno = errno;
+            close(fd);
+            errno = saved_errno;
+            return -1;
+        }
+        madvise(data, (size_t)source->identity.st_size, MADV_SEQUENTIAL);
+        source->data = data;
+        source->size = (size_t)source->identity.st_size;
+    }
+    close(fd);
+    return 0;
+}
+
+// Fetch the next record: 1 if `record` was filled, 0 at the end, -1 on a
+// read error (errno set)
+int pwsource_next(PwSource *source, PwRecord *record) {
+    if (source->kind == PWSOURCE_NSS) {
+        return next_nss_record(record);
+    }
+    return next_file_record(source, record);
+}
+
+void pwsource_close(PwSource *source) {
+    if (source->kind == PWSOURCE_NSS) {
+        endpwent(); // Close passwd file
+    } else if (source->data != NULL) {
+        munmap((void *)source->data, source->size);
+    }
+    memset(source, 0, sizeof(*source));
+}
@@ -0,0 +1,501 @@
+#include "finger.h"
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <signal.h>
+
+// Remote queries (user@host)
+// Every user@host argument is one RFC 1288 connection, and all of them run
+// at once: sockets are non-blocking, connects and reads are multiplexed in
+// one epoll loop, and each query has its own deadline covering resolution,
+// connect and the whole answer. An answer is printed as soon as it is
+// complete, so the run takes about as long as the slowest host, not the sum
+// of all of them. Host names are resolved by a few threads (getaddrinfo()
+// blocks) that hand each result to the loop through a pipe; numeric
+// addresses are used directly. The threads are detached and work on their
+// own copies of the names, so a lookup that hangs past every deadline does
+// not hold up the run: its late result is dropped by whichever of the loop
+// and the threads lets go of the shared resolver last.
+//
+// A host may carry a port, as in user@127.0.0.1:7979 or user@[::1]:7979,
+// which is how local stand-in servers (finger -S) are queried.
+
+#define REMOTE_PORT "79"
+#define REMOTE_RESOLVERS 16             // Resolver threads, at most
+#define REMOTE_MAX_CONNECTIONS 512      // Sockets open at once; later queries wait
+#define REMOTE_MAX_RESPONSE (1 << 20)   // Longer answers are cut
+#define REMOTE_MAX_EVENTS 64
+#define REMOTE_REQUEST_SIZE 512
+
+enum { REMOTE_RESOLVING, REMOTE_WAITING, REMOTE_CONNECTING, REMOTE_READING, REMOTE_DONE };
+
+typedef struct {
+    const char *query;             // The argument as given
+    char *user;                    // Split copy of the query: user, host and port
+    char *host;
+    char *port;
+    struct addrinfo *addresses;
+    struct addrinfo *next_address; // Tried after the current one fails
+    int state;
+    int fd;
+    char request[REMOTE_REQUEST_SIZE];
+    size_t request_len;
+    size_t sent;
+    char *response;
+    size_t response_len;
+    size_t response_capacity;
+    const char *error;             // Set when the query failed
+    uint64_t deadline;             // stats_now() clock
+} RemoteQuery;
+
+// One host name to look up, copied so that it outlives the queries
+typedef struct {
+    char *host;
+    char *port;
+    struct addrinfo *addresses; // Left here if the query gave up meanwhile
+    int status;                 // getaddrinfo() result
+} ResolveJob;
+
+// Shared by the event loop and the resolver threads; freed by the last one
+typedef struct {
+    ResolveJob *jobs;
+    size_t count;
+    size_t next;        // Next job to take
+    int refs;           // The event loop and every running thread
+    pthread_mutex_t lock;
+    int notify_fd;      // Write end of the pipe to the event loop
+} Resolver;
+
+// Split "user@host[:port]" in place; the host may be a bracketed IPv6 address
+static int split_query(RemoteQuery *query) {
+    char *copy = strdup(query->query);
+    if (copy == NULL) {
+        return -1;
+    }
+    char *at = strrchr(copy, '@');
+    *at = '\0';
+    query->user = copy;
+    query->host = at + 1;
+    query->port = REMOTE_PORT;
+
+    if (query->host[0] == '[') {
+        char *close = strchr(query->host, ']');
+        if (close == NULL || (close[1] != '\0' && close[1] != ':')) {
+            return -1;
+        }
+        *close = '\0';
+        query->host++;
+        if (close[1] == ':') {
+            query->port = close + 2;
+        }
+    } else {
+        char *colon = strchr(query->host, ':');
+        if (colon != NULL && strchr(colon + 1, ':') == NULL) { // One colon: host:port, more: bare IPv6
+            *colon = '\0';
+            query->port = colon + 1;
+        }
+    }
+    return query->host[0] != '\0' && query->port[0] != '\0' ? 0 : -1;
+}
+
+static int resolve(const char *host, const char *port, int flags, struct addrinfo **addresses) {
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = flags;
+    return getaddrinfo(host, port, &hints, addresses);
+}
+
+static void resolver_ref(Resolver *resolver) {
+    pthread_mutex_lock(&resolver->lock);
+    resolver->refs++;
+    pthread_mutex_unlock(&resolver->lock);
+}
+
+// Drop a reference; the last one frees the resolver and any late results
+static void resolver_unref(Resolver *resolver) {
+    pthread_mutex_lock(&resolver->lock);
+    int last = --resolver->refs == 0;
+    pthread_mutex_unlock(&resolver->lock);
+    if (!last) {
+        return;
+    }
+    for (size_t j = 0; j < resolver->count; j++) {
+        if (resolver->jobs[j].addresses != NULL) {
+            freeaddrinfo(resolver->jobs[j].addresses);
+        }
+        free(resolver->jobs[j].host);
+        free(resolver->jobs[j].port);
+    }
+    close(resolver->notify_fd);
+    pthread_mutex_destroy(&resolver->lock);
+    free(resolver->jobs);
+    free(resolver);
+}
+
+static void *resolver_main(void *arg) {
+    Resolver *resolver = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&resolver->lock);
+        size_t next = resolver->next < resolver->count ? resolver->next++ : resolver->count;
+        pthread_mutex_unlock(&resolver->lock);
+        if (next == resolver->count) {
+            break;
+        }
+
+        // Only this thread touches the job until its index is written
+        ResolveJob *job = &resolver->jobs[next];
+        job->status = resolve(job->host, job->port, 0, &job->addresses);
+        // An index is smaller than PIPE_BUF, so the write is atomic. Once the
+        // loop has returned the read end is closed and this fails (EPIPE).
+        while (write(resolver->notify_fd, &next, sizeof(next)) == -1 && errno == EINTR) {
+        }
+    }
+    resolver_unref(resolver);
+    return NULL;
+}
+
+// Copy the answer into `text` with LF line ends and every other control
+// character (escape sequences included) shown as '?'
+static char *sanitize_response(const RemoteQuery *query) {
+    char *text = malloc(query->response_len + 1);
+    if (text == NULL) {
+        return NULL;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < query->response_len; i++) {
+        unsigned char c = (unsigned char)query->response[i];
+        if (c == '\r' && i + 1 < query->response_len && query->response[i + 1] == '\n') {
+            continue;
+        }
+        text[n++] = (c < 0x20 && c != '\n' && c != '\t') || c == 0x7f ? '?' : (char)c;
+    }
+    text[n] = '\0';
+    return text;
+}
+
+// Print a finished query: "[host]" and the answer, or the error on stderr
+static void report_query(RemoteQuery *query, const FingerOptions *options, OutBuf *buf) {
+    const char *host = strrchr(query->query, '@') + 1; // As given, with the port
+    char *text = query->error == NULL ? sanitize_response(query) : NULL;
+    if (query->error == NULL && text == NULL) {
+        query->error = "out of memory";
+    }
+
+    if (options->output_format != OUTPUT_TEXT) {
+        emit_remote_record(buf, query->query, host, text, query->error, options->output_format);
+        outbuf_flush(buf); // Streamed: one record per finished host
+    } else if (query->error != NULL) {
+        fflush(stdout);
+        fprintf(stderr, "finger: %s: %s\n", query->query, query->error);
+    } else {
+        size_t len = strlen(text);
+        printf("[%s]\n%s", host, text);
+        if (len > 0 && text[len - 1] != '\n') {
+            putchar('\n');
+        }
+        fflush(stdout);
+    }
+    free(text);
+}
+
+static void finish_query(RemoteQuery *query, int epoll_fd, size_t *open_count, const char *error) {
+    if (query->fd != -1) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, query->fd, NULL);
+        close(query->fd);
+        query->fd = -1;
+        (*open_count)--;
+    }
+    if (error != NULL && query->error == NULL) {
+        query->error = error;
+    }
+    query->state = REMOTE_DONE;
+}
+
+// Start a non-blocking connect to the next address of the query. Returns
+// -1 once every address has failed (query->error says why).
+static int start_connect(RemoteQuery *query, int epoll_fd, size_t *open_count) {
+    while (query->next_address != NULL) {
+        struct addrinfo *ai = query->next_address;
+        query->next_address = ai->ai_next;
+
+        int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd == -1) {
+            query->error = strerror(errno);
+            continue;
+        }
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == -1 && errno != EINPROGRESS) {
+            query->error = strerror(errno);
+            close(fd);
+            continue;
+        }
+        struct epoll_event event = {.events = EPOLLOUT, .data.ptr = query};
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            query->error = strerror(errno);
+            close(fd);
+            continue;
+        }
+        query->fd = fd;
+        query->state = REMOTE_CONNECTING;
+        query->error = NULL;
+        query->sent = 0;
+        (*open_count)++;
+        return 0;
+    }
+    if (query->error == NULL) {
+        query->error = "no address";
+    }
+    return -1;
+}
+
+// Connected (or failed): send the query line, then wait for the answer
+static void handle_connecting(RemoteQuery *query, int epoll_fd, size_t *open_count) {
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(query->fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1) {
+        error = errno;
+    }
+    if (error != 0) {
+        // Try the host's next address, if it has one
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, query->fd, NULL);
+        close(query->fd);
+        query->fd = -1;
+        (*open_count)--;
+        query->error = strerror(error);
+        if (start_connect(query, epoll_fd, open_count) == -1) {
+            finish_query(query, epoll_fd, open_count, NULL);
+        }
+        return;
+    }
+
+    while (query->sent < query->request_len) {
+        ssize_t n = send(query->fd, query->request + query->sent, query->request_len - query->sent, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                finish_query(query, epoll_fd, open_count, strerror(errno));
+            }
+            return; // EPOLLOUT again when there is room
+        }
+        query->sent += (size_t)n;
+    }
+    shutdown(query->fd, SHUT_WR);
+    query->state = REMOTE_READING;
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = query};
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, query->fd, &event);
+}
+
+// Read what has arrived; the answer is complete when the server closes
+static void handle_reading(RemoteQuery *query, int epoll_fd, size_t *open_count) {
+    for (;;) {
+        if (query->response_len == query->response_capacity) {
+            if (query->response_capacity >= REMOTE_MAX_RESPONSE) {
+                finish_query(query, epoll_fd, open_count, NULL); // Keep what fits
+                return;
+            }
+            size_t capacity = query->response_capacity ? query->response_capacity * 2 : 4096;
+            char *response = realloc(query->response, capacity);
+            if (response == NULL) {
+                finish_query(query, epoll_fd, open_count, "out of memory");
+                return;
+            }
+            query->response = response;
+            query->response_capacity = capacity;
+        }
+
+        ssize_t n = recv(query->fd, query->response + query->response_len, query->response_capacity - query->response_len, 0);
+        if (n > 0) {
+            query->response_len += (size_t)n;
+        } else if (n == 0) {
+            finish_query(query, epoll_fd, open_count, NULL);
+            return;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        } else {
+            finish_query(query, epoll_fd, open_count, strerror(errno));
+            return;
+        }
+    }
+}
+
+// Look up every user@host query at once and print each answer as it completes
+int run_remote_queries(char *const queries[], size_t count, const FingerOptions *options) {
+    RemoteQuery *items = calloc(count ? count : 1, sizeof(RemoteQuery));
+    size_t *pending = malloc((count ? count : 1) * sizeof(size_t)); // Query of each resolver job
+    Resolver *resolver = calloc(1, sizeof(Resolver));
+    ResolveJob *jobs = calloc(count ? count : 1, sizeof(ResolveJob));
+    int notify[2];
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (items == NULL || pending == NULL || resolver == NULL || jobs == NULL || epoll_fd == -1 ||
+        pipe2(notify, O_CLOEXEC) == -1) {
+        perror("Error starting remote queries");
+        free(items);
+        free(pending);
+        free(resolver);
+        free(jobs);
+        return -1;
+    }
+    fcntl(notify[0], F_SETFL, O_NONBLOCK); // The loop drains it; resolvers may block on a full pipe
+    signal(SIGPIPE, SIG_IGN);
+
+    OutBuf buf;
+    outbuf_init(&buf, stdout);
+    uint64_t timeout = (uint64_t)(options->remote_timeout * 1e9);
+    uint64_t start = stats_now();
+    size_t open_count = 0;
+    size_t remaining = count;
+    size_t unresolved = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        RemoteQuery *query = &items[i];
+        query->query = queries[i];
+        query->fd = -1;
+        query->deadline = start + timeout;
+        query->state = REMOTE_WAITING;
+        if (split_query(query) == -1) {
+            query->error = "invalid host";
+            query->state = REMOTE_DONE;
+            continue;
+        }
+        // {Q1} ::= [{W}|{W}{S}{U}]{C}; "/W" asks for the long format
+        int len = snprintf(query->request, sizeof(query->request), "%s%s\r\n",
+                           options->long_format ? "/W " : "", query->user);
+        if (len < 0 || (size_t)len >= sizeof(query->request)) {
+            query->error = "query too long";
+            query->state = REMOTE_DONE;
+            continue;
+        }
+        query->request_len = (size_t)len;
+        if (resolve(query->host, query->port, AI_NUMERICHOST | AI_NUMERICSERV, &query->addresses) != 0) {
+            query->addresses = NULL;
+            ResolveJob *job = &jobs[unresolved];
+            job->host = strdup(query->host);
+            job->port = strdup(query->port);
+            if (job->host == NULL || job->port == NULL) {
+                free(job->host);
+                free(job->port);
+                job->host = job->port = NULL;
+                query->error = "out of memory";
+                query->state = REMOTE_DONE;
+                continue;
+            }
+            query->state = REMOTE_RESOLVING; // A name: left to the resolver threads
+            pending[unresolved++] = i;
+        }
+        query->next_address = query->addresses;
+    }
+
+    // The resolver threads need the jobs above, so they start only now
+    resolver->jobs = jobs;
+    resolver->count = unresolved;
+    resolver->refs = 1; // The event loop
+    resolver->notify_fd = notify[1];
+    pthread_mutex_init(&resolver->lock, NULL);
+    int started = 0;
+    for (size_t t = 0; t < unresolved && t < REMOTE_RESOLVERS; t++) {
+        resolver_ref(resolver); // The thread's, taken now: earlier threads already run
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, resolver_main, resolver) == 0) {
+            pthread_detach(thread);
+            started++;
+        } else {
+            resolver_unref(resolver);
+        }
+    }
+    if (unresolved > 0 && started == 0) {
+        resolver_ref(resolver);
+        resolver_main(resolver); // No threads: resolve here, one at a time
+    }
+    struct epoll_event notify_event = {.events = EPOLLIN, .data.ptr = resolver};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, notify[0], &notify_event);
+
+    while (remaining > 0) {
+        // Report finished queries, start waiting ones while sockets are free
+        uint64_t now = stats_now();
+        uint64_t next_deadline = UINT64_MAX;
+        for (size_t i = 0; i < count; i++) {
+            RemoteQuery *query = &items[i];
+            if (query->state != REMOTE_DONE && now >= query->deadline) {
+                finish_query(query, epoll_fd, &open_count, "timed out");
+            }
+            if (query->state == REMOTE_WAITING && open_count < REMOTE_MAX_CONNECTIONS &&
+                start_connect(query, epoll_fd, &open_count) == -1) {
+                finish_query(query, epoll_fd, &open_count, NULL);
+            }
+            if (query->state == REMOTE_DONE && query->deadline != 0) {
+                report_query(query, options, &buf);
+                query->deadline = 0; // Reported
+                remaining--;
+            } else if (query->state != REMOTE_DONE && query->deadline < next_deadline) {
+                next_deadline = query->deadline;
+            }
+        }
+        if (remaining == 0) {
+            break;
+        }
+
+        int wait_ms = next_deadline == UINT64_MAX ? -1 : (int)((next_deadline - now) / 1000000 + 1);
+        struct epoll_event events[REMOTE_MAX_EVENTS];
+        int ready = epoll_wait(epoll_fd, events, REMOTE_MAX_EVENTS, wait_ms);
+        if (ready == -1 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        for (int e = 0; e < ready; e++) {
+            if (events[e].data.ptr == resolver) {
+                size_t j;
+                while (read(notify[0], &j, sizeof(j)) == (ssize_t)sizeof(j)) {
+                    RemoteQuery *query = &items[pending[j]];
+                    ResolveJob *job = &jobs[j]; // Its thread is done with it
+                    if (query->state != REMOTE_RESOLVING) {
+                        continue; // Timed out meanwhile; the addresses go with the resolver
+                    }
+                    if (job->status != 0) {
+                        finish_query(query, epoll_fd, &open_count, gai_strerror(job->status));
+                    } else {
+                        query->addresses = job->addresses;
+                        job->addresses = NULL;
+                        query->next_address = query->addresses;
+                        query->state = REMOTE_WAITING;
+                    }
+                }
+                continue;
+            }
+            RemoteQuery *query = events[e].data.ptr;
+            if (query->state == REMOTE_CONNECTING) {
+                handle_connecting(query, epoll_fd, &open_count);
+            } else if (query->state == REMOTE_READING) {
+                handle_reading(query, epoll_fd, &open_count);
+            }
+        }
+    }
+
+    // Lookups still running are not waited for: no job is handed out any
+    // more, the threads find the pipe closed and the last one frees the rest
+    pthread_mutex_lock(&resolver->lock);
+    resolver->next = resolver->count;
+    pthread_mutex_unlock(&resolver->lock);
+    close(notify[0]);
+    resolver_unref(resolver);
+
+    outbuf_flush(&buf);
+    outbuf_free(&buf);
+    int failed = 0;
+    for (size_t i = 0; i < count; i++) {
+        failed |= items[i].error != NULL;
+        if (items[i].addresses != NULL) {
+            freeaddrinfo(items[i].addresses);
+        }
+        free(items[i].user);
+        free(items[i].response);
+    }
+    free(items);
+    free(pending);
+    close(epoll_fd);
+    return failed ? -1 : 0;
+}
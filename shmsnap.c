@@ -0,0 +1,396 @@
+#include "finger.h"
+#include <stdatomic.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+
+// Shared session snapshot (-Z)
+// Many finger processes started close together (monitoring agents, login
+// scripts) would each read utmp and stat() every terminal. With -Z they share
+// one file, normally in /dev/shm, holding the utmp login records and the
+// stat() of every terminal they name, as of one moment.
+//
+// The file is a versioned double buffer: a header and two slots. `current`
+// counts the publications and its low bit names the newest slot. Readers take
+// no lock: they copy the newest slot and keep the copy only if the slot's
+// sequence number was even and unchanged across the copy (a seqlock). A
+// snapshot is used while it is younger than SNAPSHOT_MAX_AGE and was built
+// from the utmp file that is there now; otherwise the reader does the normal
+// utmp read and terminal stats and, if it can take the file's flock without
+// waiting, publishes the result into the other slot for the next ones.
+// Nobody ever waits: a busy lock just means somebody else is refreshing.
+//
+// Readers trust a snapshot only if it belongs to them or to root and nobody
+// else can write it; whether a terminal is writable is worked out from the
+// recorded mode and owner with the reader's own credentials.
+
+#define SNAPSHOT_MAGIC "FNGRSNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_MAX_AGE 1000000000ull // 1 s, in ns
+#define SNAPSHOT_MIN_CAPACITY 64       // Sessions (and terminals) a slot has room for
+#define SNAPSHOT_READ_TRIES 3          // Copies attempted while a writer is busy
+
+// Start of the file
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;      // sizeof(struct utmp) of the writer
+    uint64_t capacity;         // Records, and terminals, each slot has room for
+    uint64_t slot_size;
+    _Atomic uint64_t current;  // Publications so far; slot (current & 1) is the newest
+    char pad[24];
+} SnapshotHeader;
+
+// Start of each slot, followed by `capacity` struct utmp and `capacity` SnapshotTty
+typedef struct {
+    _Atomic uint64_t sequence; // Odd while the slot is being written
+    uint64_t built;            // CLOCK_REALTIME of the terminal stats, in ns
+    uint64_t utmp_dev;         // The utmp file the records come from (all 0 if there was none)
+    uint64_t utmp_ino;
+    uint64_t utmp_size;
+    int64_t utmp_mtime_sec;
+    int64_t utmp_mtime_nsec;
+    uint64_t session_count;
+    uint64_t tty_count;
+} SnapshotSlot;
+
+// stat() of one terminal, sorted by line
+typedef struct {
+    char line[UT_LINESIZE];    // Not NUL-terminated when full
+    int64_t atime;
+    uint64_t device;
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t present;          // 0 if the stat() failed
+} SnapshotTty;
+
+// Terminals of the snapshot this process uses, if it came from -Z
+static struct {
+    SnapshotTty *ttys;
+    size_t count;
+    gid_t groups[NGROUPS_MAX];
+    int group_count;
+} shmsnap;
+
+static size_t slot_size_for(uint64_t capacity) {
+    return sizeof(SnapshotSlot) + capacity * (sizeof(struct utmp) + sizeof(SnapshotTty));
+}
+
+static SnapshotSlot *slot_at(void *map, const SnapshotHeader *header, uint64_t slot) {
+    return (SnapshotSlot *)((char *)map + sizeof(SnapshotHeader) + slot * header->slot_size);
+}
+
+static uint64_t realtime_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+static int compare_tty(const void *a, const void *b) {
+    return strncmp(((const SnapshotTty *)a)->line, ((const SnapshotTty *)b)->line, UT_LINESIZE);
+}
+
+// The utmp file a slot must have been built from, as stat() sees it now
+static void utmp_identity(const char *utmp_file, SnapshotSlot *identity) {
+    struct stat statbuf;
+    memset(identity, 0, sizeof(*identity));
+    if (stat(utmp_file, &statbuf) == 0) {
+        identity->utmp_dev = (uint64_t)statbuf.st_dev;
+        identity->utmp_ino = (uint64_t)statbuf.st_ino;
+        identity->utmp_size = (uint64_t)statbuf.st_size;
+        identity->utmp_mtime_sec = statbuf.st_mtim.tv_sec;
+        identity->utmp_mtime_nsec = statbuf.st_mtim.tv_nsec;
+    }
+}
+
+static int same_utmp(const SnapshotSlot *a, const SnapshotSlot *b) {
+    return a->utmp_dev == b->utmp_dev && a->utmp_ino == b->utmp_ino && a->utmp_size == b->utmp_size &&
+           a->utmp_mtime_sec == b->utmp_mtime_sec && a->utmp_mtime_nsec == b->utmp_mtime_nsec;
+}
+
+// Check the header of a mapped snapshot file of `size` bytes
+static int header_is_valid(const SnapshotHeader *header, size_t size) {
+    return size >= sizeof(SnapshotHeader) &&
+           memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) == 0 &&
+           header->version == SNAPSHOT_VERSION &&
+           header->record_size == sizeof(struct utmp) &&
+           header->capacity > 0 && header->capacity < (1u << 24) &&
+           header->slot_size == slot_size_for(header->capacity) &&
+           sizeof(SnapshotHeader) + 2 * header->slot_size <= size;
+}
+
+// Copy the newest slot if it is consistent, fresh and built from `identity`.
+// On success the records and terminals are malloc'd copies.
+static int read_slot(void *map, const SnapshotHeader *header, const SnapshotSlot *identity,
+                     struct utmp **records, size_t *session_count, SnapshotTty **ttys, size_t *tty_count) {
+    uint64_t capacity = header->capacity;
+    struct utmp *record_copy = malloc(capacity * sizeof(struct utmp));
+    SnapshotTty *tty_copy = malloc(capacity * sizeof(SnapshotTty));
+    if (record_copy == NULL || tty_copy == NULL) {
+        free(record_copy);
+        free(tty_copy);
+        return -1;
+    }
+
+    for (int attempt = 0; attempt < SNAPSHOT_READ_TRIES; attempt++) {
+        uint64_t current = atomic_load_explicit((_Atomic uint64_t *)&header->current, memory_order_acquire);
+        SnapshotSlot *slot = slot_at(map, header, current & 1);
+        uint64_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        if (sequence & 1) {
+            continue; // Being written right now
+        }
+
+        SnapshotSlot fields;
+        memcpy((char *)&fields + sizeof(fields.sequence), (char *)slot + sizeof(slot->sequence),
+               sizeof(fields) - sizeof(fields.sequence));
+        uint64_t sessions = fields.session_count <= capacity ? fields.session_count : 0;
+        uint64_t terminals = fields.tty_count <= capacity ? fields.tty_count : 0;
+        const struct utmp *slot_records = (const struct utmp *)(slot + 1);
+        memcpy(record_copy, slot_records, sessions * sizeof(struct utmp));
+        memcpy(tty_copy, slot_records + capacity, terminals * sizeof(SnapshotTty));
+
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->sequence, memory_order_relaxed) != sequence) {
+            continue; // Rewritten under us: the copy may be torn
+        }
+
+        uint64_t now = realtime_now();
+        if (sequence == 0 || fields.session_count > capacity || fields.tty_count > capacity ||
+            !same_utmp(&fields, identity) || fields.built > now || now - fields.built >= SNAPSHOT_MAX_AGE) {
+            break; // Consistent but never written, stale or from another utmp
+        }
+        *records = record_copy;
+        *session_count = (size_t)sessions;
+        *ttys = tty_copy;
+        *tty_count = (size_t)terminals;
+        return 0;
+    }
+    free(record_copy);
+    free(tty_copy);
+    return -1;
+}
+
+// stat() every distinct terminal of the sessions, sorted by line
+static SnapshotTty *stat_ttys(const UtmpSnapshot *utmp, size_t *count) {
+    SnapshotTty *ttys = calloc(utmp->count ? utmp->count : 1, sizeof(SnapshotTty));
+    if (ttys == NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i < utmp->count; i++) {
+        memcpy(ttys[i].line, utmp->records[i].ut_line, UT_LINESIZE);
+    }
+    qsort(ttys, utmp->count, sizeof(SnapshotTty), compare_tty);
+
+    size_t distinct = 0;
+    for (size_t i = 0; i < utmp->count; i++) {
+        if (distinct > 0 && compare_tty(&ttys[distinct - 1], &ttys[i]) == 0) {
+            continue;
+        }
+        SnapshotTty *tty = &ttys[distinct++];
+        memmove(tty->line, ttys[i].line, UT_LINESIZE);
+
+        char tty_path[256];
+        struct stat statbuf;
+        snprintf(tty_path, sizeof(tty_path), "/dev/%.*s", UT_LINESIZE, tty->line);
+        tty->present = stat(tty_path, &statbuf) == 0;
+        if (tty->present) {
+            tty->atime = statbuf.st_atime;
+            tty->device = (uint64_t)statbuf.st_rdev;
+            tty->mode = statbuf.st_mode;
+            tty->uid = statbuf.st_uid;
+            tty->gid = statbuf.st_gid;
+        }
+    }
+    *count = distinct;
+    return ttys;
+}
+
+// Write a snapshot into the slot readers are not directed to, then direct them to it
+static void publish(void *map, SnapshotHeader *header, const SnapshotSlot *fields,
+                    const UtmpSnapshot *utmp, const SnapshotTty *ttys) {
+    uint64_t current = atomic_load_explicit(&header->current, memory_order_relaxed);
+    SnapshotSlot *slot = slot_at(map, header, (current + 1) & 1);
+
+    uint64_t sequence = atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+    atomic_store_explicit(&slot->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    memcpy((char *)slot + sizeof(slot->sequence), (const char *)fields + sizeof(fields->sequence),
+           sizeof(*fields) - sizeof(fields->sequence));
+    struct utmp *records = (struct utmp *)(slot + 1);
+    memcpy(records, utmp->records, utmp->count * sizeof(struct utmp));
+    memcpy(records + header->capacity, ttys, fields->tty_count * sizeof(SnapshotTty));
+
+    atomic_store_explicit(&slot->sequence, sequence + 2, memory_order_release);
+    atomic_store_explicit(&header->current, current + 1, memory_order_release);
+}
+
+// Create a snapshot file big enough for `fields` next to `path` and move it in place
+static int create_snapshot(const char *path, const SnapshotSlot *fields, const UtmpSnapshot *utmp, const SnapshotTty *ttys) {
+    uint64_t capacity = SNAPSHOT_MIN_CAPACITY;
+    while (capacity < utmp->count * 2) {
+        capacity *= 2;
+    }
+    size_t size = sizeof(SnapshotHeader) + 2 * slot_size_for(capacity);
+
+    char temp_path[4096];
+    snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", path);
+    int fd = mkstemp(temp_path);
+    if (fd == -1) {
+        return -1;
+    }
+    void *map = MAP_FAILED;
+    if (fchmod(fd, 0644) == -1 || ftruncate(fd, (off_t)size) == -1 ||
+        (map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        unlink(temp_path);
+        return -1;
+    }
+
+    SnapshotHeader *header = map;
+    memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+    header->version = SNAPSHOT_VERSION;
+    header->record_size = sizeof(struct utmp);
+    header->capacity = capacity;
+    header->slot_size = slot_size_for(capacity);
+    publish(map, header, fields, utmp, ttys);
+    munmap(map, size);
+
+    if (close(fd) == -1 || rename(temp_path, path) == -1) {
+        unlink(temp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Make this process's terminal lookups use `ttys` (taken over)
+static void install_ttys(SnapshotTty *ttys, size_t count) {
+    free(shmsnap.ttys);
+    shmsnap.ttys = ttys;
+    shmsnap.count = count;
+    shmsnap.group_count = getgroups(NGROUPS_MAX, shmsnap.groups);
+    if (shmsnap.group_count < 0) {
+        shmsnap.group_count = 0;
+    }
+}
+
+// Load utmp (UTMP_FILE if `utmp_file` is NULL) through the shared snapshot at
+// `path`: take the snapshot if it is fresh, otherwise read utmp and stat the
+// terminals as usual and refresh the snapshot if nobody else is doing so.
+// Either way shmsnap_tty() then answers for the terminals of the sessions.
+int shmsnap_load(UtmpSnapshot *snapshot, const char *path, const char *utmp_file) {
+    if (utmp_file == NULL) {
+        utmp_file = UTMP_FILE;
+    }
+    SnapshotSlot identity;
+    utmp_identity(utmp_file, &identity); // Before the read: a later change makes the snapshot stale
+
+    // Fast path: a consistent copy of the newest slot, without a lock
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    int writable = fd != -1;
+    if (fd == -1) {
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+    struct stat statbuf;
+    void *map = MAP_FAILED;
+    size_t size = 0;
+    if (fd != -1 && fstat(fd, &statbuf) == 0 && file_is_trusted(&statbuf)) {
+        size = (size_t)statbuf.st_size;
+        if (size >= sizeof(SnapshotHeader)) {
+            map = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+        }
+    }
+    if (map != MAP_FAILED && !header_is_valid(map, size)) {
+        munmap(map, size);
+        map = MAP_FAILED;
+    }
+    if (map != MAP_FAILED) {
+        struct utmp *records;
+        size_t session_count;
+        SnapshotTty *ttys;
+        size_t tty_count;
+        if (read_slot(map, map, &identity, &records, &session_count, &ttys, &tty_count) == 0) {
+            munmap(map, size);
+            close(fd);
+            if (utmp_snapshot_index(snapshot, records, session_count) == -1) {
+                free(ttys);
+                return -1;
+            }
+            install_ttys(ttys, tty_count);
+            return 0;
+        }
+    }
+
+    // Stale or missing: the normal path, shared with the next readers if possible
+    if (utmp_snapshot_load(snapshot, utmp_file) == -1) {
+        if (map != MAP_FAILED) {
+            munmap(map, size);
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    size_t tty_count;
+    SnapshotTty *ttys = stat_ttys(snapshot, &tty_count);
+    if (ttys == NULL) {
+        if (map != MAP_FAILED) {
+            munmap(map, size);
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+        return 0; // Probes stat() the terminals themselves
+    }
+    identity.built = realtime_now();
+    identity.session_count = snapshot->count;
+    identity.tty_count = tty_count;
+
+    int exists = fd != -1;
+    if (!exists || (writable && flock(fd, LOCK_EX | LOCK_NB) == 0)) {
+        // Ours to refresh: in place if it fits, else as a new file
+        if (map != MAP_FAILED && writable && ((SnapshotHeader *)map)->capacity >= snapshot->count) {
+            publish(map, map, &identity, snapshot, ttys);
+        } else if (create_snapshot(path, &identity, snapshot, ttys) == -1 && !exists) {
+            fprintf(stderr, "Warning: cannot write session snapshot %s: %s\n", path, strerror(errno));
+        }
+    }
+    if (map != MAP_FAILED) {
+        munmap(map, size);
+    }
+    if (fd != -1) {
+        close(fd); // Drops the lock
+    }
+    install_ttys(ttys, tty_count);
+    return 0;
+}
+
+// Terminal `line` as the snapshot recorded it. Returns 0 if the snapshot has
+// no such terminal (the caller stats it); otherwise 1, with last_access -1 if
+// the terminal could not be stat()ed.
+int shmsnap_tty(const char *line, time_t *last_access, dev_t *device, int *writable) {
+    if (shmsnap.ttys == NULL) {
+        return 0;
+    }
+    SnapshotTty key = {0};
+    memcpy(key.line, line, strnlen(line, UT_LINESIZE));
+    const SnapshotTty *tty = bsearch(&key, shmsnap.ttys, shmsnap.count, sizeof(SnapshotTty), compare_tty);
+    if (tty == NULL) {
+        return 0;
+    }
+    if (!tty->present) {
+        *last_access = -1;
+        *device = 0;
+        *writable = 0;
+        return 1;
+    }
+    *last_access = (time_t)tty->atime;
+    *device = (dev_t)tty->device;
+    *writable = mode_writable(tty->mode, tty->uid, tty->gid, shmsnap.groups, shmsnap.group_count);
+    return 1;
+}
+
+void shmsnap_free(void) {
+    free(shmsnap.ttys);
+    memset(&shmsnap, 0, sizeof(shmsnap));
+}
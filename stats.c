@@ -0,0 +1,135 @@
+#include "finger.h"
+#include <stdatomic.h>
+
+// Run statistics (--stats)
+// Every instrumented phase is bracketed by stats_start()/stats_stop(). When
+// --stats is off those are a test of stats_enabled and nothing else. When it
+// is on, the monotonic time and one call are added to the run totals and to
+// the counters of the user being probed or printed on this thread.
+
+int stats_enabled;
+
+static const char *const stats_phase_names[STAT_PHASE_COUNT] = {
+    "passwd", "utmp", "query", "sessions", "tty", "mail", "dotfiles", "uring", "wtmp", "procs", "print",
+};
+
+static _Atomic uint64_t phase_ns[STAT_PHASE_COUNT];
+static _Atomic uint64_t phase_calls[STAT_PHASE_COUNT];
+static uint64_t run_start;
+
+static __thread UserStats *current_user; // Counters of the user this thread works on
+
+uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+void stats_init(void) {
+    stats_enabled = 1;
+    run_start = stats_now();
+}
+
+void stats_record(int phase, uint64_t start) {
+    uint64_t elapsed = stats_now() - start;
+    atomic_fetch_add_explicit(&phase_ns[phase], elapsed, memory_order_relaxed);
+    atomic_fetch_add_explicit(&phase_calls[phase], 1, memory_order_relaxed);
+    if (current_user != NULL) {
+        current_user->ns[phase] += elapsed;
+        current_user->calls[phase]++;
+    }
+}
+
+void stats_set_user(UserStats *stats) {
+    current_user = stats;
+}
+
+static double to_ms(uint64_t ns) {
+    return ns / 1e6;
+}
+
+static void report_text(FILE *out, const UserQueue *queue, uint64_t total) {
+    fprintf(out, "finger: %.3f ms total\n", to_ms(total));
+    fprintf(out, "%-10s %10s %12s\n", "phase", "calls", "ms");
+    for (int p = 0; p < STAT_PHASE_COUNT; p++) {
+        uint64_t calls = atomic_load(&phase_calls[p]);
+        if (calls > 0) {
+            fprintf(out, "%-10s %10llu %12.3f\n", stats_phase_names[p], (unsigned long long)calls, to_ms(atomic_load(&phase_ns[p])));
+        }
+    }
+
+    for (size_t i = 0; i < queue->count; i++) {
+        const QueueItem *item = &queue->items[i];
+        if (item->missing != NULL) {
+            continue;
+        }
+        fprintf(out, "%-10s", item->user.login_name);
+        for (int p = 0; p < STAT_PHASE_COUNT; p++) {
+            if (item->stats.calls[p] > 0) {
+                fprintf(out, " %s=%.3fms/%u", stats_phase_names[p], to_ms(item->stats.ns[p]), item->stats.calls[p]);
+            }
+        }
+        fprintf(out, "\n");
+    }
+}
+
+static void report_json(FILE *out, const UserQueue *queue, uint64_t total) {
+    fprintf(out, "{\"total_ms\":%.3f,\"phases\":{", to_ms(total));
+    int first = 1;
+    for (int p = 0; p < STAT_PHASE_COUNT; p++) {
+        uint64_t calls = atomic_load(&phase_calls[p]);
+        if (calls > 0) {
+            fprintf(out, "%s\"%s\":{\"calls\":%llu,\"ms\":%.3f}", first ? "" : ",", stats_phase_names[p],
+                    (unsigned long long)calls, to_ms(atomic_load(&phase_ns[p])));
+            first = 0;
+        }
+    }
+    fprintf(out, "},\"users\":[");
+
+    first = 1;
+    for (size_t i = 0; i < queue->count; i++) {
+        const QueueItem *item = &queue->items[i];
+        if (item->missing != NULL) {
+            continue;
+        }
+        fprintf(out, "%s{\"login\":\"", first ? "" : ",");
+        for (const char *c = item->user.login_name; *c != '\0'; c++) {
+            if (*c == '"' || *c == '\\') {
+                fprintf(out, "\\%c", *c);
+            } else if ((unsigned char)*c < 0x20) {
+                fprintf(out, "\\u%04x", (unsigned char)*c);
+            } else {
+                fputc(*c, out);
+            }
+        }
+        fprintf(out, "\",\"phases\":{");
+        int first_phase = 1;
+        for (int p = 0; p < STAT_PHASE_COUNT; p++) {
+            if (item->stats.calls[p] > 0) {
+                fprintf(out, "%s\"%s\":{\"calls\":%u,\"ms\":%.3f}", first_phase ? "" : ",", stats_phase_names[p],
+                        item->stats.calls[p], to_ms(item->stats.ns[p]));
+                first_phase = 0;
+            }
+        }
+        fprintf(out, "}}");
+        first = 0;
+    }
+    fprintf(out, "]}\n");
+}
+
+// Print the run totals and the per-user breakdown of `queue`
+void stats_report(FILE *out, const UserQueue *queue, int json) {
+    uint64_t total = stats_now() - run_start;
+    if (json) {
+        report_json(out, queue, total);
+    } else {
+        report_text(out, queue, total);
+    }
+}
+
+// Name of a phase and its totals so far, for the metrics exporter
+const char *stats_phase_totals(int phase, uint64_t *ns, uint64_t *calls) {
+    *ns = atomic_load(&phase_ns[phase]);
+    *calls = atomic_load(&phase_calls[phase]);
+    return stats_phase_names[phase];
+}
@@ -0,0 +1,220 @@
+#include "finger.h"
+#include <dirent.h>
+#include <sys/sysmacros.h>
+
+// Foreground command of every terminal
+// One walk of /proc reads the stat line of every process and keeps, per
+// controlling terminal, the process that `w` would show: the leader of the
+// terminal's foreground process group (pid == tpgid), or, if the leader has
+// exited, the most recently started member of that group. Only the winners'
+// command lines are read, after the walk. Sessions are joined to the map by
+// the device number of their terminal, which the idle-time stat already has.
+//
+// The map is rebuilt by ttyproc_refresh() when it is more than
+// TTYPROC_MAX_AGE old, so the batches of an -a listing share one walk and the
+// daemon sees current commands. Lookups are read-only and safe from the
+// probe worker threads; refreshes must not overlap them.
+
+#define TTYPROC_MAX_AGE 1000000000ull // 1 s, in ns
+#define TTYPROC_COMMAND_SIZE 256       // Longer command lines are cut
+
+typedef struct {
+    dev_t tty;                 // 0 marks an empty slot
+    pid_t tpgid;               // Foreground process group of the terminal
+    pid_t pid;                 // Process shown for the terminal, 0 if none yet
+    int leader;                // `pid` is the group leader
+    unsigned long long start;  // Start time of `pid`, in clock ticks
+    char comm[16];             // Its name from the stat line, for processes without a command line
+    char *command;
+} TtyProcess;
+
+static struct {
+    TtyProcess *slots;
+    size_t mask;
+    size_t count;
+    uint64_t loaded; // stats_now() of the last walk, 0 if none
+} ttyproc;
+
+static size_t ttyproc_hash(dev_t tty) {
+    return (size_t)((uint64_t)tty * 0x9e3779b97f4a7c15ULL >> 32);
+}
+
+// Slot of `tty`, or the empty slot where it belongs
+static TtyProcess *ttyproc_slot(TtyProcess *slots, size_t mask, dev_t tty) {
+    size_t slot = ttyproc_hash(tty) & mask;
+    while (slots[slot].tty != 0 && slots[slot].tty != tty) {
+        slot = (slot + 1) & mask;
+    }
+    return &slots[slot];
+}
+
+static void ttyproc_clear(void) {
+    for (size_t i = 0; ttyproc.slots != NULL && i <= ttyproc.mask; i++) {
+        free(ttyproc.slots[i].command);
+    }
+    free(ttyproc.slots);
+    ttyproc.slots = NULL;
+    ttyproc.mask = 0;
+    ttyproc.count = 0;
+}
+
+static TtyProcess *ttyproc_add(dev_t tty) {
+    if (ttyproc.slots == NULL || (ttyproc.count + 1) * 10 > (ttyproc.mask + 1) * 7) {
+        // Double the table once it is 70% full
+        size_t old_size = ttyproc.slots != NULL ? ttyproc.mask + 1 : 0;
+        size_t size = old_size ? old_size * 2 : 64;
+        TtyProcess *slots = calloc(size, sizeof(TtyProcess));
+        if (slots == NULL) {
+            perror("Error allocating memory for terminal processes");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < old_size; i++) {
+            if (ttyproc.slots[i].tty != 0) {
+                *ttyproc_slot(slots, size - 1, ttyproc.slots[i].tty) = ttyproc.slots[i];
+            }
+        }
+        free(ttyproc.slots);
+        ttyproc.slots = slots;
+        ttyproc.mask = size - 1;
+    }
+
+    TtyProcess *slot = ttyproc_slot(ttyproc.slots, ttyproc.mask, tty);
+    if (slot->tty == 0) {
+        slot->tty = tty;
+        ttyproc.count++;
+    }
+    return slot;
+}
+
+// Read a small /proc file relative to `dir_fd`; returns its length or -1
+static ssize_t read_proc_file(int dir_fd, const char *path, char *buffer, size_t size) {
+    int fd = openat(dir_fd, path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    ssize_t n = read(fd, buffer, size - 1);
+    close(fd);
+    if (n >= 0) {
+        buffer[n] = '\0';
+    }
+    return n;
+}
+
+// Fold one /proc/<pid>/stat line into the map
+static void ttyproc_account(pid_t pid, char *line) {
+    // The name is in parentheses and may itself hold spaces and ')'
+    char *name = strchr(line, '(');
+    char *name_end = strrchr(line, ')');
+    if (name == NULL || name_end == NULL || name_end < name) {
+        return;
+    }
+
+    int pgrp;
+    int tty_nr;
+    int tpgid;
+    unsigned long long start;
+    // state ppid pgrp session tty_nr tpgid flags minflt cminflt majflt cmajflt
+    // utime stime cutime cstime priority nice num_threads itrealvalue starttime
+    if (sscanf(name_end + 2, "%*c %*d %d %*d %d %d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d %*d %*d %*d %llu",
+               &pgrp, &tty_nr, &tpgid, &start) != 4) {
+        return;
+    }
+    if (tty_nr == 0 || tpgid <= 0 || pgrp != tpgid) {
+        return; // No terminal, or not in its foreground group
+    }
+
+    // tty_nr uses the kernel's dev_t encoding; rebuild it the way stat() reports st_rdev
+    TtyProcess *entry = ttyproc_add(makedev(major((dev_t)tty_nr), minor((dev_t)tty_nr)));
+    if (entry->tpgid != tpgid) {
+        // First process seen, or the foreground changed during the walk: follow the last group seen
+        entry->tpgid = tpgid;
+        entry->pid = 0;
+        entry->leader = 0;
+    }
+    int leader = pid == tpgid;
+    if (entry->leader || (!leader && entry->pid != 0 && start <= entry->start)) {
+        return;
+    }
+    entry->pid = pid;
+    entry->leader = leader;
+    entry->start = start;
+    size_t len = (size_t)(name_end - name - 1);
+    if (len >= sizeof(entry->comm)) {
+        len = sizeof(entry->comm) - 1;
+    }
+    memcpy(entry->comm, name + 1, len);
+    entry->comm[len] = '\0';
+}
+
+// Command line of the process shown for a terminal, arguments space-separated
+static char *ttyproc_command(int proc_fd, const TtyProcess *entry) {
+    char path[32];
+    char buffer[TTYPROC_COMMAND_SIZE];
+    snprintf(path, sizeof(path), "%d/cmdline", (int)entry->pid);
+    ssize_t n = read_proc_file(proc_fd, path, buffer, sizeof(buffer));
+    while (n > 0 && buffer[n - 1] == '\0') {
+        n--;
+    }
+    if (n <= 0) {
+        return strdup(entry->comm); // Zombie or kernel thread
+    }
+    for (ssize_t i = 0; i < n; i++) {
+        if (buffer[i] == '\0' || buffer[i] == '\n' || buffer[i] == '\t') {
+            buffer[i] = ' ';
+        }
+    }
+    buffer[n] = '\0';
+    return strdup(buffer);
+}
+
+// Walk /proc again if the map is missing or older than TTYPROC_MAX_AGE.
+// Returns -1 if /proc cannot be read (every lookup then finds nothing).
+int ttyproc_refresh(void) {
+    uint64_t now = stats_now();
+    if (ttyproc.loaded != 0 && now - ttyproc.loaded < TTYPROC_MAX_AGE) {
+        return 0;
+    }
+    ttyproc_clear();
+    ttyproc.loaded = now;
+
+    DIR *proc = opendir("/proc");
+    if (proc == NULL) {
+        return -1;
+    }
+    int proc_fd = dirfd(proc);
+    struct dirent *entry;
+    char path[32];
+    char line[1024];
+    while ((entry = readdir(proc)) != NULL) {
+        if (entry->d_name[0] < '1' || entry->d_name[0] > '9') {
+            continue; // Not a process
+        }
+        pid_t pid = (pid_t)atoi(entry->d_name);
+        snprintf(path, sizeof(path), "%d/stat", (int)pid);
+        if (read_proc_file(proc_fd, path, line, sizeof(line)) > 0) {
+            ttyproc_account(pid, line);
+        }
+    }
+
+    for (size_t i = 0; ttyproc.slots != NULL && i <= ttyproc.mask; i++) {
+        if (ttyproc.slots[i].tty != 0 && ttyproc.slots[i].pid != 0) {
+            ttyproc.slots[i].command = ttyproc_command(proc_fd, &ttyproc.slots[i]);
+        }
+    }
+    closedir(proc);
+    return 0;
+}
+
+// Foreground command of the terminal device `tty`, or NULL if there is none
+const char *ttyproc_find(dev_t tty) {
+    if (ttyproc.slots == NULL || tty == 0) {
+        return NULL;
+    }
+    const TtyProcess *entry = ttyproc_slot(ttyproc.slots, ttyproc.mask, tty);
+    return entry->tty != 0 ? entry->command : NULL;
+}
+
+void ttyproc_free(void) {
+    ttyproc_clear();
+    ttyproc.loaded = 0;
+}
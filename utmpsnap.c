@@ -0,0 +1,147 @@
+#include "finger.h"
+
+// utmp snapshot
+// The utmp file is read into memory with a single bulk read, keeping only
+// USER_PROCESS records, and chained into a hash table by user name so that
+// every lookup after that is a walk over the sessions of one user.
+
+// Read the whole file into a malloc'd buffer
+static int read_whole_file(int fd, char **data, size_t *size) {
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) == -1) {
+        return -1;
+    }
+
+    size_t capacity = statbuf.st_size > 0 ? (size_t)statbuf.st_size : sizeof(struct utmp);
+    size_t used = 0;
+    char *buffer = malloc(capacity);
+    if (buffer == NULL) {
+        return -1;
+    }
+
+    for (;;) {
+        if (used == capacity) { // File grew since fstat
+            char *grown = realloc(buffer, capacity * 2);
+            if (grown == NULL) {
+                free(buffer);
+                return -1;
+            }
+            buffer = grown;
+            capacity *= 2;
+        }
+        ssize_t n = read(fd, buffer + used, capacity - used);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            free(buffer);
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        used += (size_t)n;
+    }
+
+    *data = buffer;
+    *size = used;
+    return 0;
+}
+
+// Load the utmp file at `path` (UTMP_FILE if NULL). A missing file is not an
+// error, it just means nobody is logged in.
+int utmp_snapshot_load(UtmpSnapshot *snapshot, const char *path) {
+    memset(snapshot, 0, sizeof(*snapshot));
+
+    int fd = open(path ? path : UTMP_FILE, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        return -1;
+    }
+
+    char *data;
+    size_t size;
+    int result = read_whole_file(fd, &data, &size);
+    close(fd);
+    if (result == -1) {
+        return -1;
+    }
+
+    // Keep only the login sessions, compacting them in place
+    struct utmp *records = (struct utmp *)data;
+    size_t total = size / sizeof(struct utmp);
+    size_t count = 0;
+    for (size_t i = 0; i < total; i++) {
+        if (records[i].ut_type == USER_PROCESS && records[i].ut_user[0] != '\0') {
+            if (count != i) {
+                memcpy(&records[count], &records[i], sizeof(struct utmp));
+            }
+            count++;
+        }
+    }
+
+    return utmp_snapshot_index(snapshot, records, count);
+}
+
+// Build a snapshot over `count` login sessions in a malloc'd array, which
+// the snapshot takes over (it is freed on failure too)
+int utmp_snapshot_index(UtmpSnapshot *snapshot, struct utmp *records, size_t count) {
+    memset(snapshot, 0, sizeof(*snapshot));
+    snapshot->records = records;
+    snapshot->count = count;
+
+    // Chain sessions by user name, inserting in reverse to keep file order
+    size_t table_size = table_size_for(count * 2);
+    snapshot->user_buckets = malloc(table_size * sizeof(size_t));
+    snapshot->next_session = malloc((count ? count : 1) * sizeof(size_t));
+    if (snapshot->user_buckets == NULL || snapshot->next_session == NULL) {
+        utmp_snapshot_free(snapshot);
+        return -1;
+    }
+    snapshot->user_mask = table_size - 1;
+    for (size_t i = 0; i < table_size; i++) {
+        snapshot->user_buckets[i] = PWINDEX_NONE;
+    }
+    for (size_t i = count; i-- > 0; ) {
+        const char *user = records[i].ut_user;
+        size_t slot = hash_lower(user, strnlen(user, sizeof(records[i].ut_user))) & snapshot->user_mask;
+        snapshot->next_session[i] = snapshot->user_buckets[slot];
+        snapshot->user_buckets[slot] = i;
+    }
+
+    return 0;
+}
+
+void utmp_snapshot_free(UtmpSnapshot *snapshot) {
+    free(snapshot->records);
+    free(snapshot->user_buckets);
+    free(snapshot->next_session);
+    memset(snapshot, 0, sizeof(*snapshot));
+}
+
+// Skip forward along a hash chain to the next session of `login_name`
+static size_t skip_to_user(const UtmpSnapshot *snapshot, size_t i, const char *login_name) {
+    for ( ; i != PWINDEX_NONE; i = snapshot->next_session[i]) {
+        if (strncmp(snapshot->records[i].ut_user, login_name, sizeof(snapshot->records[i].ut_user)) == 0) {
+            break;
+        }
+    }
+    return i;
+}
+
+// First session of a user, or PWINDEX_NONE if not logged in
+size_t utmp_snapshot_first(const UtmpSnapshot *snapshot, const char *login_name) {
+    if (snapshot->user_buckets == NULL) {
+        return PWINDEX_NONE;
+    }
+    size_t len = strnlen(login_name, sizeof(snapshot->records[0].ut_user));
+    size_t i = snapshot->user_buckets[hash_lower(login_name, len) & snapshot->user_mask];
+    return skip_to_user(snapshot, i, login_name);
+}
+
+// Next session of the same user after session `i`
+size_t utmp_snapshot_next(const UtmpSnapshot *snapshot, size_t i) {
+    return skip_to_user(snapshot, snapshot->next_session[i], snapshot->records[i].ut_user);
+}
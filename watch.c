@@ -0,0 +1,317 @@
+#include "finger.h"
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+
+// Live watch mode (-w seconds)
+// A short-format table of the queried users (everyone logged in by default)
+// that stays on screen and keeps itself current. passwd and utmp are loaded
+// once and kept resident, like in the daemon; inotify on their directories
+// triggers a reload, so new and ended sessions show up at once. Every
+// interval only the terminals are stat()ed again for their idle time.
+//
+// Each refresh renders the table into lines and compares them with what the
+// screen already shows: only rows that changed are rewritten, with cursor
+// addressing, and an idle system produces no output at all. Without a
+// terminal on stdout every changed table is printed whole instead.
+
+#define WATCH_LINE_SIZE 512
+
+typedef struct {
+    const UserInfo *user;       // NULL for a query or login with no passwd entry
+    const char *missing;        // ...which is then this name
+    const SessionInfo *session; // NULL for a user with no session
+    char idle_time[64];         // Refreshed every interval
+} WatchRow;
+
+typedef struct {
+    const FingerOptions *options;
+    char *const *names;
+    size_t name_count;
+    const char *passwd_file;  // Watched files (-P and -U, or the system defaults)
+    const char *utmp_file;
+    PwIndex index;
+    UtmpSnapshot utmp;
+    UserQueue queue;          // Owns the users and sessions the rows point to
+    WatchRow *rows;
+    size_t row_count;
+    char **lines;             // What the screen shows, header first
+    size_t line_count;
+    int inotify_fd;
+    int passwd_wd;            // -1 if the file could not be watched
+    int utmp_wd;
+    int passwd_dirty;
+    int utmp_dirty;
+    int ansi;                 // stdout is a terminal: redraw rows in place
+} Watch;
+
+static volatile sig_atomic_t watch_stop = 0;
+
+static void handle_watch_signal(int signo) {
+    (void)signo;
+    watch_stop = 1;
+}
+
+// Resolve the queries again and lay out one row per session
+static void build_rows(Watch *watch) {
+    queue_reset(&watch->queue);
+    build_queue(&watch->index, &watch->utmp, &watch->queue, watch->names, watch->name_count, watch->options->match_names);
+
+    size_t count = 0;
+    for (size_t i = 0; i < watch->queue.count; i++) {
+        QueueItem *item = &watch->queue.items[i];
+        if (item->missing == NULL) {
+            get_user_sessions(&watch->utmp, &item->user, 0);
+            count += item->user.session_count ? item->user.session_count : 1;
+        } else {
+            count++;
+        }
+    }
+
+    free(watch->rows);
+    watch->rows = calloc(count ? count : 1, sizeof(WatchRow));
+    if (watch->rows == NULL) {
+        perror("Error allocating memory for watch rows");
+        exit(EXIT_FAILURE);
+    }
+    watch->row_count = 0;
+    for (size_t i = 0; i < watch->queue.count; i++) {
+        const UserInfo *user = &watch->queue.items[i].user;
+        if (watch->queue.items[i].missing != NULL) {
+            // Logged in (or queried) but not in passwd, e.g. removed mid-session
+            watch->rows[watch->row_count++] = (WatchRow){.missing = watch->queue.items[i].missing};
+            continue;
+        }
+        if (user->session_count == 0) {
+            watch->rows[watch->row_count++] = (WatchRow){.user = user, .idle_time = "*"};
+        }
+        for (size_t s = 0; s < user->session_count; s++) {
+            watch->rows[watch->row_count++] = (WatchRow){.user = user, .session = &user->sessions[s]};
+        }
+    }
+}
+
+// Re-stat every terminal for its idle time; nothing else is read
+static void refresh_idle_times(Watch *watch) {
+    for (size_t i = 0; i < watch->row_count; i++) {
+        WatchRow *row = &watch->rows[i];
+        if (row->session != NULL) {
+            dev_t device;
+            get_idle_time(row->session->terminal, row->session->login_time, row->idle_time, 0, &device);
+        }
+    }
+}
+
+static char *render_row(const WatchRow *row) {
+    const UserInfo *user = row->user;
+    const SessionInfo *session = row->session;
+    char line[WATCH_LINE_SIZE];
+    if (user == NULL) {
+        snprintf(line, sizeof(line), "User not found: %s", row->missing);
+    } else {
+        snprintf(line, sizeof(line), "%-10s %-15s %-15s %-15s %-15s %-15s %-10s %s",
+                 user->login_name, user->real_name, row->idle_time,
+                 session ? session->login_time : "*", user->office_location, user->office_phone,
+                 session ? session->terminal : "*",
+                 session && session->host[0] != '\0' ? session->host : "-");
+    }
+    char *copy = strdup(line);
+    if (copy == NULL) {
+        perror("Error allocating memory for watch rows");
+        exit(EXIT_FAILURE);
+    }
+    return copy;
+}
+
+// Render the table and write the lines that differ from the screen
+static void redraw(Watch *watch) {
+    size_t count = watch->row_count + 1;
+    char **lines = malloc(count * sizeof(char *));
+    char header[WATCH_LINE_SIZE];
+    if (lines == NULL) {
+        perror("Error allocating memory for watch rows");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(header, sizeof(header), "%-10s %-15s %-15s %-15s %-15s %-15s %-10s %s",
+             "Login", "Name", "Idle Time", "Login Time", "Office", "Office Phone", "Tty", "From");
+    lines[0] = strdup(header);
+    if (lines[0] == NULL) {
+        perror("Error allocating memory for watch rows");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < watch->row_count; i++) {
+        lines[i + 1] = render_row(&watch->rows[i]);
+    }
+
+    char *text = NULL;
+    size_t text_len = 0;
+    FILE *out = open_memstream(&text, &text_len);
+    if (out == NULL) {
+        perror("open_memstream");
+        exit(EXIT_FAILURE);
+    }
+    int changed = count != watch->line_count;
+    for (size_t i = 0; i < count; i++) {
+        if (i < watch->line_count && strcmp(lines[i], watch->lines[i]) == 0) {
+            continue;
+        }
+        changed = 1;
+        if (watch->ansi) {
+            fprintf(out, "\033[%zu;1H%s\033[K", i + 1, lines[i]);
+        }
+    }
+    if (watch->ansi && changed) {
+        // Clear what is left of a longer table and park the cursor below
+        fprintf(out, "\033[%zu;1H\033[J", count + 1);
+    } else if (changed) {
+        for (size_t i = 0; i < count; i++) {
+            fprintf(out, "%s\n", lines[i]);
+        }
+        fprintf(out, "\n");
+    }
+    fclose(out);
+    if (text_len > 0) {
+        fwrite(text, 1, text_len, stdout);
+        fflush(stdout);
+    }
+    free(text);
+
+    for (size_t i = 0; i < watch->line_count; i++) {
+        free(watch->lines[i]);
+    }
+    free(watch->lines);
+    watch->lines = lines;
+    watch->line_count = count;
+}
+
+// Drain inotify and mark whatever changed as stale
+static void handle_watch_events(Watch *watch) {
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    for (;;) {
+        ssize_t len = read(watch->inotify_fd, buffer, sizeof(buffer));
+        if (len <= 0) {
+            break;
+        }
+        for (char *p = buffer; p < buffer + len; ) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            const char *name = event->len ? event->name : "";
+            if (event->wd == watch->passwd_wd && strcmp(name, base_name(watch->passwd_file)) == 0) {
+                watch->passwd_dirty = 1;
+            }
+            if (event->wd == watch->utmp_wd && strcmp(name, base_name(watch->utmp_file)) == 0) {
+                watch->utmp_dirty = 1;
+            }
+            if (event->mask & IN_Q_OVERFLOW) {
+                watch->passwd_dirty = 1;
+                watch->utmp_dirty = 1;
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+// Reload passwd and utmp if they changed (or cannot be watched); 1 if the rows must be rebuilt
+static int reload_data(Watch *watch) {
+    int reloaded = 0;
+    if (watch->passwd_dirty || watch->passwd_wd == -1) {
+        PwIndex index;
+        if (pwindex_load(&index, watch->options->passwd_file, watch->options->index_file) == 0) {
+            queue_reset(&watch->queue); // Its users point into the old index
+            watch->row_count = 0;
+            pwindex_free(&watch->index);
+            watch->index = index;
+            watch->passwd_dirty = 0;
+            reloaded = 1;
+        }
+    }
+    if (watch->utmp_dirty || watch->utmp_wd == -1) {
+        UtmpSnapshot utmp;
+        if (utmp_snapshot_load(&utmp, watch->utmp_file) == 0) {
+            utmp_snapshot_free(&watch->utmp);
+            watch->utmp = utmp;
+            watch->utmp_dirty = 0;
+            reloaded = 1;
+        }
+    }
+    return reloaded;
+}
+
+// Show the table of `names` (everyone logged in if there are none) until
+// SIGINT/SIGTERM, refreshing idle times every options->watch_interval seconds
+int run_watch(const FingerOptions *options, char *const names[], size_t name_count) {
+    static Watch watch;
+
+    memset(&watch, 0, sizeof(watch));
+    watch.options = options;
+    watch.names = names;
+    watch.name_count = name_count;
+    watch.passwd_file = options->passwd_file ? options->passwd_file : PASSWD_FILE;
+    watch.utmp_file = options->utmp_file ? options->utmp_file : UTMP_FILE;
+    watch.passwd_wd = watch.utmp_wd = -1;
+    watch.ansi = isatty(STDOUT_FILENO);
+
+    if (pwindex_load(&watch.index, options->passwd_file, options->index_file) == -1) {
+        perror("Error reading passwd database");
+        return -1;
+    }
+    if (utmp_snapshot_load(&watch.utmp, watch.utmp_file) == -1) {
+        perror("Error reading utmp");
+        pwindex_free(&watch.index);
+        return -1;
+    }
+    queue_init(&watch.queue);
+
+    // Without inotify every interval reloads passwd and utmp (reload_data)
+    watch.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch.inotify_fd != -1) {
+        watch.passwd_wd = watch_parent(watch.inotify_fd, watch.passwd_file);
+        watch.utmp_wd = watch_parent(watch.inotify_fd, watch.utmp_file);
+    }
+
+    struct sigaction action = {0};
+    action.sa_handler = handle_watch_signal; // No SA_RESTART: poll returns EINTR
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    if (watch.ansi) {
+        fputs("\033[H\033[2J", stdout); // Start from a blank screen
+    }
+    build_rows(&watch);
+    refresh_idle_times(&watch);
+    redraw(&watch);
+
+    int timeout = (int)(options->watch_interval * 1000);
+    while (!watch_stop) {
+        struct pollfd pfd = {.fd = watch.inotify_fd, .events = POLLIN};
+        int ready = poll(&pfd, watch.inotify_fd != -1 ? 1 : 0, timeout);
+        if (ready == -1 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+        if (watch_stop) {
+            break;
+        }
+        if (ready > 0) {
+            handle_watch_events(&watch);
+        }
+        if (reload_data(&watch)) {
+            build_rows(&watch);
+        }
+        refresh_idle_times(&watch);
+        redraw(&watch);
+    }
+
+    for (size_t i = 0; i < watch.line_count; i++) {
+        free(watch.lines[i]);
+    }
+    free(watch.lines);
+    free(watch.rows);
+    queue_free(&watch.queue);
+    if (watch.inotify_fd != -1) {
+        close(watch.inotify_fd);
+    }
+    utmp_snapshot_free(&watch.utmp);
+    pwindex_free(&watch.index);
+    return 0;
+}
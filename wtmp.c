@@ -0,0 +1,299 @@
+#include "finger.h"
+
+// Last logins from wtmp
+// wtmp is only ever appended to, so the last login of a user is the last
+// USER_PROCESS record with their name. The file is read backwards in blocks of
+// WTMP_BLOCK_RECORDS records, and every user met on the way is remembered
+// with the offset of their newest record. Records in [low, high) have been
+// read; asking for a user who is not in the table moves `low` back, a block
+// at a time, until they turn up or the start of the file is reached. Records
+// appended later are read (backwards too) by the next wtmp_refresh().
+//
+// With a cache file (-L) the table and the range are saved on exit and
+// reused by the next run as long as wtmp is the same file and has not
+// shrunk, so a repeated query only reads what was appended in between.
+
+#define WTMP_BLOCK_RECORDS 4096 // 1.5 MiB per read
+#define WTMP_CACHE_MAGIC "FNGRWTMP"
+#define WTMP_CACHE_VERSION 1
+
+typedef struct {
+    char user[UT_NAMESIZE]; // Not NUL-terminated when full; empty slot if user[0] is 0
+    uint64_t offset;        // Newest record of the user in [low, high)
+} WtmpSlot;
+
+// Header of the cache file, followed by `count` slots
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size; // sizeof(struct utmp) of the writer
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t low;
+    uint64_t high;
+    uint64_t count;
+} WtmpCacheHeader;
+
+static struct {
+    const char *path;
+    const char *cache_path;
+    int fd;           // -1 until the first wtmp_refresh()
+    dev_t dev;
+    ino_t ino;
+    uint64_t low;
+    uint64_t high;
+    WtmpSlot *slots;
+    size_t mask;
+    size_t count;
+    struct utmp *block;
+    int dirty;        // Table changed since it was loaded
+} wtmp = {.fd = -1};
+
+// Where to read wtmp from (NULL for WTMP_FILE) and where to keep the cache (NULL for none)
+void wtmp_configure(const char *wtmp_file, const char *cache_file) {
+    wtmp.path = wtmp_file;
+    wtmp.cache_path = cache_file;
+}
+
+static void table_reset(size_t size) {
+    free(wtmp.slots);
+    wtmp.slots = calloc(size, sizeof(WtmpSlot));
+    if (wtmp.slots == NULL) {
+        perror("Error allocating memory for wtmp table");
+        exit(EXIT_FAILURE);
+    }
+    wtmp.mask = size - 1;
+    wtmp.count = 0;
+}
+
+// Slot of `user` (at most UT_NAMESIZE bytes), or the empty slot where it belongs
+static WtmpSlot *table_slot(const char *user) {
+    size_t len = strnlen(user, UT_NAMESIZE);
+    size_t slot = hash_lower(user, len) & wtmp.mask;
+    while (wtmp.slots[slot].user[0] != '\0') {
+        if (strncmp(wtmp.slots[slot].user, user, UT_NAMESIZE) == 0) {
+            break;
+        }
+        slot = (slot + 1) & wtmp.mask;
+    }
+    return &wtmp.slots[slot];
+}
+
+// Record a login of `user` at `offset`. An existing entry is only replaced if
+// it is older than `newer_than` (the records appended since the last read).
+static void table_add(const char *user, uint64_t offset, uint64_t newer_than) {
+    if ((wtmp.count + 1) * 10 > (wtmp.mask + 1) * 7) {
+        WtmpSlot *old = wtmp.slots;
+        size_t old_size = wtmp.mask + 1;
+        wtmp.slots = NULL;
+        table_reset(old_size * 2);
+        for (size_t i = 0; i < old_size; i++) {
+            if (old[i].user[0] != '\0') {
+                *table_slot(old[i].user) = old[i];
+                wtmp.count++;
+            }
+        }
+        free(old);
+    }
+
+    WtmpSlot *slot = table_slot(user);
+    if (slot->user[0] == '\0') {
+        memcpy(slot->user, user, UT_NAMESIZE);
+        slot->offset = offset;
+        wtmp.count++;
+    } else if (slot->offset < newer_than) {
+        slot->offset = offset;
+    }
+}
+
+// Read one block of records ending at `high` (but not before `low`), newest
+// first, into the table; returns the offset of the first record read
+static uint64_t scan_block(uint64_t low, uint64_t high, uint64_t newer_than) {
+    size_t records = (size_t)((high - low) / sizeof(struct utmp));
+    if (records > WTMP_BLOCK_RECORDS) {
+        records = WTMP_BLOCK_RECORDS;
+    }
+    uint64_t start = high - records * sizeof(struct utmp);
+
+    size_t size = records * sizeof(struct utmp);
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(wtmp.fd, (char *)wtmp.block + done, size - done, (off_t)(start + done));
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return low; // Unreadable: treat the rest as read
+        }
+        done += (size_t)n;
+    }
+
+    for (size_t i = records; i-- > 0; ) {
+        const struct utmp *ut = &wtmp.block[i];
+        if (ut->ut_type == USER_PROCESS && ut->ut_user[0] != '\0') {
+            table_add(ut->ut_user, start + i * sizeof(struct utmp), newer_than);
+        }
+    }
+    wtmp.dirty = 1;
+    return start;
+}
+
+// Take the table and range of the cache file if it describes this wtmp
+static void load_cache(uint64_t size) {
+    FILE *file = fopen(wtmp.cache_path, "re");
+    if (file == NULL) {
+        return;
+    }
+
+    WtmpCacheHeader header;
+    if (fread(&header, sizeof(header), 1, file) == 1 &&
+        memcmp(header.magic, WTMP_CACHE_MAGIC, sizeof(header.magic)) == 0 &&
+        header.version == WTMP_CACHE_VERSION &&
+        header.record_size == sizeof(struct utmp) &&
+        header.dev == (uint64_t)wtmp.dev && header.ino == (uint64_t)wtmp.ino &&
+        header.low <= header.high && header.high <= size &&
+        header.high % sizeof(struct utmp) == 0 && header.low % sizeof(struct utmp) == 0) {
+        WtmpSlot slot;
+        size_t loaded = 0;
+        while (loaded < header.count && fread(&slot, sizeof(slot), 1, file) == 1) {
+            if (slot.user[0] != '\0' && slot.offset < header.high) {
+                table_add(slot.user, slot.offset, 0);
+            }
+            loaded++;
+        }
+        if (loaded == header.count) {
+            wtmp.low = header.low;
+            wtmp.high = header.high;
+        } else {
+            table_reset(wtmp.mask + 1); // Truncated cache: start over
+        }
+    }
+    fclose(file);
+}
+
+// Write the table to the cache file (atomically, via rename)
+static void save_cache(void) {
+    char temp_path[4096];
+    snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", wtmp.cache_path);
+    int fd = mkstemp(temp_path);
+    if (fd == -1) {
+        fprintf(stderr, "Warning: cannot write wtmp cache %s: %s\n", wtmp.cache_path, strerror(errno));
+        return;
+    }
+
+    FILE *file = fdopen(fd, "w");
+    if (file == NULL) {
+        close(fd);
+        unlink(temp_path);
+        return;
+    }
+    WtmpCacheHeader header = {
+        .version = WTMP_CACHE_VERSION,
+        .record_size = sizeof(struct utmp),
+        .dev = (uint64_t)wtmp.dev,
+        .ino = (uint64_t)wtmp.ino,
+        .low = wtmp.low,
+        .high = wtmp.high,
+        .count = wtmp.count,
+    };
+    memcpy(header.magic, WTMP_CACHE_MAGIC, sizeof(header.magic));
+    fwrite(&header, sizeof(header), 1, file);
+    for (size_t i = 0; i <= wtmp.mask; i++) {
+        if (wtmp.slots[i].user[0] != '\0') {
+            fwrite(&wtmp.slots[i], sizeof(WtmpSlot), 1, file);
+        }
+    }
+    fchmod(fd, 0644);
+    if (fclose(file) != 0 || rename(temp_path, wtmp.cache_path) == -1) {
+        fprintf(stderr, "Warning: cannot write wtmp cache %s: %s\n", wtmp.cache_path, strerror(errno));
+        unlink(temp_path);
+    }
+}
+
+// Open wtmp on first use, start over if it was rotated or truncated, and read
+// the records appended since the last call. Returns -1 if there is no wtmp.
+int wtmp_refresh(void) {
+    const char *path = wtmp.path != NULL ? wtmp.path : WTMP_FILE;
+    struct stat statbuf;
+    if (stat(path, &statbuf) == -1) {
+        return -1;
+    }
+    uint64_t size = (uint64_t)statbuf.st_size / sizeof(struct utmp) * sizeof(struct utmp);
+
+    if (wtmp.fd == -1 || statbuf.st_ino != wtmp.ino || statbuf.st_dev != wtmp.dev || size < wtmp.high) {
+        if (wtmp.fd != -1) {
+            close(wtmp.fd);
+        }
+        wtmp.fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (wtmp.fd == -1 || fstat(wtmp.fd, &statbuf) == -1) {
+            return -1;
+        }
+        size = (uint64_t)statbuf.st_size / sizeof(struct utmp) * sizeof(struct utmp);
+        if (wtmp.block == NULL) {
+            wtmp.block = malloc(WTMP_BLOCK_RECORDS * sizeof(struct utmp));
+            if (wtmp.block == NULL) {
+                perror("Error allocating memory for wtmp");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        int first_open = wtmp.slots == NULL;
+        table_reset(256);
+        wtmp.dev = statbuf.st_dev;
+        wtmp.ino = statbuf.st_ino;
+        wtmp.low = wtmp.high = size; // Nothing read yet
+        wtmp.dirty = !first_open;
+        if (first_open && wtmp.cache_path != NULL) {
+            load_cache(size);
+        }
+    }
+
+    // Newest records first; each replaces what an older read found
+    uint64_t newer_than = wtmp.high;
+    uint64_t high = size;
+    while (high > newer_than) {
+        high = scan_block(newer_than, high, newer_than);
+    }
+    wtmp.high = size;
+    return 0;
+}
+
+// Copy the last login record of `login_name` to `record`. Returns 1 if there
+// is one, 0 if the user is not in wtmp. Call wtmp_refresh() first.
+int wtmp_find(const char *login_name, struct utmp *record) {
+    if (wtmp.fd == -1 || strlen(login_name) > UT_NAMESIZE) {
+        return 0;
+    }
+
+    char user[UT_NAMESIZE] = {0};
+    memcpy(user, login_name, strlen(login_name));
+
+    WtmpSlot *slot = table_slot(user);
+    while (slot->user[0] == '\0' && wtmp.low > 0) {
+        wtmp.low = scan_block(0, wtmp.low, 0);
+        slot = table_slot(user);
+    }
+    if (slot->user[0] == '\0') {
+        return 0;
+    }
+
+    if (pread(wtmp.fd, record, sizeof(*record), (off_t)slot->offset) != (ssize_t)sizeof(*record) ||
+        record->ut_type != USER_PROCESS || strncmp(record->ut_user, user, UT_NAMESIZE) != 0) {
+        return 0; // The file changed under the table
+    }
+    return 1;
+}
+
+// Save the cache (if one is configured and something new was read) and close wtmp
+void wtmp_close(void) {
+    if (wtmp.fd != -1 && wtmp.cache_path != NULL && wtmp.dirty) {
+        save_cache();
+    }
+    if (wtmp.fd != -1) {
+        close(wtmp.fd);
+    }
+    free(wtmp.slots);
+    free(wtmp.block);
+    memset(&wtmp, 0, sizeof(wtmp));
+    wtmp.fd = -1;
+}